@@ -0,0 +1,314 @@
+// Benchmark for parsing expressions. It generates a script of random nested
+// arithmetic, comparison, equality and unary expressions, scans it once and
+// times parsing its tokens two ways: with the precedence climbing parser in
+// src/parser.c, and with the recursive descent through every precedence
+// level that it replaced, kept here as it was. Both build the same nodes.
+// Run with 'make bench'.
+#include "../src/parser.c" // the parser's state and helpers are static
+#include "scanner.h"
+#include <time.h>
+
+#define SCRIPT_SIZE (8 * 1024 * 1024)
+#define MAX_DEPTH 6
+#define ROUNDS 5
+
+static const char *names[] = {"x", "y", "total", "count", "rate"};
+static const char *operators[] = {"+", "-",  "*", "/",  "<",
+                                  "<=", ">", ">=", "==", "!="};
+#define COUNT(array) (int)(sizeof(array) / sizeof(array[0]))
+
+typedef struct {
+  char *chars;
+  int length;
+  int capacity;
+} Text;
+
+static void append(Text *text, const char *chars) {
+  int length = (int)strlen(chars);
+  if (text->length + length > text->capacity) {
+    text->capacity = (text->length + length) * 2;
+    text->chars = realloc(text->chars, text->capacity);
+    if (text->chars == NULL) {
+      printf("Cannot allocate memory for the script");
+      exit(1);
+    }
+  }
+  memcpy(text->chars + text->length, chars, length);
+  text->length += length;
+}
+
+static void generate_expression(Text *text, int depth) {
+  int choice = depth == 0 ? 0 : rand() % 8;
+  if (choice <= 1) {
+    char number[16];
+    snprintf(number, sizeof(number), "%d", rand() % 1000);
+    append(text, rand() % 2 == 0 ? number : names[rand() % COUNT(names)]);
+  } else if (choice == 2) {
+    append(text, rand() % 2 == 0 ? "-" : "!");
+    generate_expression(text, depth - 1);
+  } else if (choice == 3) {
+    append(text, "(");
+    generate_expression(text, depth - 1);
+    append(text, ")");
+  } else {
+    generate_expression(text, depth - 1);
+    append(text, " ");
+    append(text, operators[rand() % COUNT(operators)]);
+    append(text, " ");
+    generate_expression(text, depth - 1);
+  }
+}
+
+// The expression parser before the rules table, as it was in parser.c: a
+// function per precedence level, each matching its operators through
+// check(), peek() and a bounds-checked tokenlist_get().
+static Token *descent_peek(Parser *p) {
+  return tokenlist_get(p->tokens, p->current);
+}
+
+static Token *descent_previous(Parser *p) {
+  return tokenlist_get(p->tokens, p->current - 1);
+}
+
+static bool descent_check(Parser *p, TokenType type) {
+  return descent_peek(p)->type == type;
+}
+
+static Token *descent_advance(Parser *p) {
+  if (descent_peek(p)->type != END_OF_FILE) {
+    p->current += 1;
+  }
+  return descent_previous(p);
+}
+
+static bool match2(Parser *p, TokenType type1, TokenType type2) {
+  if (descent_check(p, type1) || descent_check(p, type2)) {
+    descent_advance(p);
+    return true;
+  } else {
+    return false;
+  }
+}
+
+static bool match4(Parser *p, TokenType type1, TokenType type2,
+                   TokenType type3, TokenType type4) {
+  if (descent_check(p, type1) || descent_check(p, type2) ||
+      descent_check(p, type3) || descent_check(p, type4)) {
+    descent_advance(p);
+    return true;
+  } else {
+    return false;
+  }
+}
+
+static bool descent_match1(Parser *p, TokenType type) {
+  if (descent_check(p, type)) {
+    descent_advance(p);
+    return true;
+  } else {
+    return false;
+  }
+}
+
+static NodeIndex descent_expression(Parser *p);
+
+static NodeIndex descent_binary(Parser *p, NodeIndex left, Token *operator,
+                                NodeIndex right) {
+  Node binary = {.kind = BINARY_EXPR, .op = operator->type};
+  binary.as.binary.left = left;
+  binary.as.binary.right = right;
+  return add_node(p, binary);
+}
+
+static NodeIndex primary(Parser *p) {
+  if (descent_match1(p, FALSE)) {
+    return literal(p, ast_add_constant(p->ast, bool_value(false)));
+  }
+  if (descent_match1(p, TRUE)) {
+    return literal(p, ast_add_constant(p->ast, bool_value(true)));
+  }
+  if (descent_match1(p, NIL)) {
+    return literal(p, NIL_CONSTANT);
+  }
+  if (descent_check(p, NUMBER)) {
+    descent_advance(p);
+    Value value = number_value(token_number(descent_previous(p)));
+    return literal(p, ast_add_constant(p->ast, value));
+  }
+  if (descent_check(p, STRING)) {
+    descent_advance(p);
+    Value value = string_value(descent_previous(p)->symbol);
+    return literal(p, ast_add_constant(p->ast, value));
+  }
+  if (descent_match1(p, IDENTIFIER)) {
+    Node var = {.kind = VARIABLE_EXPR};
+    var.as.variable.name = add_name(p, descent_previous(p)->symbol);
+    return add_node(p, var);
+  }
+  if (descent_match1(p, LEFT_PAREN)) {
+    NodeIndex expr = descent_expression(p);
+    consume(p, RIGHT_PAREN, "Expect ')' after expression.");
+    Node group = {.kind = GROUP_EXPR};
+    group.as.group.expression = expr;
+    return add_node(p, group);
+  }
+
+  Node error = {.kind = ERROR_EXPR};
+  return add_node(p, error);
+}
+
+static NodeIndex descent_unary(Parser *p) {
+  if (match2(p, BANG, MINUS)) {
+    Token *operator = descent_previous(p);
+    NodeIndex right = descent_unary(p);
+    Node unary = {.kind = UNARY_EXPR, .op = operator->type};
+    unary.as.unary.right = right;
+    return add_node(p, unary);
+  }
+  return primary(p);
+}
+
+static NodeIndex factor(Parser *p) {
+  NodeIndex expr = descent_unary(p);
+  while (match2(p, SLASH, STAR)) {
+    Token *operator = descent_previous(p);
+    NodeIndex right = descent_unary(p);
+    expr = descent_binary(p, expr, operator, right);
+  }
+  return expr;
+}
+
+static NodeIndex term(Parser *p) {
+  NodeIndex expr = factor(p);
+  while (match2(p, MINUS, PLUS)) {
+    Token *operator = descent_previous(p);
+    NodeIndex right = factor(p);
+    expr = descent_binary(p, expr, operator, right);
+  }
+  return expr;
+}
+
+static NodeIndex comparison(Parser *p) {
+  NodeIndex expr = term(p);
+  while (match4(p, GREATER, GREATER_EQUAL, LESS, LESS_EQUAL)) {
+    Token *operator = descent_previous(p);
+    NodeIndex right = term(p);
+    expr = descent_binary(p, expr, operator, right);
+  }
+  return expr;
+}
+
+static NodeIndex equality(Parser *p) {
+  NodeIndex expr = comparison(p);
+  while (match2(p, BANG_EQUAL, EQUAL_EQUAL)) {
+    Token *operator = descent_previous(p);
+    NodeIndex right = comparison(p);
+    expr = descent_binary(p, expr, operator, right);
+  }
+  return expr;
+}
+
+static NodeIndex descent_assignment(Parser *p) {
+  NodeIndex expr = equality(p);
+  if (descent_match1(p, EQUAL)) {
+    Token *equals = descent_previous(p);
+    NodeIndex value = descent_assignment(p);
+    const Node *target = ast_node(p->ast, expr);
+    if (target->kind == VARIABLE_EXPR) {
+      Node assign = {.kind = ASSIGN_STMT};
+      assign.as.assign.name = target->as.variable.name;
+      assign.as.assign.value = value;
+      return add_node(p, assign);
+    }
+    Node error = {.kind = ERROR_EXPR, .op = equals->type};
+    return add_node(p, error);
+  }
+  return expr;
+}
+
+static NodeIndex descent_expression(Parser *p) {
+  return descent_assignment(p);
+}
+
+// Parses the script's print statements with the given expression parser,
+// the way parse() does.
+static Ast *parse_prints(TokenList *tokens, Arena *arena,
+                         NodeIndex (*parse_expression)(Parser *p)) {
+  Ast *ast = arena_alloc(arena, sizeof(Ast));
+  memset(ast, 0, sizeof(Ast));
+  ast->arena = arena;
+  Parser parser = {.tokens = tokens, .ast = ast, .out = stderr};
+  Parser *p = &parser;
+  while (!is_at_end(p)) {
+    consume(p, PRINT, "Expected print");
+    Node print = {.kind = PRINT_STMT};
+    print.as.group.expression = parse_expression(p);
+    consume(p, SEMICOLON, "Expected semicolon");
+    push_pending(p, add_node(p, print));
+  }
+  ast->statement_count = p->pending_count;
+  ast->first_statement = pop_pending(p, 0);
+  free(parser.pending);
+  return ast;
+}
+
+static double seconds(void) {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Returns the best time of ROUNDS, and in arena the last round's AST.
+static double time_parser(TokenList *tokens, Arena *arena, Ast **ast,
+                          NodeIndex (*parse_expression)(Parser *p)) {
+  double best = 0;
+  for (int round = 0; round < ROUNDS; round++) {
+    if (round > 0) {
+      arena_free(arena);
+    }
+    arena_init(arena);
+    double start = seconds();
+    *ast = parse_prints(tokens, arena, parse_expression);
+    double elapsed = seconds() - start;
+    if (round == 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  return best;
+}
+
+int main(void) {
+  Text script = {NULL, 0, 0};
+  srand(1);
+  while (script.length < SCRIPT_SIZE) {
+    append(&script, "print ");
+    generate_expression(&script, MAX_DEPTH);
+    append(&script, ";\n");
+  }
+  ScanResult scanned = scan_tokens(script.chars, script.length, stderr);
+
+  Arena arenas[2];
+  Ast *pratt;
+  Ast *descent;
+  double after = time_parser(&scanned.token_list, &arenas[0], &pratt,
+                             expression);
+  double before = time_parser(&scanned.token_list, &arenas[1], &descent,
+                              descent_expression);
+
+  printf("parse expressions, %.1f MB, %u nodes, best of %d:\n",
+         script.length / (1024.0 * 1024.0), pratt->node_count, ROUNDS);
+  printf("  recursive descent   %7.3f s\n", before);
+  printf("  precedence climbing %7.3f s\n", after);
+  bool same = pratt->node_count == descent->node_count &&
+              memcmp(pratt->nodes, descent->nodes,
+                     sizeof(Node) * pratt->node_count) == 0;
+  arena_free(&arenas[0]);
+  arena_free(&arenas[1]);
+  tokenlist_free(&scanned.token_list);
+  free(script.chars);
+  if (!same) {
+    fprintf(stderr, "the parsers built different nodes\n");
+    return 1;
+  }
+  return 0;
+}
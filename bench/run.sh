@@ -0,0 +1,15 @@
+#!/bin/bash
+# Times each benchmark script on the tree walker with and without --jit,
+# and on the vm for comparison. Build lox optimized first for numbers that
+# mean something, e.g. make CC='clang -c -std=c17 -O2'.
+# Usage: bench/run.sh [lox binary]
+lox=${1:-./target/lox}
+dir=$(dirname "$0")
+TIMEFORMAT=%R
+for script in "$dir"/*.lox; do
+  echo "$(basename "$script"):"
+  for options in "--engine=tree" "--engine=tree --jit" "--engine=vm"; do
+    seconds=$({ time "$lox" $options "$script" >/dev/null; } 2>&1)
+    printf "  %-22s %6.2f s\n" "$options" "$seconds"
+  done
+done
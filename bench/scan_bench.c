@@ -0,0 +1,85 @@
+// Benchmark for loading and scanning large scripts. It generates scripts of
+// a few sizes from the same mix of declarations, loops, calls, strings and
+// comments, and times source_load() plus scan_tokens() on each. Both are
+// linear in the size of the script, so the time per MB stays flat as the
+// scripts grow; before, the loader's realloc+strcat and the scanner's
+// strlen() per character made it grow with the size. Run with 'make bench'.
+// Usage: scan_bench [directory for the generated scripts]
+#include "scanner.h"
+#include "source.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MB (1024 * 1024)
+#define ROUNDS 3
+
+static const int sizes[] = {5, 20, 50}; // MB
+
+static const char *chunk =
+    "// sums the first n squares\n"
+    "fun squares(n) {\n"
+    "  var total = 0;\n"
+    "  for (var i = 1; i <= n; i = i + 1) {\n"
+    "    total = total + i * i;\n"
+    "  }\n"
+    "  return total;\n"
+    "}\n"
+    "class Point {\n"
+    "  init(x, y) { this.x = x; this.y = y; }\n"
+    "  sum() { return this.x + this.y; }\n"
+    "}\n"
+    "var label = \"the sum of the squares up to 10\";\n"
+    "print label;\n"
+    "print squares(10) + Point(1.5, 2.25).sum();\n";
+
+static double seconds(void) {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Writes a script of at least size bytes to path.
+static void generate(const char *path, long size) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "unable to write '%s'\n", path);
+    exit(1);
+  }
+  for (long written = 0; written < size;) {
+    written += fprintf(file, "%s", chunk);
+  }
+  fclose(file);
+}
+
+int main(int argc, char *argv[]) {
+  const char *dir = argc > 1 ? argv[1] : ".";
+  printf("load and scan, best of %d:\n", ROUNDS);
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/scan_bench_%dMB.lox", dir, sizes[i]);
+    generate(path, (long)sizes[i] * MB);
+
+    double best = 0;
+    int tokens = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+      double start = seconds();
+      Source source;
+      if (!source_load(&source, path, stderr)) {
+        return 1;
+      }
+      ScanResult result = scan_tokens(source.text, (int)source.length, stderr);
+      double elapsed = seconds() - start;
+      tokens = result.token_list.size;
+      tokenlist_free(&result.token_list);
+      source_free(&source);
+      if (round == 0 || elapsed < best) {
+        best = elapsed;
+      }
+    }
+    remove(path);
+    printf("  %3d MB  %9d tokens  %7.3f s  %6.1f ms/MB\n", sizes[i], tokens,
+           best, best * 1000 / sizes[i]);
+  }
+  return 0;
+}
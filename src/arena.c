@@ -0,0 +1,95 @@
+#include "arena.h"
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (64 * 1024)
+#define ALIGNMENT alignof(max_align_t)
+
+struct ArenaBlock {
+  ArenaBlock *previous;
+  size_t capacity;
+  size_t used;
+  alignas(max_align_t) char data[];
+};
+
+static ArenaBlock *new_block(size_t capacity, ArenaBlock *previous) {
+  ArenaBlock *block = malloc(sizeof(ArenaBlock) + capacity);
+  if (block == NULL) {
+    printf("can't allocate memory for Arena");
+    exit(1);
+  }
+  block->previous = previous;
+  block->capacity = capacity;
+  block->used = 0;
+  return block;
+}
+
+void arena_init(Arena *arena) {
+  arena->head = NULL;
+  arena->spare = NULL;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+  size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+  ArenaBlock *block = arena->head;
+  if (block == NULL || block->capacity - block->used < size) {
+    if (arena->spare != NULL && arena->spare->capacity >= size) {
+      block = arena->spare;
+      arena->spare = NULL;
+      block->previous = arena->head;
+      block->used = 0;
+    } else {
+      block = new_block(size > BLOCK_SIZE ? size : BLOCK_SIZE, arena->head);
+    }
+    arena->head = block;
+  }
+
+  void *memory = block->data + block->used;
+  block->used += size;
+  return memory;
+}
+
+ArenaMark arena_mark(Arena *arena) {
+  ArenaMark mark = {arena->head, arena->head == NULL ? 0 : arena->head->used};
+  return mark;
+}
+
+void arena_release(Arena *arena, ArenaMark mark) {
+  while (arena->head != mark.block) {
+    ArenaBlock *block = arena->head;
+    arena->head = block->previous;
+    if (arena->spare == NULL || arena->spare->capacity < block->capacity) {
+      free(arena->spare);
+      arena->spare = block;
+    } else {
+      free(block);
+    }
+  }
+  if (arena->head != NULL) {
+    arena->head->used = mark.used;
+  }
+}
+
+void arena_free(Arena *arena) {
+  ArenaMark start = {NULL, 0};
+  arena_release(arena, start);
+  free(arena->spare);
+  arena->spare = NULL;
+}
+
+void *arena_grow(Arena *arena, void *array, uint32_t count, uint32_t *capacity,
+                 size_t size) {
+  if (count < *capacity) {
+    return array;
+  }
+  uint32_t grown = *capacity == 0 ? 16 : *capacity * 2;
+  void *copy = arena_alloc(arena, size * grown);
+  if (count > 0) {
+    memcpy(copy, array, size * count);
+  }
+  *capacity = grown;
+  return copy;
+}
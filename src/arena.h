@@ -0,0 +1,40 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Region allocator: allocation is a pointer bump into the current block and
+// everything is released at once. A run uses one arena for its AST and
+// literals.
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+  ArenaBlock *head;  // block being allocated from
+  ArenaBlock *spare; // kept by arena_release to avoid malloc churn
+} Arena;
+
+// A position to roll back to with arena_release.
+typedef struct {
+  ArenaBlock *block;
+  size_t used;
+} ArenaMark;
+
+void arena_init(Arena *arena);
+
+// Never returns NULL: exits when out of memory, like the other allocators.
+void *arena_alloc(Arena *arena, size_t size);
+
+// Makes room for one more element in an array of count elements of size
+// bytes that lives in arena, doubling capacity when it is full. Returns the
+// array to use from now on; the old one stays in the arena until released.
+void *arena_grow(Arena *arena, void *array, uint32_t count, uint32_t *capacity,
+                 size_t size);
+
+ArenaMark arena_mark(Arena *arena);
+
+// Frees everything allocated after mark was taken.
+void arena_release(Arena *arena, ArenaMark mark);
+
+void arena_free(Arena *arena);
+#endif
@@ -0,0 +1,136 @@
+// open_memstream is POSIX, hidden by a strict -std=c17
+#define _DEFAULT_SOURCE
+
+#include "batch.h"
+#include "runner.h"
+#include "source.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+  char *filename;
+  const RunOptions *options;
+  char *output; // captured by open_memstream
+  size_t output_length;
+  bool ok;
+  bool done;
+} Job;
+
+typedef struct {
+  Job *jobs;
+  int count;
+  int next; // index of the next job to hand out
+  pthread_mutex_t lock;
+  pthread_cond_t job_done;
+} Batch;
+
+static void run_job(Job *job) {
+  FILE *out = open_memstream(&job->output, &job->output_length);
+  if (out == NULL) {
+    job->output = NULL;
+    job->output_length = 0;
+    job->ok = false;
+    return;
+  }
+
+  Source source;
+  job->ok = source_load(&source, job->filename, out);
+  if (job->ok && source.length > INT_MAX) {
+    fprintf(out, "file '%s' is too large\n", job->filename);
+    source_free(&source);
+    job->ok = false;
+  }
+  if (job->ok) {
+    VarMap *environment = newVarMap(NULL);
+    job->ok = run_script(environment, source.text, (int)source.length,
+                         job->options, out);
+    freeVarMap(environment);
+    source_free(&source);
+  }
+  fclose(out);
+}
+
+static void *worker(void *arg) {
+  Batch *batch = arg;
+  for (;;) {
+    pthread_mutex_lock(&batch->lock);
+    int index = batch->next++;
+    pthread_mutex_unlock(&batch->lock);
+    if (index >= batch->count) {
+      return NULL;
+    }
+
+    run_job(&batch->jobs[index]);
+
+    pthread_mutex_lock(&batch->lock);
+    batch->jobs[index].done = true;
+    pthread_cond_broadcast(&batch->job_done);
+    pthread_mutex_unlock(&batch->lock);
+  }
+}
+
+int run_batch(int jobs, char **files, int count, const RunOptions *options) {
+  Batch batch;
+  batch.jobs = calloc(count, sizeof(Job));
+  if (batch.jobs == NULL) {
+    puts("Out of memory");
+    return EXIT_FAILURE;
+  }
+  for (int i = 0; i < count; i++) {
+    batch.jobs[i].filename = files[i];
+    batch.jobs[i].options = options;
+  }
+  batch.count = count;
+  batch.next = 0;
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.job_done, NULL);
+
+  if (jobs > count) {
+    jobs = count;
+  }
+  pthread_t *threads = malloc(sizeof(pthread_t) * jobs);
+  if (threads == NULL) {
+    puts("Out of memory");
+    return EXIT_FAILURE;
+  }
+  int started = 0;
+  for (; started < jobs; started++) {
+    if (pthread_create(&threads[started], NULL, worker, &batch) != 0) {
+      break;
+    }
+  }
+  if (started == 0) {
+    // no threads available, run the batch on this one
+    worker(&batch);
+  }
+
+  int status = EXIT_SUCCESS;
+  for (int i = 0; i < count; i++) {
+    Job *job = &batch.jobs[i];
+    pthread_mutex_lock(&batch.lock);
+    while (!job->done) {
+      pthread_cond_wait(&batch.job_done, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+
+    if (job->output != NULL) {
+      fwrite(job->output, 1, job->output_length, stdout);
+      free(job->output);
+    }
+    if (!job->ok) {
+      status = EXIT_FAILURE;
+    }
+  }
+
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  pthread_cond_destroy(&batch.job_done);
+  pthread_mutex_destroy(&batch.lock);
+  free(batch.jobs);
+  return status;
+}
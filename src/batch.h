@@ -0,0 +1,11 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "runner.h"
+
+// Runs count scripts on a pool of jobs worker threads. Every script gets its
+// own global environment and output buffer; the buffers are written to stdout
+// in the order the scripts were given, each as soon as it and all scripts
+// before it have finished. Returns EXIT_FAILURE if any script failed.
+int run_batch(int jobs, char **files, int count, const RunOptions *options);
+#endif
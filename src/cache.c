@@ -0,0 +1,481 @@
+// mmap and friends are POSIX, hidden by a strict -std=c17
+#define _DEFAULT_SOURCE
+
+#include "cache.h"
+#include "intern.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bump when the file layout changes. Changes to Node or Value are caught by
+// the sizes in the header as well.
+#define CACHE_VERSION 5
+#define CACHE_MAGIC 0x43584f4c // "LOXC"
+
+// The file is the header followed by the constants, names, nodes, functions
+// and lists arrays as they are in memory, then the strings. The arrays are in
+// order of alignment, so each one is aligned when the mapping is. String
+// pointers in constants and names are stored as offsets in the strings.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t node_size;
+  uint32_t value_size;
+  uint64_t source_hash;
+  uint64_t source_length;
+  uint64_t checksum; // of everything after the header
+  uint32_t node_count;
+  uint32_t constant_count;
+  uint32_t name_count;
+  uint32_t list_count;
+  uint32_t function_count;
+  uint32_t first_statement;
+  uint32_t statement_count;
+  uint64_t string_bytes;
+} CacheHeader;
+
+_Static_assert(sizeof(CacheHeader) % _Alignof(Value) == 0 &&
+                   sizeof(Node) % _Alignof(Function) == 0,
+               "a cache file section would be misaligned");
+
+static uint64_t fnv1a(const void *bytes, size_t length) {
+  const unsigned char *p = bytes;
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= p[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static char *cache_path(const char *dir, uint64_t hash) {
+  size_t length = strlen(dir) + 32;
+  char *path = malloc(length);
+  if (path != NULL) {
+    snprintf(path, length, "%s/%016llx.loxc", dir, (unsigned long long)hash);
+  }
+  return path;
+}
+
+static size_t sections_size(const CacheHeader *h) {
+  return sizeof(Value) * h->constant_count +
+         sizeof(const char *) * h->name_count + sizeof(Node) * h->node_count +
+         sizeof(NodeIndex) * h->list_count +
+         sizeof(Function) * h->function_count;
+}
+
+static bool valid_string(const CacheHeader *h, uint64_t offset) {
+  return offset < h->string_bytes;
+}
+
+// Children are stored before their parents, so every node a node refers
+// to, directly or in a list, has a lower index than its own. Checking that
+// is what keeps a file from making the engines loop or recurse forever.
+static bool below(NodeIndex child, NodeIndex parent) { return child < parent; }
+
+static bool below_or_none(NodeIndex child, NodeIndex parent) {
+  return child == NO_NODE || child < parent;
+}
+
+static bool valid_list(const Ast *ast, uint32_t first, uint32_t count,
+                       NodeIndex owner) {
+  if (first > ast->list_count || count > ast->list_count - first) {
+    return false;
+  }
+  for (uint32_t i = first; i < first + count; i++) {
+    if (ast->lists[i] >= owner) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool has_kind(const Ast *ast, NodeIndex index, NodeKind kind) {
+  return ast->nodes[index].kind == kind;
+}
+
+// The engines take a function's first arity entries to be its parameters.
+static bool valid_function(const Ast *ast, uint32_t index, NodeIndex owner) {
+  if (index >= ast->function_count) {
+    return false;
+  }
+  const Function *function = &ast->functions[index];
+  if (function->name >= ast->name_count ||
+      !valid_list(ast, function->first, function->count, owner) ||
+      function->arity > function->count) {
+    return false;
+  }
+  for (uint32_t i = 0; i < function->arity; i++) {
+    if (!has_kind(ast, ast->lists[function->first + i], VARIABLE_STMT)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// A class's members are its methods, after the declaration of 'super' of a
+// subclass, which the resolver looks into for the superclass's name.
+static bool valid_class(const Ast *ast, const Node *node, NodeIndex index) {
+  uint32_t first = node->as.klass.first;
+  uint32_t count = node->as.klass.count;
+  if (node->as.klass.name >= ast->name_count ||
+      !valid_list(ast, first, count, index)) {
+    return false;
+  }
+  uint32_t i = 0;
+  if (node->op & CLASS_SUBCLASS) {
+    if (count == 0 || !has_kind(ast, ast->lists[first], VARIABLE_STMT)) {
+      return false;
+    }
+    NodeIndex superclass = ast->nodes[ast->lists[first]].as.assign.value;
+    if (superclass == NO_NODE ||
+        !has_kind(ast, superclass, VARIABLE_EXPR)) {
+      return false;
+    }
+    i = 1;
+  }
+  for (; i < count; i++) {
+    if (!has_kind(ast, ast->lists[first + i], FUNCTION_EXPR)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool valid_node(const Ast *ast, NodeIndex index) {
+  const Node *node = &ast->nodes[index];
+  switch (node->kind) {
+  case BINARY_EXPR:
+    // deopts is the tree walker's and 0 when stored; any count only makes
+    // the node quicken fewer times, so it needs no check
+    return below(node->as.binary.left, index) &&
+           below(node->as.binary.right, index);
+  case UNARY_EXPR:
+    return below(node->as.unary.right, index);
+  case LITERAL_EXPR:
+    return node->as.literal.constant < ast->constant_count ||
+           node->as.literal.constant == NIL_CONSTANT;
+  case GROUP_EXPR:
+  case EXPR_STMT:
+  case PRINT_STMT:
+    return below(node->as.group.expression, index);
+  case VARIABLE_EXPR:
+    return node->as.variable.name < ast->name_count;
+  case ASSIGN_STMT:
+  case VARIABLE_STMT:
+    return node->as.assign.name < ast->name_count &&
+           below_or_none(node->as.assign.value, index);
+  case BLOCK_STMT:
+    return valid_list(ast, node->as.block.first, node->as.block.count, index);
+  case WHILE_STMT:
+    return below_or_none(node->as.loop.condition, index) &&
+           below(node->as.loop.body, index) &&
+           below_or_none(node->as.loop.increment, index);
+  case FUNCTION_EXPR:
+    return valid_function(ast, node->as.function.index, index);
+  case CALL_EXPR:
+    return below(node->as.call.callee, index) &&
+           valid_list(ast, node->as.call.first, node->as.call.count, index);
+  case RETURN_STMT:
+    return below_or_none(node->as.group.expression, index);
+  case CLASS_EXPR:
+    return valid_class(ast, node, index);
+  case GET_EXPR:
+    return below(node->as.property.object, index) &&
+           node->as.property.name < ast->name_count;
+  case SET_EXPR:
+    return below(node->as.set.target, index) &&
+           has_kind(ast, node->as.set.target, GET_EXPR) &&
+           below(node->as.set.value, index);
+  case SUPER_EXPR:
+    return below(node->as.super.superclass, index) &&
+           below(node->as.super.receiver, index) &&
+           node->as.super.name < ast->name_count;
+  case ERROR_EXPR:
+    return true;
+  default:
+    return false;
+  }
+}
+
+Ast *cache_load(const char *dir, const char *source, int length, Arena *arena,
+                CacheFile *file) {
+  file->mapping = NULL;
+  file->size = 0;
+  uint64_t source_hash = fnv1a(source, length);
+  char *path = cache_path(dir, source_hash);
+  if (path == NULL) {
+    return NULL;
+  }
+  int fd = open(path, O_RDONLY);
+  free(path);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+    close(fd);
+    return NULL;
+  }
+  size_t size = st.st_size;
+  // private, so that fixing up pointers and resolving don't write the file
+  char *mapping =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+
+  const CacheHeader *h = (const CacheHeader *)mapping;
+  char *sections = mapping + sizeof(CacheHeader);
+  if (h->magic != CACHE_MAGIC || h->version != CACHE_VERSION ||
+      h->node_size != sizeof(Node) || h->value_size != sizeof(Value) ||
+      h->source_hash != source_hash || h->source_length != (size_t)length ||
+      size - sizeof(CacheHeader) < sections_size(h) ||
+      size - sizeof(CacheHeader) - sections_size(h) != h->string_bytes ||
+      h->first_statement > h->list_count ||
+      h->statement_count > h->list_count - h->first_statement ||
+      fnv1a(sections, size - sizeof(CacheHeader)) != h->checksum) {
+    munmap(mapping, size);
+    return NULL;
+  }
+
+  Value *constants = (Value *)sections;
+  const char **names = (const char **)(constants + h->constant_count);
+  Node *nodes = (Node *)(names + h->name_count);
+  Function *functions = (Function *)(nodes + h->node_count);
+  NodeIndex *lists = (NodeIndex *)(functions + h->function_count);
+  const char *strings = (const char *)(lists + h->list_count);
+  if (h->string_bytes > 0 && strings[h->string_bytes - 1] != '\0') {
+    munmap(mapping, size);
+    return NULL;
+  }
+  // the sections as they will be used, for checking them first
+  Ast view = {.nodes = nodes,
+              .node_count = h->node_count,
+              .constant_count = h->constant_count,
+              .name_count = h->name_count,
+              .lists = lists,
+              .list_count = h->list_count,
+              .functions = functions,
+              .function_count = h->function_count};
+  bool valid = valid_list(&view, h->first_statement, h->statement_count,
+                          h->node_count);
+  for (uint32_t i = 0; i < h->node_count && valid; i++) {
+    valid = valid_node(&view, i);
+  }
+  for (uint32_t i = 0; i < h->constant_count && valid; i++) {
+    valid = is_number(constants[i]) || is_bool(constants[i]) ||
+            (is_obj(constants[i]) &&
+             valid_string(h, (uintptr_t)as_obj(constants[i])));
+  }
+  for (uint32_t i = 0; i < h->name_count && valid; i++) {
+    valid = valid_string(h, (uintptr_t)names[i]);
+  }
+  if (!valid) {
+    munmap(mapping, size);
+    return NULL;
+  }
+
+  // offsets back to pointers; interning makes them comparable again
+  for (uint32_t i = 0; i < h->constant_count; i++) {
+    if (is_obj(constants[i])) {
+      const char *string = strings + (uintptr_t)as_obj(constants[i]);
+      constants[i] = string_value(intern(string, (int)strlen(string)));
+    }
+  }
+  for (uint32_t i = 0; i < h->name_count; i++) {
+    const char *name = strings + (uintptr_t)names[i];
+    names[i] = intern(name, (int)strlen(name));
+  }
+
+  Ast *ast = arena_alloc(arena, sizeof(Ast));
+  memset(ast, 0, sizeof(Ast));
+  ast->arena = arena;
+  // capacities equal to the counts make growing copy into the arena
+  ast->nodes = nodes;
+  ast->node_count = ast->node_capacity = h->node_count;
+  ast->constants = constants;
+  ast->constant_count = ast->constant_capacity = h->constant_count;
+  ast->names = names;
+  ast->name_count = ast->name_capacity = h->name_count;
+  ast->lists = lists;
+  ast->list_count = ast->list_capacity = h->list_count;
+  ast->functions = functions;
+  ast->function_count = ast->function_capacity = h->function_count;
+  ast->first_statement = h->first_statement;
+  ast->statement_count = h->statement_count;
+
+  file->mapping = mapping;
+  file->size = size;
+  return ast;
+}
+
+void cache_close(CacheFile *file) {
+  if (file->mapping != NULL) {
+    munmap(file->mapping, file->size);
+    file->mapping = NULL;
+  }
+}
+
+// The strings section, each interned string once.
+typedef struct {
+  const char **keys; // open addressing on the interned pointer
+  uint64_t *offsets;
+  uint32_t mask;
+  char *bytes;
+  uint64_t length;
+  uint64_t capacity;
+} Strings;
+
+static bool strings_init(Strings *s, uint32_t count) {
+  uint32_t capacity = 16;
+  while (capacity < count * 2) {
+    capacity *= 2;
+  }
+  s->keys = calloc(capacity, sizeof(const char *));
+  s->offsets = malloc(sizeof(uint64_t) * capacity);
+  s->mask = capacity - 1;
+  s->bytes = NULL;
+  s->length = 0;
+  s->capacity = 0;
+  return s->keys != NULL && s->offsets != NULL;
+}
+
+static void strings_free(Strings *s) {
+  free(s->keys);
+  free(s->offsets);
+  free(s->bytes);
+}
+
+// Returns the offset of string in the section, or UINT64_MAX when out of
+// memory.
+static uint64_t string_offset(Strings *s, const char *string) {
+  uint32_t slot = intern_hash(string) & s->mask;
+  while (s->keys[slot] != NULL && s->keys[slot] != string) {
+    slot = (slot + 1) & s->mask;
+  }
+  if (s->keys[slot] == string) {
+    return s->offsets[slot];
+  }
+  uint64_t length = intern_length(string) + 1;
+  if (s->length + length > s->capacity) {
+    uint64_t capacity = s->capacity == 0 ? 4096 : s->capacity * 2;
+    while (capacity < s->length + length) {
+      capacity *= 2;
+    }
+    char *bytes = realloc(s->bytes, capacity);
+    if (bytes == NULL) {
+      return UINT64_MAX;
+    }
+    s->bytes = bytes;
+    s->capacity = capacity;
+  }
+  memcpy(s->bytes + s->length, string, length);
+  s->keys[slot] = string;
+  s->offsets[slot] = s->length;
+  s->length += length;
+  return s->offsets[slot];
+}
+
+void cache_store(const char *dir, const char *source, int length,
+                 const Ast *ast) {
+  CacheHeader h;
+  memset(&h, 0, sizeof(h));
+  h.magic = CACHE_MAGIC;
+  h.version = CACHE_VERSION;
+  h.node_size = sizeof(Node);
+  h.value_size = sizeof(Value);
+  h.source_hash = fnv1a(source, length);
+  h.source_length = length;
+  h.node_count = ast->node_count;
+  h.constant_count = ast->constant_count;
+  h.name_count = ast->name_count;
+  h.list_count = ast->list_count;
+  h.function_count = ast->function_count;
+  h.first_statement = ast->first_statement;
+  h.statement_count = ast->statement_count;
+
+  Strings strings;
+  size_t size = sizeof(CacheHeader) + sections_size(&h);
+  char *image = malloc(size);
+  if (image == NULL ||
+      !strings_init(&strings, ast->constant_count + ast->name_count)) {
+    free(image);
+    return;
+  }
+
+  Value *constants = (Value *)(image + sizeof(CacheHeader));
+  const char **names = (const char **)(constants + h.constant_count);
+  Node *nodes = (Node *)(names + h.name_count);
+  Function *functions = (Function *)(nodes + h.node_count);
+  NodeIndex *lists = (NodeIndex *)(functions + h.function_count);
+  bool ok = true;
+  for (uint32_t i = 0; i < h.constant_count; i++) {
+    constants[i] = ast->constants[i];
+    if (is_string(constants[i])) {
+      const char *string = as_string(constants[i])->chars;
+      uint64_t offset = string_offset(&strings, string);
+      ok = ok && offset != UINT64_MAX;
+      constants[i] = obj_value((Obj *)(uintptr_t)offset);
+    }
+  }
+  for (uint32_t i = 0; i < h.name_count; i++) {
+    uint64_t offset = string_offset(&strings, ast->names[i]);
+    ok = ok && offset != UINT64_MAX;
+    names[i] = (const char *)(uintptr_t)offset;
+  }
+  memcpy(nodes, ast->nodes, sizeof(Node) * h.node_count);
+  memcpy(lists, ast->lists, sizeof(NodeIndex) * h.list_count);
+  // only what parse() filled in, so equal scripts give equal files
+  memset(functions, 0, sizeof(Function) * h.function_count);
+  for (uint32_t i = 0; i < h.function_count; i++) {
+    functions[i].name = ast->functions[i].name;
+    functions[i].arity = ast->functions[i].arity;
+    functions[i].first = ast->functions[i].first;
+    functions[i].count = ast->functions[i].count;
+  }
+  h.string_bytes = strings.length;
+  uint64_t checksum = fnv1a(image + sizeof(CacheHeader),
+                            size - sizeof(CacheHeader));
+  // continue the hash over the strings, as if they were in the same buffer
+  const unsigned char *p = (const unsigned char *)strings.bytes;
+  for (uint64_t i = 0; i < strings.length; i++) {
+    checksum ^= p[i];
+    checksum *= 1099511628211ull;
+  }
+  h.checksum = checksum;
+  memcpy(image, &h, sizeof(CacheHeader));
+
+  // written under a unique temporary name and renamed, so concurrent runs,
+  // and the threads of one --jobs run, only ever see complete files
+  char *path = cache_path(dir, h.source_hash);
+  size_t temporary_length = path == NULL ? 0 : strlen(path) + 8;
+  char *temporary = path == NULL ? NULL : malloc(temporary_length);
+  if (ok && temporary != NULL) {
+    snprintf(temporary, temporary_length, "%s.XXXXXX", path);
+    int fd = mkstemp(temporary);
+    // mkstemp makes the file private; a cache directory may be shared
+    FILE *f = fd < 0 || fchmod(fd, 0644) != 0 ? NULL : fdopen(fd, "wb");
+    if (f == NULL && fd >= 0) {
+      close(fd);
+      remove(temporary);
+    }
+    if (f != NULL) {
+      ok = fwrite(image, 1, size, f) == size &&
+           fwrite(strings.bytes, 1, strings.length, f) == strings.length;
+      ok = fclose(f) == 0 && ok;
+      if (!ok || rename(temporary, path) != 0) {
+        remove(temporary);
+      }
+    }
+  }
+  free(temporary);
+  free(path);
+  free(image);
+  strings_free(&strings);
+}
@@ -0,0 +1,32 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "parser.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// On-disk cache of parsed scripts, so that a script that hasn't changed is
+// not scanned and parsed again. A cache file holds the Ast of one source
+// text, named after a hash of that text. Loading maps the file privately and
+// only has to check it and turn string offsets back into interned pointers.
+
+// Keeps the file of a loaded Ast mapped; the Ast's arrays point into it.
+typedef struct {
+  void *mapping; // NULL if nothing is mapped
+  size_t size;
+} CacheFile;
+
+// Returns the cached Ast of source, allocated in arena, or NULL if dir has
+// none or it is stale or damaged. Resolving and optimizing the Ast doesn't
+// change the file.
+Ast *cache_load(const char *dir, const char *source, int length, Arena *arena,
+                CacheFile *file);
+
+// Unmaps the file of an Ast returned by cache_load once it's no longer used.
+void cache_close(CacheFile *file);
+
+// Writes the Ast that parse() returned for source to dir. Failures are
+// ignored: the cache is only an optimization.
+void cache_store(const char *dir, const char *source, int length,
+                 const Ast *ast);
+#endif
@@ -0,0 +1,73 @@
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include "parser.h"
+#include <stdint.h>
+
+// Instructions of the VM. Operands follow the opcode as 32-bit values in
+// native byte order.
+typedef enum {
+  OP_CONSTANT,      // index in constants: push it
+  OP_NIL,           // push nil
+  OP_GET_GLOBAL,    // slot in the environment: push it
+  OP_SET_GLOBAL,    // slot: pop into it, push nil
+  OP_DEFINE_GLOBAL, // slot, index in names: pop into a new variable
+  OP_GET_LOCAL,     // index in the locals: push it
+  OP_SET_LOCAL,     // index: pop into it, push nil
+  OP_DEFINE_LOCAL,  // index: pop into it
+  OP_SET_LOCAL_CELL, // index of a local holding a cell: pop into the cell,
+                     // push nil
+  OP_GET_UPVALUE,    // index in the closure's upvalues: push it
+  OP_SET_UPVALUE,    // index of an upvalue, always a cell: pop into the
+                     // cell, push nil
+  OP_BOX,            // replace the top with a new cell holding it
+  OP_UNBOX,          // replace the cell on top with its value
+  OP_ADD,
+  OP_SUBTRACT,
+  OP_MULTIPLY,
+  OP_DIVIDE,
+  OP_GREATER,
+  OP_GREATER_EQUAL,
+  OP_LESS,
+  OP_LESS_EQUAL,
+  OP_EQUAL,
+  OP_NEGATE,
+  OP_NOT,
+  OP_PRINT,
+  OP_POP,
+  OP_JUMP,          // offset in code: continue there
+  OP_JUMP_IF_FALSE, // offset: pop, continue there if it is falsey
+  OP_CLOSURE,   // index in functions, then per capture a local index * 2 + 1
+                // or an upvalue index * 2: push a new closure
+  OP_CALL,      // argument count: call the closure below the arguments
+  OP_TAIL_CALL, // argument count: the same, in place of the running call
+  OP_CLASS,     // index in names, method count, 1 for a subclass: pop the
+                // methods and the superclass below them, push a new class
+  OP_GET_PROPERTY, // index in names, index in caches: replace the instance
+                   // on top with the property
+  OP_SET_PROPERTY, // name, cache: pop the value and the instance below it
+                   // into its field, push nil
+  OP_INVOKE,       // name, cache, argument count: call the method of the
+                   // instance below the arguments
+  OP_TAIL_INVOKE,  // name, cache, argument count: the same, in place of the
+                   // running call
+  OP_GET_SUPER,    // name: replace the superclass and the receiver on top
+                   // with the superclass's method bound to it
+  OP_RETURN     // pop the result and leave the function, or the script
+} OpCode;
+
+// A compiled script or function. Constants, names and functions are the
+// Ast's tables, so the Ast must outlive the chunk. A function's chunk is
+// its Function.code.
+typedef struct {
+  uint8_t *code;
+  uint32_t count;
+  uint32_t capacity;
+  const Value *constants;
+  const char *const *names;
+  const Function *functions;
+  PropertyCache *caches;
+  uint32_t max_locals; // block variables live at the same time
+  uint32_t max_stack;  // deepest the operand stack gets
+} Chunk;
+#endif
@@ -0,0 +1,464 @@
+#include "compiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  const Ast *ast;
+  Arena *arena;
+  Chunk *chunk;
+  uint32_t stack; // operand stack depth at the current instruction
+  uint16_t level; // block nesting, 0 for the environment
+  uint32_t live;  // locals of the open blocks declared so far
+  bool initializer; // compiling init, which returns slot 0
+  // index of the first local of each open block, by level
+  uint32_t *base;
+  uint32_t base_capacity;
+} Compiler;
+
+static void compile_expression(Compiler *c, NodeIndex index);
+static void compile_statement(Compiler *c, NodeIndex index);
+
+// Returns room for bytes more bytes of code.
+static uint8_t *reserve(Compiler *c, uint32_t bytes) {
+  Chunk *chunk = c->chunk;
+  if (chunk->count + bytes > chunk->capacity) {
+    uint32_t capacity = chunk->capacity == 0 ? 1024 : chunk->capacity * 2;
+    uint8_t *code = arena_alloc(c->arena, capacity);
+    if (chunk->count > 0) {
+      memcpy(code, chunk->code, chunk->count);
+    }
+    chunk->code = code;
+    chunk->capacity = capacity;
+  }
+  uint8_t *start = chunk->code + chunk->count;
+  chunk->count += bytes;
+  return start;
+}
+
+// effect is what the instruction does to the stack depth
+static void emit(Compiler *c, OpCode op, int effect) {
+  *reserve(c, 1) = op;
+  c->stack += effect;
+  if (c->stack > c->chunk->max_stack) {
+    c->chunk->max_stack = c->stack;
+  }
+}
+
+static void emit_operand(Compiler *c, uint32_t operand) {
+  memcpy(reserve(c, sizeof(uint32_t)), &operand, sizeof(uint32_t));
+}
+
+// Fills in the operand at offset, emitted as a placeholder.
+static void patch_operand(Compiler *c, uint32_t offset, uint32_t operand) {
+  memcpy(c->chunk->code + offset, &operand, sizeof(uint32_t));
+}
+
+// Opens a scope whose locals go after the live ones.
+static void begin_level(Compiler *c) {
+  c->level += 1;
+  if (c->level >= c->base_capacity) {
+    while (c->level >= c->base_capacity) {
+      c->base_capacity = c->base_capacity == 0 ? 16 : c->base_capacity * 2;
+    }
+    c->base = realloc(c->base, sizeof(uint32_t) * c->base_capacity);
+    if (c->base == NULL) {
+      printf("Cannot allocate memory for the compiler");
+      exit(1);
+    }
+  }
+  c->base[c->level] = c->live;
+}
+
+static uint32_t local(Compiler *c, uint16_t level, uint32_t slot) {
+  uint32_t index = c->base[level] + slot;
+  if (index + 1 > c->chunk->max_locals) {
+    c->chunk->max_locals = index + 1;
+  }
+  return index;
+}
+
+static void compile_binary(Compiler *c, const Node *node) {
+  compile_expression(c, node->as.binary.left);
+  compile_expression(c, node->as.binary.right);
+  switch (node->op) {
+  case MINUS:
+    emit(c, OP_SUBTRACT, -1);
+    break;
+  case PLUS:
+    emit(c, OP_ADD, -1);
+    break;
+  case SLASH:
+    emit(c, OP_DIVIDE, -1);
+    break;
+  case STAR:
+    emit(c, OP_MULTIPLY, -1);
+    break;
+  case GREATER:
+    emit(c, OP_GREATER, -1);
+    break;
+  case GREATER_EQUAL:
+    emit(c, OP_GREATER_EQUAL, -1);
+    break;
+  case LESS:
+    emit(c, OP_LESS, -1);
+    break;
+  case LESS_EQUAL:
+    emit(c, OP_LESS_EQUAL, -1);
+    break;
+  case BANG_EQUAL: // the tree walker doesn't negate != either
+  case EQUAL_EQUAL:
+    emit(c, OP_EQUAL, -1);
+    break;
+  default:
+    emit(c, OP_POP, -1);
+    emit(c, OP_POP, -1);
+    emit(c, OP_NIL, 1);
+    break;
+  }
+}
+
+// Assignments are expressions that leave nil, like visitAssignStmt. An
+// assigned upvalue is always in a cell.
+static void compile_assign(Compiler *c, const Node *node) {
+  compile_expression(c, node->as.assign.value);
+  uint16_t level = c->level - node->depth;
+  if (node->op & VAR_UPVALUE) {
+    emit(c, OP_SET_UPVALUE, 0);
+    emit_operand(c, node->as.assign.slot);
+  } else if (level == 0) {
+    emit(c, OP_SET_GLOBAL, 0);
+    emit_operand(c, node->as.assign.slot);
+  } else {
+    emit(c, node->op & VAR_CELL ? OP_SET_LOCAL_CELL : OP_SET_LOCAL, 0);
+    emit_operand(c, local(c, level, node->as.assign.slot));
+  }
+}
+
+static void compile_function(Compiler *c, Function *function);
+
+// Captured locals are copied as they are, like visitFunction does.
+static void compile_closure(Compiler *c, const Node *node) {
+  Function *function = ast_function(c->ast, node);
+  compile_function(c, function);
+  emit(c, OP_CLOSURE, 1);
+  emit_operand(c, node->as.function.index);
+  const Capture *captures = &c->ast->captures[function->first_capture];
+  for (uint32_t i = 0; i < function->capture_count; i++) {
+    if (captures[i].local) {
+      uint16_t level = c->level - captures[i].depth;
+      emit_operand(c, local(c, level, captures[i].slot) << 1 | 1);
+    } else {
+      emit_operand(c, captures[i].slot << 1);
+    }
+  }
+}
+
+// A call of instance.name is an invoke: the instance takes the callee's
+// slot and no bound method is made for it.
+static void compile_call(Compiler *c, const Node *call) {
+  const Node *callee = ast_node(c->ast, call->as.call.callee);
+  bool invoke = callee->kind == GET_EXPR;
+  compile_expression(c, invoke ? callee->as.property.object
+                               : call->as.call.callee);
+  const NodeIndex *arguments = &c->ast->lists[call->as.call.first];
+  for (uint32_t i = 0; i < call->as.call.count; i++) {
+    compile_expression(c, arguments[i]);
+  }
+  int effect = -(int)call->as.call.count;
+  bool tail = call->op == CALL_TAIL;
+  if (invoke) {
+    emit(c, tail ? OP_TAIL_INVOKE : OP_INVOKE, effect);
+    emit_operand(c, callee->as.property.name);
+    emit_operand(c, callee->as.property.cache);
+  } else {
+    emit(c, tail ? OP_TAIL_CALL : OP_CALL, effect);
+  }
+  emit_operand(c, call->as.call.count);
+}
+
+// The class's scope holds 'super' in a subclass, which OP_CLASS takes
+// below the methods.
+static void compile_class(Compiler *c, const Node *klass) {
+  begin_level(c);
+  const NodeIndex *members = &c->ast->lists[klass->as.klass.first];
+  uint32_t count = klass->as.klass.count;
+  uint32_t first = 0;
+  if (klass->op & CLASS_SUBCLASS) {
+    compile_statement(c, members[first++]);
+    emit(c, OP_GET_LOCAL, 1);
+    emit_operand(c, local(c, c->level, 0));
+  }
+  for (uint32_t i = first; i < count; i++) {
+    compile_expression(c, members[i]);
+  }
+  emit(c, OP_CLASS, 1 - (int)count);
+  emit_operand(c, klass->as.klass.name);
+  emit_operand(c, count - first);
+  emit_operand(c, first);
+  c->live = c->base[c->level];
+  c->level -= 1;
+}
+
+static void compile_expression(Compiler *c, NodeIndex index) {
+  if (index == NO_NODE) {
+    emit(c, OP_NIL, 1);
+    return;
+  }
+  const Node *node = ast_node(c->ast, index);
+  switch ((NodeKind)node->kind) {
+  case BINARY_EXPR:
+    compile_binary(c, node);
+    break;
+  case UNARY_EXPR:
+    compile_expression(c, node->as.unary.right);
+    if (node->op == MINUS) {
+      emit(c, OP_NEGATE, 0);
+    } else if (node->op == BANG) {
+      emit(c, OP_NOT, 0);
+    }
+    break;
+  case LITERAL_EXPR:
+    if (node->as.literal.constant == NIL_CONSTANT) {
+      emit(c, OP_NIL, 1);
+    } else {
+      emit(c, OP_CONSTANT, 1);
+      emit_operand(c, node->as.literal.constant);
+    }
+    break;
+  case GROUP_EXPR:
+    compile_expression(c, node->as.group.expression);
+    break;
+  case VARIABLE_EXPR: {
+    uint16_t level = c->level - node->depth;
+    if (node->op & VAR_UPVALUE) {
+      emit(c, OP_GET_UPVALUE, 1);
+      emit_operand(c, node->as.variable.slot);
+    } else if (level == 0) {
+      emit(c, OP_GET_GLOBAL, 1);
+      emit_operand(c, node->as.variable.slot);
+    } else {
+      emit(c, OP_GET_LOCAL, 1);
+      emit_operand(c, local(c, level, node->as.variable.slot));
+    }
+    if (node->op & VAR_CELL) {
+      emit(c, OP_UNBOX, 0);
+    }
+    break;
+  }
+  case ASSIGN_STMT:
+    compile_assign(c, node);
+    break;
+  case FUNCTION_EXPR:
+    compile_closure(c, node);
+    break;
+  case CALL_EXPR:
+    compile_call(c, node);
+    break;
+  case CLASS_EXPR:
+    compile_class(c, node);
+    break;
+  case GET_EXPR:
+    compile_expression(c, node->as.property.object);
+    emit(c, OP_GET_PROPERTY, 0);
+    emit_operand(c, node->as.property.name);
+    emit_operand(c, node->as.property.cache);
+    break;
+  case SET_EXPR: {
+    const Node *get = ast_node(c->ast, node->as.set.target);
+    compile_expression(c, get->as.property.object);
+    compile_expression(c, node->as.set.value);
+    emit(c, OP_SET_PROPERTY, -1);
+    emit_operand(c, get->as.property.name);
+    emit_operand(c, get->as.property.cache);
+    break;
+  }
+  case SUPER_EXPR:
+    compile_expression(c, node->as.super.superclass);
+    compile_expression(c, node->as.super.receiver);
+    emit(c, OP_GET_SUPER, -1);
+    emit_operand(c, node->as.super.name);
+    break;
+  default:
+    // statements and errors have no value
+    emit(c, OP_NIL, 1);
+    break;
+  }
+}
+
+static void compile_block(Compiler *c, const Node *block) {
+  begin_level(c);
+  const NodeIndex *statements = &c->ast->lists[block->as.block.first];
+  for (uint32_t i = 0; i < block->as.block.count; i++) {
+    compile_statement(c, statements[i]);
+  }
+  c->live = c->base[c->level];
+  c->level -= 1;
+}
+
+static void compile_while(Compiler *c, const Node *loop) {
+  uint32_t start = c->chunk->count;
+  uint32_t exit = 0;
+  bool conditional = loop->as.loop.condition != NO_NODE;
+  if (conditional) {
+    compile_expression(c, loop->as.loop.condition);
+    emit(c, OP_JUMP_IF_FALSE, -1);
+    exit = c->chunk->count;
+    emit_operand(c, 0);
+  }
+  compile_statement(c, loop->as.loop.body);
+  if (loop->as.loop.increment != NO_NODE) {
+    compile_expression(c, loop->as.loop.increment);
+    emit(c, OP_POP, -1);
+  }
+  emit(c, OP_JUMP, 0);
+  emit_operand(c, start);
+  if (conditional) {
+    patch_operand(c, exit, c->chunk->count);
+  }
+}
+
+static void compile_statement(Compiler *c, NodeIndex index) {
+  const Node *node = ast_node(c->ast, index);
+  switch ((NodeKind)node->kind) {
+  case PRINT_STMT:
+    compile_expression(c, node->as.group.expression);
+    emit(c, OP_PRINT, -1);
+    break;
+  case EXPR_STMT:
+    compile_expression(c, node->as.group.expression);
+    emit(c, OP_POP, -1);
+    break;
+  case VARIABLE_STMT:
+    if (node->op & VAR_CELL) {
+      // the cell exists before the value, so a function can capture itself
+      uint32_t index = local(c, c->level, node->as.assign.slot);
+      emit(c, OP_NIL, 1);
+      emit(c, OP_BOX, 0);
+      emit(c, OP_DEFINE_LOCAL, -1);
+      emit_operand(c, index);
+      c->live = index + 1;
+      compile_expression(c, node->as.assign.value);
+      emit(c, OP_SET_LOCAL_CELL, 0);
+      emit_operand(c, index);
+      emit(c, OP_POP, -1);
+      break;
+    }
+    compile_expression(c, node->as.assign.value);
+    if (c->level == 0) {
+      emit(c, OP_DEFINE_GLOBAL, -1);
+      emit_operand(c, node->as.assign.slot);
+      emit_operand(c, node->as.assign.name);
+    } else {
+      uint32_t index = local(c, c->level, node->as.assign.slot);
+      emit(c, OP_DEFINE_LOCAL, -1);
+      emit_operand(c, index);
+      c->live = index + 1;
+    }
+    break;
+  case BLOCK_STMT:
+    compile_block(c, node);
+    break;
+  case WHILE_STMT:
+    compile_while(c, node);
+    break;
+  case RETURN_STMT: {
+    // a tail call leaves the function itself
+    NodeIndex value = node->as.group.expression;
+    const Node *call = value == NO_NODE ? NULL : ast_node(c->ast, value);
+    if (call == NULL && c->initializer) {
+      emit(c, OP_GET_LOCAL, 1);
+      emit_operand(c, 0);
+      emit(c, OP_RETURN, -1);
+      break;
+    }
+    compile_expression(c, value);
+    if (call == NULL || call->kind != CALL_EXPR || call->op != CALL_TAIL) {
+      emit(c, OP_RETURN, -1);
+    } else {
+      c->stack -= 1;
+    }
+    break;
+  }
+  default:
+    compile_expression(c, index);
+    emit(c, OP_POP, -1);
+    break;
+  }
+}
+
+static Chunk *new_chunk(const Ast *ast, Arena *arena) {
+  Chunk *chunk = arena_alloc(arena, sizeof(Chunk));
+  memset(chunk, 0, sizeof(Chunk));
+  chunk->constants = ast->constants;
+  chunk->names = ast->names;
+  chunk->functions = ast->functions;
+  chunk->caches = ast->caches;
+  return chunk;
+}
+
+// Compiles a function into a chunk of its own. Its first local is the
+// callee's slot and its parameters follow, where OP_CALL leaves the
+// arguments; the ones in cells are boxed first thing.
+static void compile_function(Compiler *c, Function *function) {
+  Chunk *chunk = new_chunk(c->ast, c->arena);
+  Compiler compiler;
+  compiler.ast = c->ast;
+  compiler.arena = c->arena;
+  compiler.chunk = chunk;
+  compiler.stack = 0;
+  compiler.level = function->level - 1;
+  compiler.live = 0;
+  compiler.base = NULL;
+  compiler.base_capacity = 0;
+  compiler.initializer = function->initializer;
+  begin_level(&compiler);
+  compiler.live = function->arity + 1;
+  chunk->max_locals = function->arity + 1;
+
+  const NodeIndex *statements = &c->ast->lists[function->first];
+  for (uint32_t i = 0; i < function->arity; i++) {
+    if (ast_node(c->ast, statements[i])->op & VAR_CELL) {
+      emit(&compiler, OP_GET_LOCAL, 1);
+      emit_operand(&compiler, i + 1);
+      emit(&compiler, OP_BOX, 0);
+      emit(&compiler, OP_DEFINE_LOCAL, -1);
+      emit_operand(&compiler, i + 1);
+    }
+  }
+  for (uint32_t i = function->arity; i < function->count; i++) {
+    compile_statement(&compiler, statements[i]);
+  }
+  if (function->initializer) {
+    emit(&compiler, OP_GET_LOCAL, 1);
+    emit_operand(&compiler, 0);
+  } else {
+    emit(&compiler, OP_NIL, 1);
+  }
+  emit(&compiler, OP_RETURN, -1);
+
+  free(compiler.base);
+  function->code = chunk;
+}
+
+Chunk *compile(const Ast *ast, Arena *arena) {
+  Chunk *chunk = new_chunk(ast, arena);
+  Compiler compiler;
+  compiler.ast = ast;
+  compiler.arena = arena;
+  compiler.chunk = chunk;
+  compiler.stack = 0;
+  compiler.level = 0;
+  compiler.live = 0;
+  compiler.base = NULL;
+  compiler.base_capacity = 0;
+  compiler.initializer = false;
+
+  for (uint32_t i = 0; i < ast->statement_count; i++) {
+    compile_statement(&compiler, ast_statement(ast, i));
+  }
+  emit(&compiler, OP_RETURN, 0);
+
+  free(compiler.base);
+  return chunk;
+}
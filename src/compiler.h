@@ -0,0 +1,10 @@
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include "arena.h"
+#include "chunk.h"
+
+// Translates a resolved AST to bytecode for vm_run. The chunk is allocated
+// in arena.
+Chunk *compile(const Ast *ast, Arena *arena);
+#endif
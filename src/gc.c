@@ -0,0 +1,260 @@
+#include "gc.h"
+#include "shape.h"
+#include <stdlib.h>
+#include <time.h>
+
+static void *grow(void *array, uint32_t *capacity, size_t size) {
+  *capacity = *capacity == 0 ? 16 : *capacity * 2;
+  array = realloc(array, size * *capacity);
+  if (array == NULL) {
+    printf("Cannot allocate memory for the collector");
+    exit(1);
+  }
+  return array;
+}
+
+void heap_init(Heap *heap) {
+  heap->objects = NULL;
+  heap->bytes_allocated = 0;
+  heap->next_gc = GC_MIN_HEAP;
+  heap->growth_factor = GC_GROWTH_FACTOR;
+  heap->stress = false;
+  heap->roots = NULL;
+  heap->root_count = 0;
+  heap->root_capacity = 0;
+  heap->temps = NULL;
+  heap->temp_count = 0;
+  heap->temp_capacity = 0;
+  heap->gray = NULL;
+  heap->gray_count = 0;
+  heap->gray_capacity = 0;
+  heap->stats = (GcStats){0};
+  heap->shapes = NULL;
+  heap->shape_stats = (ShapeStats){0};
+}
+
+// Including what the object owns, like the characters of a flattened rope.
+static size_t object_size(const Obj *object) {
+  switch ((ObjType)object->type) {
+  case OBJ_STRING: {
+    const ObjString *string = (const ObjString *)object;
+    return string->chars == NULL ? sizeof(ObjString)
+                                 : sizeof(ObjString) + string->length + 1;
+  }
+  case OBJ_CLOSURE:
+    return sizeof(ObjClosure) +
+           sizeof(Value) * ((const ObjClosure *)object)->upvalue_count;
+  case OBJ_CELL:
+    return sizeof(ObjCell);
+  case OBJ_CLASS:
+    return sizeof(ObjClass) +
+           sizeof(Method) * ((const ObjClass *)object)->method_count;
+  case OBJ_INSTANCE:
+    // near enough once the fields have outgrown the inline ones
+    return sizeof(ObjInstance) +
+           sizeof(Value) * ((const ObjInstance *)object)->capacity;
+  case OBJ_BOUND_METHOD:
+    return sizeof(ObjBoundMethod);
+  }
+  return 0;
+}
+
+static void free_object(Obj *object) {
+  switch ((ObjType)object->type) {
+  case OBJ_STRING: {
+    ObjString *string = (ObjString *)object;
+    if (string->chars != string->inline_chars) {
+      free(string->chars);
+    }
+    break;
+  }
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    if (instance->fields != instance->inline_fields) {
+      free(instance->fields);
+    }
+    break;
+  }
+  case OBJ_CLOSURE:
+  case OBJ_CELL:
+  case OBJ_CLASS:
+  case OBJ_BOUND_METHOD:
+    break;
+  }
+  free(object);
+}
+
+void heap_free(Heap *heap) {
+  Obj *object = heap->objects;
+  while (object != NULL) {
+    Obj *next = object->next;
+    free_object(object);
+    object = next;
+  }
+  free(heap->roots);
+  free(heap->temps);
+  free(heap->gray);
+  shapes_free(heap->shapes);
+  heap_init(heap);
+}
+
+Obj *gc_allocate(Heap *heap, size_t size, ObjType type) {
+  if (heap->stress || heap->bytes_allocated + size > heap->next_gc) {
+    gc_collect(heap);
+  }
+  Obj *object = malloc(size);
+  if (object == NULL) {
+    printf("Cannot allocate memory for an object");
+    exit(1);
+  }
+  object->type = type;
+  object->marked = false;
+  object->next = heap->objects;
+  heap->objects = object;
+  heap->bytes_allocated += size;
+  return object;
+}
+
+void gc_push_roots(Heap *heap, MarkRoots mark, void *context) {
+  if (heap->root_count == heap->root_capacity) {
+    heap->roots = grow(heap->roots, &heap->root_capacity, sizeof(RootSource));
+  }
+  heap->roots[heap->root_count++] = (RootSource){mark, context};
+}
+
+void gc_pop_roots(Heap *heap) { heap->root_count--; }
+
+void gc_protect(Heap *heap, Value value) {
+  if (heap->temp_count == heap->temp_capacity) {
+    heap->temps = grow(heap->temps, &heap->temp_capacity, sizeof(Value));
+  }
+  heap->temps[heap->temp_count++] = value;
+}
+
+// Interned strings are born marked, so marking never writes to them and
+// they can be shared between threads.
+void gc_mark_value(Heap *heap, Value value) {
+  if (!is_obj(value)) {
+    return;
+  }
+  Obj *object = as_obj(value);
+  if (object->marked) {
+    return;
+  }
+  object->marked = true;
+  if (heap->gray_count == heap->gray_capacity) {
+    heap->gray = grow(heap->gray, &heap->gray_capacity, sizeof(Obj *));
+  }
+  heap->gray[heap->gray_count++] = object;
+}
+
+static void mark_object(Heap *heap, Obj *object) {
+  if (object != NULL) {
+    gc_mark_value(heap, obj_value(object));
+  }
+}
+
+// Marks what object refers to.
+static void blacken(Heap *heap, Obj *object) {
+  switch ((ObjType)object->type) {
+  case OBJ_STRING: {
+    ObjString *string = (ObjString *)object;
+    mark_object(heap, (Obj *)string->left);
+    mark_object(heap, (Obj *)string->right);
+    break;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)object;
+    for (uint32_t i = 0; i < closure->upvalue_count; i++) {
+      gc_mark_value(heap, closure->upvalues[i]);
+    }
+    break;
+  }
+  case OBJ_CELL:
+    gc_mark_value(heap, ((ObjCell *)object)->value);
+    break;
+  case OBJ_CLASS: {
+    ObjClass *klass = (ObjClass *)object;
+    for (uint32_t i = 0; i < klass->method_count; i++) {
+      gc_mark_value(heap, klass->methods[i].method);
+    }
+    break;
+  }
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    mark_object(heap, &instance->shape->klass->obj);
+    for (uint32_t i = 0; i < instance->shape->field_count; i++) {
+      gc_mark_value(heap, instance->fields[i]);
+    }
+    break;
+  }
+  case OBJ_BOUND_METHOD: {
+    ObjBoundMethod *bound = (ObjBoundMethod *)object;
+    gc_mark_value(heap, bound->receiver);
+    mark_object(heap, &bound->method->obj);
+    break;
+  }
+  }
+}
+
+// Flattening a rope doesn't go through the heap, so the live bytes are
+// counted again here rather than kept up to date.
+static void sweep(Heap *heap) {
+  size_t live = 0;
+  Obj **link = &heap->objects;
+  while (*link != NULL) {
+    Obj *object = *link;
+    size_t size = object_size(object);
+    if (object->marked) {
+      object->marked = false;
+      live += size;
+      link = &object->next;
+    } else {
+      *link = object->next;
+      heap->stats.bytes_freed += size;
+      heap->stats.objects_freed += 1;
+      free_object(object);
+    }
+  }
+  heap->bytes_allocated = live;
+}
+
+static double now_ms(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+void gc_collect(Heap *heap) {
+  double start = now_ms();
+
+  for (uint32_t i = 0; i < heap->root_count; i++) {
+    heap->roots[i].mark(heap, heap->roots[i].context);
+  }
+  for (uint32_t i = 0; i < heap->temp_count; i++) {
+    gc_mark_value(heap, heap->temps[i]);
+  }
+  while (heap->gray_count > 0) {
+    blacken(heap, heap->gray[--heap->gray_count]);
+  }
+  sweep(heap);
+
+  size_t next_gc = (size_t)(heap->bytes_allocated * heap->growth_factor);
+  heap->next_gc = next_gc < GC_MIN_HEAP ? GC_MIN_HEAP : next_gc;
+
+  double pause = now_ms() - start;
+  heap->stats.collections += 1;
+  heap->stats.pause_total += pause;
+  if (pause > heap->stats.pause_max) {
+    heap->stats.pause_max = pause;
+  }
+}
+
+void gc_print_stats(const Heap *heap, FILE *out) {
+  const GcStats *s = &heap->stats;
+  fprintf(out, "gc: %llu collections, %.3f ms paused (longest %.3f ms)\n",
+          (unsigned long long)s->collections, s->pause_total, s->pause_max);
+  fprintf(out, "gc: %llu objects freed, %llu bytes reclaimed, %zu bytes live\n",
+          (unsigned long long)s->objects_freed,
+          (unsigned long long)s->bytes_freed, heap->bytes_allocated);
+}
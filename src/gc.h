@@ -0,0 +1,87 @@
+#ifndef GC_H
+#define GC_H
+
+#include "object.h"
+#include <stdio.h>
+
+// Precise mark-and-sweep collector for the objects made at run time. Each
+// environment has its own Heap, so scripts running on different threads
+// never share one.
+//
+// The roots are whatever the registered root sources mark: the environment
+// and the engine that is running. Values an engine only holds in C locals
+// while it allocates must be protected with gc_protect.
+typedef struct Heap Heap;
+
+typedef void (*MarkRoots)(Heap *heap, void *context);
+
+typedef struct {
+  MarkRoots mark;
+  void *context;
+} RootSource;
+
+typedef struct {
+  uint64_t collections;
+  uint64_t objects_freed;
+  uint64_t bytes_freed;
+  double pause_total; // in milliseconds
+  double pause_max;
+} GcStats;
+
+// How well the inline caches of property accesses do, see shape.h.
+typedef struct {
+  uint64_t shapes;      // created
+  uint64_t transitions; // instances moved to a shape with one more field
+  uint64_t hits;        // accesses an inline cache answered
+  uint64_t misses;
+  uint64_t megamorphic; // sites that saw more shapes than a cache holds
+} ShapeStats;
+
+#define GC_GROWTH_FACTOR 2.0
+#define GC_MIN_HEAP (1024 * 1024)
+
+struct Heap {
+  Obj *objects;           // everything allocated, newest first
+  size_t bytes_allocated; // by the objects that haven't been freed
+  size_t next_gc;         // collect when an allocation would pass this
+  double growth_factor;   // next_gc is the live bytes times this
+  bool stress;            // collect on every allocation
+
+  RootSource *roots;
+  uint32_t root_count;
+  uint32_t root_capacity;
+  Value *temps; // see gc_protect
+  uint32_t temp_count;
+  uint32_t temp_capacity;
+  Obj **gray; // marked objects whose references are still to be marked
+  uint32_t gray_count;
+  uint32_t gray_capacity;
+
+  GcStats stats;
+  Shape *shapes; // every shape made for a class on this heap
+  ShapeStats shape_stats;
+};
+
+void heap_init(Heap *heap);
+// Frees every object, reachable or not.
+void heap_free(Heap *heap);
+
+// Returns a new object of type, size bytes including the header. May
+// collect first.
+Obj *gc_allocate(Heap *heap, size_t size, ObjType type);
+void gc_collect(Heap *heap);
+
+// Root sources are registered and removed in stack order.
+void gc_push_roots(Heap *heap, MarkRoots mark, void *context);
+void gc_pop_roots(Heap *heap);
+void gc_mark_value(Heap *heap, Value value);
+
+// Keeps value alive until it is unprotected. Unprotecting goes back to
+// temp_count; engines reset it that way after a runtime error as well.
+void gc_protect(Heap *heap, Value value);
+static inline void gc_unprotect(Heap *heap, uint32_t temp_count) {
+  heap->temp_count = temp_count;
+}
+
+void gc_print_stats(const Heap *heap, FILE *out);
+#endif
@@ -0,0 +1,129 @@
+#include "intern.h"
+#include "object.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Entries are string objects, stored in one allocation with their
+// characters. intern() hands out a pointer to them; string_header() finds
+// the object again.
+typedef struct {
+  ObjString **entries; // open addressing, linear probing
+  int count;
+  int capacity; // always a power of two
+  pthread_mutex_t lock;
+} InternTable;
+
+// Scripts in a batch, and chunks of one large script, are scanned on several
+// threads. The table is split into shards, picked by the top bits of the
+// hash, so those threads rarely wait for each other's lock.
+#define SHARD_BITS 6
+#define SHARD_COUNT (1 << SHARD_BITS)
+
+static InternTable shards[SHARD_COUNT];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static void init_shards(void) {
+  for (int i = 0; i < SHARD_COUNT; i++) {
+    shards[i].entries = NULL;
+    shards[i].count = 0;
+    shards[i].capacity = 0;
+    pthread_mutex_init(&shards[i].lock, NULL);
+  }
+}
+
+int intern_length(const char *interned) {
+  return string_header(interned)->length;
+}
+
+uint32_t intern_hash(const char *interned) {
+  return string_header(interned)->hash;
+}
+
+// FNV-1a
+uint32_t hash_string(const char *chars, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (unsigned char)chars[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void grow(InternTable *table) {
+  int capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+  ObjString **entries = calloc(capacity, sizeof(ObjString *));
+  if (entries == NULL) {
+    printf("can't allocate memory for intern table");
+    exit(1);
+  }
+  for (int i = 0; i < table->capacity; i++) {
+    ObjString *entry = table->entries[i];
+    if (entry != NULL) {
+      uint32_t index = entry->hash & (capacity - 1);
+      while (entries[index] != NULL) {
+        index = (index + 1) & (capacity - 1);
+      }
+      entries[index] = entry;
+    }
+  }
+  free(table->entries);
+  table->entries = entries;
+  table->capacity = capacity;
+}
+
+static const char *intern_locked(InternTable *table, const char *chars,
+                                 int length, uint32_t hash);
+
+const char *intern(const char *chars, int length) {
+  pthread_once(&shards_once, init_shards);
+
+  uint32_t hash = hash_string(chars, length);
+  InternTable *table = &shards[hash >> (32 - SHARD_BITS)];
+  pthread_mutex_lock(&table->lock);
+  const char *interned = intern_locked(table, chars, length, hash);
+  pthread_mutex_unlock(&table->lock);
+  return interned;
+}
+
+static const char *intern_locked(InternTable *table, const char *chars,
+                                 int length, uint32_t hash) {
+  // keep the load factor below 3/4
+  if ((table->count + 1) * 4 > table->capacity * 3) {
+    grow(table);
+  }
+
+  uint32_t index = hash & (table->capacity - 1);
+  for (;;) {
+    ObjString *entry = table->entries[index];
+    if (entry == NULL) {
+      break;
+    }
+    if (entry->hash == hash && entry->length == length &&
+        memcmp(entry->chars, chars, length) == 0) {
+      return entry->chars;
+    }
+    index = (index + 1) & (table->capacity - 1);
+  }
+
+  ObjString *entry = malloc(sizeof(ObjString) + length + 1);
+  if (entry == NULL) {
+    printf("can't allocate memory for interned string");
+    exit(1);
+  }
+  entry->obj.next = NULL;
+  entry->obj.type = OBJ_STRING;
+  entry->obj.marked = true; // never collected
+  entry->hash = hash;
+  entry->length = length;
+  entry->chars = entry->inline_chars;
+  entry->left = NULL;
+  entry->right = NULL;
+  memcpy(entry->chars, chars, length);
+  entry->chars[length] = '\0';
+
+  table->entries[index] = entry;
+  table->count += 1;
+  return entry->chars;
+}
@@ -0,0 +1,17 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdint.h>
+
+// Process-wide string intern table. intern() returns the one canonical,
+// NUL-terminated copy of a character sequence, so interned strings can be
+// compared with == and identical literals share storage. Interned strings
+// live until the process exits.
+const char *intern(const char *chars, int length);
+
+// Length and hash of a string returned by intern(), without rescanning it.
+int intern_length(const char *interned);
+uint32_t intern_hash(const char *interned);
+
+uint32_t hash_string(const char *chars, int length);
+#endif
@@ -1,171 +1,844 @@
 #include "interpreter.h"
+#include "intern.h"
+#include "jit.h"
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 
-Value *accept(Expression *expr);
-void checkNumeric(Value *left, Value *right);
-Value *isEqual(Value *left, Value *right);
-bool streq(char *left, char *right);
+typedef struct Interpreter Interpreter;
 
-Value *visitBinary(Expression *expr);
-Value *visitUnary(Expression *unary);
-Value *visitLiteral(Expression *literal);
-Value *visitGroup(Expression *literal);
-Value *visitVariable(Expression *var);
-Value *visitVariableStmt(Expression *varStmt);
-Value *visitAssignStmt(Expression *varStmt);
+Value accept(Interpreter *in, NodeIndex index);
+void checkNumeric(Interpreter *in, Value left, Value right);
 
-Value *visitPrintStmt(Expression *printStatement);
-Value *visitBlock(Expression *block);
+Value visitBinary(Interpreter *in, Node *expr);
+Value visitUnary(Interpreter *in, const Node *unary);
+Value visitLiteral(Interpreter *in, const Node *literal);
+Value visitVariable(Interpreter *in, Node *var);
+Value visitVariableStmt(Interpreter *in, const Node *varStmt);
+Value visitAssignStmt(Interpreter *in, const Node *varStmt);
 
-static VarMap *current;
+Value visitPrintStmt(Interpreter *in, const Node *printStatement);
+Value visitBlock(Interpreter *in, const Node *block);
+Value visitWhileStmt(Interpreter *in, const Node *whileStmt);
+Value visitFunction(Interpreter *in, const Node *function);
+Value visitCall(Interpreter *in, const Node *call);
+Value visitReturnStmt(Interpreter *in, const Node *returnStmt);
+Value visitClass(Interpreter *in, const Node *klass);
+Value visitGet(Interpreter *in, const Node *get);
+Value visitSet(Interpreter *in, const Node *set);
+Value visitSuper(Interpreter *in, const Node *super);
 
-Value *accept(Expression *expr) {
-  // printf("accept %s\n", expr->type);
-  char *type = expr->type;
-  if (streq(type, "BinaryExpr")) {
-    return visitBinary(expr);
+// the kinds nodes are quickened to
+Value visitAddNumbers(Interpreter *in, Node *expr);
+Value visitSubtractNumbers(Interpreter *in, Node *expr);
+Value visitMultiplyNumbers(Interpreter *in, Node *expr);
+Value visitDivideNumbers(Interpreter *in, Node *expr);
+Value visitGreaterNumbers(Interpreter *in, Node *expr);
+Value visitGreaterEqualNumbers(Interpreter *in, Node *expr);
+Value visitLessNumbers(Interpreter *in, Node *expr);
+Value visitLessEqualNumbers(Interpreter *in, Node *expr);
+Value visitEqualNumbers(Interpreter *in, Node *expr);
+Value visitLocal(Interpreter *in, const Node *var);
+Value visitGlobal(Interpreter *in, const Node *var);
+
+// All state of one run, so several scripts can be interpreted concurrently.
+typedef struct Interpreter {
+  Ast *ast; // its nodes are quickened in place
+  VarMap *environment; // scope level 0
+  Heap *heap;
+  FILE *out;
+  // Block scopes are frames on one value stack: the variables of the block
+  // at level l are at stack[base[l + frame_offset] + slot]. Entering a
+  // block records the top, leaving it puts the top back. A call puts the
+  // function and its arguments on top, which become its slot 0 and its
+  // parameters, and continues base after the caller's levels.
+  Value *stack;
+  uint32_t top;
+  uint32_t stack_capacity;
+  uint32_t *base;
+  uint32_t base_capacity;
+  uint16_t level;
+  int32_t frame_offset;
+  ObjClosure *closure; // running, NULL for the script
+  uint32_t depth;      // calls nested
+  // set by a return statement until the function it leaves gets to see it
+  bool returning;
+  bool tail_call; // the callee and its arguments replaced the frame
+  uint32_t tail_count;     // ... that many arguments; blocks move the top
+  ObjClosure *tail_method; // to run with the receiver the tail call left
+  Value result;
+  Jit *jit; // NULL unless --jit
+  QuickenStats quickened;
+  jmp_buf on_error; // runtime errors unwind straight back to interpret()
+} Interpreter;
+
+// Runs a Binary, Unary or assignment node natively once the JIT has
+// compiled it, with what's below it, else visits it.
+static Value visitNative(Interpreter *in, NodeIndex index) {
+  JitFrame frame = {in->stack,
+                    in->base == NULL
+                        ? NULL
+                        : in->base + in->level + in->frame_offset,
+                    in->environment->entries, in->level};
+  Value value = jit_run(in->jit, in->ast, index, &frame);
+  if (value != JIT_NOT_RUN) {
+    return value;
   }
-  if (streq(type, "UnaryExpr")) {
-    return visitUnary(expr);
+  Node *node = &in->ast->nodes[index];
+  switch (node->kind) {
+  case BINARY_EXPR:
+    return visitBinary(in, node);
+  case UNARY_EXPR:
+    return visitUnary(in, node);
+  case ASSIGN_STMT:
+    return visitAssignStmt(in, node);
+  case ADD_NUMBERS:
+    return visitAddNumbers(in, node);
+  case SUBTRACT_NUMBERS:
+    return visitSubtractNumbers(in, node);
+  case MULTIPLY_NUMBERS:
+    return visitMultiplyNumbers(in, node);
+  case DIVIDE_NUMBERS:
+    return visitDivideNumbers(in, node);
+  case GREATER_NUMBERS:
+    return visitGreaterNumbers(in, node);
+  case GREATER_EQUAL_NUMBERS:
+    return visitGreaterEqualNumbers(in, node);
+  case LESS_NUMBERS:
+    return visitLessNumbers(in, node);
+  case LESS_EQUAL_NUMBERS:
+    return visitLessEqualNumbers(in, node);
+  case EQUAL_NUMBERS:
+    return visitEqualNumbers(in, node);
+  default:
+    // accept() only sends the kinds above here
+    fprintf(in->out, "Unexpected node kind %d", node->kind);
+    longjmp(in->on_error, 1);
   }
-  if (streq(type, "Literal")) {
-    return visitLiteral(expr);
+}
+
+Value accept(Interpreter *in, NodeIndex index) {
+  if (index == NO_NODE) {
+    return NIL_VALUE;
   }
-  if (streq(type, "Group")) {
-    return visitGroup(expr);
+  Node *node = &in->ast->nodes[index];
+  switch ((NodeKind)node->kind) {
+  case BINARY_EXPR:
+    return in->jit != NULL ? visitNative(in, index) : visitBinary(in, node);
+  case UNARY_EXPR:
+    return in->jit != NULL ? visitNative(in, index) : visitUnary(in, node);
+  case LITERAL_EXPR:
+    return visitLiteral(in, node);
+  case GROUP_EXPR:
+  case EXPR_STMT:
+    return accept(in, node->as.group.expression);
+  case PRINT_STMT:
+    return visitPrintStmt(in, node);
+  case VARIABLE_STMT:
+    return visitVariableStmt(in, node);
+  case ASSIGN_STMT:
+    return in->jit != NULL ? visitNative(in, index)
+                           : visitAssignStmt(in, node);
+  case VARIABLE_EXPR:
+    return visitVariable(in, node);
+  case BLOCK_STMT:
+    return visitBlock(in, node);
+  case WHILE_STMT:
+    return visitWhileStmt(in, node);
+  case FUNCTION_EXPR:
+    return visitFunction(in, node);
+  case CALL_EXPR:
+    return visitCall(in, node);
+  case RETURN_STMT:
+    return visitReturnStmt(in, node);
+  case CLASS_EXPR:
+    return visitClass(in, node);
+  case GET_EXPR:
+    return visitGet(in, node);
+  case SET_EXPR:
+    return visitSet(in, node);
+  case SUPER_EXPR:
+    return visitSuper(in, node);
+  case ADD_NUMBERS:
+    return in->jit != NULL ? visitNative(in, index)
+                           : visitAddNumbers(in, node);
+  case SUBTRACT_NUMBERS:
+    return in->jit != NULL ? visitNative(in, index)
+                           : visitSubtractNumbers(in, node);
+  case MULTIPLY_NUMBERS:
+    return in->jit != NULL ? visitNative(in, index)
+                           : visitMultiplyNumbers(in, node);
+  case DIVIDE_NUMBERS:
+    return in->jit != NULL ? visitNative(in, index)
+                           : visitDivideNumbers(in, node);
+  case GREATER_NUMBERS:
+    return in->jit != NULL ? visitNative(in, index)
+                           : visitGreaterNumbers(in, node);
+  case GREATER_EQUAL_NUMBERS:
+    return in->jit != NULL ? visitNative(in, index)
+                           : visitGreaterEqualNumbers(in, node);
+  case LESS_NUMBERS:
+    return in->jit != NULL ? visitNative(in, index)
+                           : visitLessNumbers(in, node);
+  case LESS_EQUAL_NUMBERS:
+    return in->jit != NULL ? visitNative(in, index)
+                           : visitLessEqualNumbers(in, node);
+  case EQUAL_NUMBERS:
+    return in->jit != NULL ? visitNative(in, index)
+                           : visitEqualNumbers(in, node);
+  case LOCAL_EXPR:
+    return visitLocal(in, node);
+  case GLOBAL_EXPR:
+    return visitGlobal(in, node);
+  case ERROR_EXPR:
+    return NIL_VALUE;
   }
-  if (streq(type, "PrintStmt")) {
-    return visitPrintStmt(expr);
+  return NIL_VALUE;
+}
+
+static void markStack(Heap *heap, void *context) {
+  Interpreter *in = context;
+  for (uint32_t i = 0; i < in->top; i++) {
+    gc_mark_value(heap, in->stack[i]);
+  }
+  gc_mark_value(heap, in->result);
+}
+
+bool interpret(VarMap *environment, Ast *ast, bool jit, QuickenStats *stats,
+               FILE *out) {
+  Interpreter interpreter;
+  Interpreter *in = &interpreter;
+  in->ast = ast;
+  in->environment = environment;
+  in->heap = environment->heap;
+  in->out = out;
+  in->stack = NULL;
+  in->top = 0;
+  in->stack_capacity = 0;
+  in->base = NULL;
+  in->base_capacity = 0;
+  in->level = 0;
+  in->frame_offset = 0;
+  in->closure = NULL;
+  in->depth = 0;
+  in->returning = false;
+  in->tail_call = false;
+  in->tail_count = 0;
+  in->tail_method = NULL;
+  in->result = NIL_VALUE;
+  in->jit = jit ? jit_new() : NULL;
+  in->quickened = (QuickenStats){0, 0};
+  uint32_t temps = in->heap->temp_count;
+  gc_push_roots(in->heap, markStack, in);
+  bool ok = false;
+  if (setjmp(in->on_error) == 0) {
+    for (uint32_t i = 0; i < ast->statement_count; i++) {
+      accept(in, ast_statement(ast, i));
+    }
+    ok = true;
   }
-  if (streq(type, "VariableStmt")) {
-    return visitVariableStmt(expr);
+  gc_unprotect(in->heap, temps);
+  gc_pop_roots(in->heap);
+  free(in->stack);
+  free(in->base);
+  jit_free(in->jit);
+  if (stats != NULL) {
+    stats->specialized += in->quickened.specialized;
+    stats->deoptimized += in->quickened.deoptimized;
   }
-  if (streq(type, "AssignStmt")) {
-    return visitAssignStmt(expr);
+  return ok;
+}
+
+// Makes array hold at least needed elements of size bytes.
+static void *reserve(void *array, uint32_t *capacity, uint32_t needed,
+                     size_t size) {
+  if (needed <= *capacity) {
+    return array;
   }
-  if (streq(type, "Variable")) {
-    return visitVariable(expr);
+  uint32_t grown = *capacity < 16 ? 16 : *capacity;
+  while (grown < needed) {
+    grown *= 2;
   }
-  if (streq(type, "ExprStmt")) {
-    return accept(expr->left);
+  array = realloc(array, size * grown);
+  if (array == NULL) {
+    printf("Can not allocate memory for the interpreter stack");
+    exit(1);
   }
-  if (streq(type, "Block")) {
-    return visitBlock(expr);
+  *capacity = grown;
+  return array;
+}
+
+static void runtimeError(Interpreter *in, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vfprintf(in->out, format, args);
+  va_end(args);
+  longjmp(in->on_error, 1);
+}
+
+// The slot of a variable of the running function or the environment,
+// depth scopes out. Only valid until the next variable is defined.
+static Value *local(Interpreter *in, uint16_t depth, uint32_t slot) {
+  uint16_t level = in->level - depth;
+  if (level == 0) {
+    return &in->environment->entries[slot].value;
   }
+  return &in->stack[in->base[level + in->frame_offset] + slot];
+}
 
-  return NULL;
+// resolve() has checked that the variable exists and set the depth, slot
+// and flags of node.
+static Value *variable(Interpreter *in, const Node *node, uint32_t slot) {
+  Value *value = node->op & VAR_UPVALUE ? &in->closure->upvalues[slot]
+                                        : local(in, node->depth, slot);
+  if (node->op & VAR_CELL) {
+    value = &as_cell(*value)->value;
+  }
+  return value;
+}
+
+// Nodes quicken: once they have run they rewrite their kind in place to
+// one that skips the checks and the dispatch on the operator that what
+// they have seen makes unnecessary. A binary node that gets other than
+// numbers after all is deoptimized back, and after QUICKEN_DEOPTS_MAX
+// times stays generic.
+#define QUICKEN_DEOPTS_MAX 4
+
+static void quicken(Interpreter *in, Node *node, NodeKind kind) {
+  node->kind = kind;
+  in->quickened.specialized++;
+}
+
+// Where a variable lives doesn't change from one run of its node to the
+// next, so a plain local or global needs no guard once quickened.
+Value visitVariable(Interpreter *in, Node *var) {
+  if (var->op == 0) {
+    quicken(in, var, var->depth == in->level ? GLOBAL_EXPR : LOCAL_EXPR);
+  }
+  return *variable(in, var, var->as.variable.slot);
 }
 
-void execute(Expression *statement) { accept(statement); }
+Value visitLocal(Interpreter *in, const Node *var) {
+  uint16_t level = in->level - var->depth;
+  return in->stack[in->base[level + in->frame_offset] +
+                   var->as.variable.slot];
+}
 
-void interpret(VarMap *environment, ExpressionList *statements) {
-  current = environment;
+Value visitGlobal(Interpreter *in, const Node *var) {
+  return in->environment->entries[var->as.variable.slot].value;
+}
+
+// A variable in a cell gets its cell before the value is evaluated, so
+// that a function can capture itself.
+Value visitVariableStmt(Interpreter *in, const Node *var) {
+  uint32_t slot = var->as.assign.slot;
+  if (in->level == 0) {
+    Value value = accept(in, var->as.assign.value);
+    var_define(in->environment, slot, in->ast->names[var->as.assign.name],
+               value);
+    return NIL_VALUE;
+  }
+  uint32_t index = in->base[in->level + in->frame_offset] + slot;
+  in->stack = reserve(in->stack, &in->stack_capacity, index + 1,
+                      sizeof(Value));
+  if (index >= in->top) {
+    in->top = index + 1;
+  }
+  // evaluating the value can move the stack
+  in->stack[index] = NIL_VALUE;
+  if (var->op & VAR_CELL) {
+    Value cell = new_cell(in->heap, NIL_VALUE);
+    in->stack[index] = cell;
+    as_cell(cell)->value = accept(in, var->as.assign.value);
+  } else {
+    Value value = accept(in, var->as.assign.value);
+    in->stack[index] = value;
+  }
+  return NIL_VALUE;
+}
 
-  for (int i = 0; i < statements->size; i++) {
-    execute(exprlist_get(statements, i));
+// Statements stop running once a return statement has run.
+static void runStatements(Interpreter *in, const NodeIndex *statements,
+                          uint32_t count) {
+  for (uint32_t i = 0; i < count && !in->returning; i++) {
+    accept(in, statements[i]);
   }
 }
 
-Value *visitVariable(Expression *var) { return var_get(current, var->name); }
+Value visitBlock(Interpreter *in, const Node *blockStmt) {
+  in->base = reserve(in->base, &in->base_capacity,
+                     in->level + in->frame_offset + 2, sizeof(uint32_t));
+  in->level += 1;
+  in->base[in->level + in->frame_offset] = in->top;
+  runStatements(in, &in->ast->lists[blockStmt->as.block.first],
+                blockStmt->as.block.count);
+  in->top = in->base[in->level + in->frame_offset];
+  in->level -= 1;
+  return NIL_VALUE;
+}
 
-Value *visitVariableStmt(Expression *var) {
-  Value *value = accept(var->left);
-  if (var_isdefined(current, var->name)) {
-    printf("%s is already defined\n", var->name);
-    return NULL;
+Value visitWhileStmt(Interpreter *in, const Node *whileStmt) {
+  NodeIndex condition = whileStmt->as.loop.condition;
+  while (condition == NO_NODE || !is_falsey(accept(in, condition))) {
+    accept(in, whileStmt->as.loop.body);
+    if (in->returning) {
+      break;
+    }
+    accept(in, whileStmt->as.loop.increment);
   }
-  var_add(current, var->name, value);
-  return NULL;
+  return NIL_VALUE;
 }
 
-Value *visitBlock(Expression *blockStmt) {
-  VarMap *previous = current;
-  current = newVarMap(previous);
-  for (int i = 0; i < blockStmt->block->size; i++) {
-    Expression *e = exprlist_get(blockStmt->block, i);
-    execute(e);
+// Captured variables are copied as they are: a variable in a cell is
+// shared by copying the cell.
+Value visitFunction(Interpreter *in, const Node *node) {
+  const Function *function = ast_function(in->ast, node);
+  ObjClosure *closure =
+      new_closure(in->heap, function, function->capture_count);
+  const Capture *captures = &in->ast->captures[function->first_capture];
+  for (uint32_t i = 0; i < function->capture_count; i++) {
+    closure->upvalues[i] = captures[i].local
+                               ? *local(in, captures[i].depth, captures[i].slot)
+                               : in->closure->upvalues[captures[i].slot];
   }
-  current = previous;
-  return NULL;
+  return obj_value(&closure->obj);
 }
 
-Value *visitGroup(Expression *group) { return accept(group->left); }
+static void push(Interpreter *in, Value value) {
+  in->stack = reserve(in->stack, &in->stack_capacity, in->top + 1,
+                      sizeof(Value));
+  in->stack[in->top++] = value;
+}
 
-Value *visitPrintStmt(Expression *printStatement) {
-  Value *value = accept(printStatement->left);
-  if (value == NULL) {
+// Looks up the method a call of instance.name runs with the instance in
+// the callee's slot. A field is called like any other value instead: it
+// replaces the instance and NULL is returned.
+static ObjClosure *lookupMethod(Interpreter *in, const Node *get,
+                                uint32_t callee) {
+  Value receiver = in->stack[callee];
+  if (!is_instance(receiver)) {
+    runtimeError(in, "Only instances have properties");
+  }
+  const char *name = in->ast->names[get->as.property.name];
+  PropertyCache *cache = &in->ast->caches[get->as.property.cache];
+  Value value;
+  switch (property_get(in->heap, cache, as_instance(receiver), name,
+                       &value)) {
+  case PROPERTY_METHOD:
+    return as_closure(value);
+  case PROPERTY_FIELD:
+    in->stack[callee] = value;
+    return NULL;
+  default:
+    runtimeError(in, "Undefined property '%s'", name);
     return NULL;
   }
-  printf("%s\n", value_string(value));
-  return NULL;
 }
 
-Value *visitAssignStmt(Expression *var) {
-  Value *value = accept(var->left);
-  bool result = var_set(current, var->name, value);
-  if (!result) {
-    printf("%s is not defined", var->name);
+// Evaluates the callee and the arguments onto the top of the stack, where
+// the collector sees them. Returns the index of the callee; *method is set
+// for a method call, see lookupMethod.
+static uint32_t pushCall(Interpreter *in, const Node *call,
+                         ObjClosure **method) {
+  uint32_t callee = in->top;
+  const Node *target = ast_node(in->ast, call->as.call.callee);
+  bool invoke = target->kind == GET_EXPR;
+  push(in, accept(in, invoke ? target->as.property.object
+                             : call->as.call.callee));
+  const NodeIndex *arguments = &in->ast->lists[call->as.call.first];
+  for (uint32_t i = 0; i < call->as.call.count; i++) {
+    push(in, accept(in, arguments[i]));
   }
-  return NULL;
+  *method = invoke ? lookupMethod(in, target, callee) : NULL;
+  return callee;
+}
+
+// The closure a call of stack[callee] runs. A bound method runs with its
+// receiver in the callee's slot, a class's init with a new instance there.
+// NULL if there's nothing to run: a class without init.
+static ObjClosure *calleeClosure(Interpreter *in, uint32_t callee,
+                                 uint32_t count) {
+  Value value = in->stack[callee];
+  ObjClosure *closure;
+  if (is_closure(value)) {
+    closure = as_closure(value);
+  } else if (is_bound_method(value)) {
+    closure = as_bound_method(value)->method;
+    in->stack[callee] = as_bound_method(value)->receiver;
+  } else if (is_class(value)) {
+    in->stack[callee] = new_instance(in->heap, as_class(value));
+    if (is_nil(as_class(value)->init)) {
+      if (count != 0) {
+        runtimeError(in, "Expected 0 arguments but got %u", count);
+      }
+      return NULL;
+    }
+    closure = as_closure(as_class(value)->init);
+  } else {
+    runtimeError(in, "Can only call functions and classes");
+    return NULL;
+  }
+  if (count != closure->function->arity) {
+    runtimeError(in, "Expected %u arguments but got %u",
+                 closure->function->arity, count);
+  }
+  return closure;
+}
+
+// Runs the function at stack[callee] with the arguments after it, or
+// method with the receiver there. Tail calls replace them and go round
+// again instead of nesting.
+static Value callFunction(Interpreter *in, uint32_t callee, uint32_t count,
+                          ObjClosure *method) {
+  if (in->depth == CALL_DEPTH_MAX) {
+    runtimeError(in, "Stack overflow");
+  }
+  in->depth += 1;
+  Ast *ast = in->ast;
+  ObjClosure *closure = in->closure;
+  uint16_t level = in->level;
+  int32_t frame_offset = in->frame_offset;
+  // the first index in base after the caller's
+  uint32_t frame = level + frame_offset + 1;
+  in->base = reserve(in->base, &in->base_capacity, frame + 1,
+                     sizeof(uint32_t));
+  for (;;) {
+    ObjClosure *running =
+        method != NULL ? method : calleeClosure(in, callee, count);
+    if (running == NULL) {
+      in->result = in->stack[callee];
+      break;
+    }
+    const Function *function = running->function;
+    in->ast = function->ast;
+    in->closure = running;
+    in->level = function->level;
+    in->frame_offset = frame - function->level;
+    in->base[frame] = callee;
+    const NodeIndex *statements = &in->ast->lists[function->first];
+    for (uint32_t i = 0; i < count; i++) {
+      if (ast_node(in->ast, statements[i])->op & VAR_CELL) {
+        Value *parameter = &in->stack[callee + 1 + i];
+        *parameter = new_cell(in->heap, *parameter);
+      }
+    }
+    runStatements(in, statements + count, function->count - count);
+    in->returning = false;
+    // init evaluates to the instance, whatever it returns
+    if (function->initializer) {
+      in->result = in->stack[callee];
+    }
+    if (!in->tail_call) {
+      break;
+    }
+    in->tail_call = false;
+    method = in->tail_method;
+    in->tail_method = NULL;
+    count = in->tail_count;
+    in->top = callee + 1 + count;
+  }
+  Value result = in->result;
+  in->result = NIL_VALUE;
+  in->ast = ast;
+  in->closure = closure;
+  in->level = level;
+  in->frame_offset = frame_offset;
+  in->top = callee;
+  in->depth -= 1;
+  return result;
+}
+
+Value visitCall(Interpreter *in, const Node *call) {
+  ObjClosure *method;
+  uint32_t callee = pushCall(in, call, &method);
+  return callFunction(in, callee, call->as.call.count, method);
+}
+
+// A tail call moves the callee and its arguments down over the frame of the
+// function returning, for callFunction to run in its place.
+Value visitReturnStmt(Interpreter *in, const Node *returnStmt) {
+  NodeIndex value = returnStmt->as.group.expression;
+  const Node *node = value == NO_NODE ? NULL : ast_node(in->ast, value);
+  if (node != NULL && node->kind == CALL_EXPR && node->op == CALL_TAIL) {
+    ObjClosure *method;
+    uint32_t from = pushCall(in, node, &method);
+    uint16_t level = in->closure->function->level;
+    uint32_t callee = in->base[level + in->frame_offset];
+    uint32_t count = node->as.call.count + 1;
+    // short, so a loop beats memmove
+    for (uint32_t i = 0; i < count; i++) {
+      in->stack[callee + i] = in->stack[from + i];
+    }
+    in->top = callee + count;
+    in->tail_call = true;
+    in->tail_count = node->as.call.count;
+    in->tail_method = method;
+    in->result = NIL_VALUE;
+  } else {
+    in->result = accept(in, value);
+  }
+  in->returning = true;
+  return NIL_VALUE;
+}
+
+// The methods are made in a scope of their own, like a block's, whose
+// first variable is 'super' in a subclass.
+Value visitClass(Interpreter *in, const Node *klass) {
+  in->base = reserve(in->base, &in->base_capacity,
+                     in->level + in->frame_offset + 2, sizeof(uint32_t));
+  in->level += 1;
+  uint32_t base = in->top;
+  in->base[in->level + in->frame_offset] = base;
+  const NodeIndex *members = &in->ast->lists[klass->as.klass.first];
+  uint32_t count = klass->as.klass.count;
+  uint32_t first = 0;
+  if (klass->op & CLASS_SUBCLASS) {
+    accept(in, members[first++]);
+    if (!is_class(in->stack[base])) {
+      runtimeError(in, "Superclass must be a class");
+    }
+  }
+  uint32_t methods = in->top;
+  for (uint32_t i = first; i < count; i++) {
+    push(in, accept(in, members[i]));
+  }
+  const ObjClass *superclass = first == 0 ? NULL : as_class(in->stack[base]);
+  Value value = new_class(in->heap, in->ast->names[klass->as.klass.name],
+                          superclass, &in->stack[methods], count - first);
+  in->top = base;
+  in->level -= 1;
+  return value;
+}
+
+static ObjInstance *instance(Interpreter *in, Value value,
+                             const char *message) {
+  if (!is_instance(value)) {
+    runtimeError(in, message);
+  }
+  return as_instance(value);
+}
+
+// A method read without calling it is bound to the instance.
+Value visitGet(Interpreter *in, const Node *get) {
+  Value object = accept(in, get->as.property.object);
+  ObjInstance *receiver =
+      instance(in, object, "Only instances have properties");
+  const char *name = in->ast->names[get->as.property.name];
+  PropertyCache *cache = &in->ast->caches[get->as.property.cache];
+  Value value;
+  switch (property_get(in->heap, cache, receiver, name, &value)) {
+  case PROPERTY_FIELD:
+    return value;
+  case PROPERTY_METHOD:
+    return new_bound_method(in->heap, object, as_closure(value));
+  default:
+    runtimeError(in, "Undefined property '%s'", name);
+    return NIL_VALUE;
+  }
+}
+
+// Like other assignments it evaluates to nil.
+Value visitSet(Interpreter *in, const Node *set) {
+  const Node *get = ast_node(in->ast, set->as.set.target);
+  Value object = accept(in, get->as.property.object);
+  // the value may allocate
+  uint32_t temps = in->heap->temp_count;
+  if (is_obj(object)) {
+    gc_protect(in->heap, object);
+  }
+  Value value = accept(in, set->as.set.value);
+  gc_unprotect(in->heap, temps);
+  ObjInstance *receiver = instance(in, object, "Only instances have fields");
+  PropertyCache *cache = &in->ast->caches[get->as.property.cache];
+  property_set(in->heap, cache, receiver,
+               in->ast->names[get->as.property.name], value);
+  return NIL_VALUE;
+}
+
+Value visitSuper(Interpreter *in, const Node *super) {
+  Value superclass = accept(in, super->as.super.superclass);
+  Value receiver = accept(in, super->as.super.receiver);
+  const char *name = in->ast->names[super->as.super.name];
+  Value method = class_method(as_class(superclass), name);
+  if (is_nil(method)) {
+    runtimeError(in, "Undefined property '%s'", name);
+  }
+  return new_bound_method(in->heap, receiver, as_closure(method));
+}
+
+Value visitPrintStmt(Interpreter *in, const Node *printStatement) {
+  Value value = accept(in, printStatement->as.group.expression);
+  if (is_nil(value)) {
+    return NIL_VALUE;
+  }
+  char buffer[VALUE_STRING_SIZE];
+  fprintf(in->out, "%s\n", value_string(value, buffer));
+  return NIL_VALUE;
+}
+
+Value visitAssignStmt(Interpreter *in, const Node *var) {
+  Value value = accept(in, var->as.assign.value);
+  *variable(in, var, var->as.assign.slot) = value;
+  return NIL_VALUE;
 }
 
-Value *visitUnary(Expression *unary) {
-  Value *right = accept(unary->right);
+Value visitUnary(Interpreter *in, const Node *unary) {
+  Value right = accept(in, unary->as.unary.right);
 
-  switch (unary->operator->type) {
+  switch (unary->op) {
   case MINUS:
-    return newNumber(-right->value.number);
+    checkNumeric(in, right, right);
+    return number_value(-as_number(right));
   case BANG:
-    return newBoolean(!right->value.boolean);
+    return bool_value(is_falsey(right));
   default:
-    return NULL;
+    return NIL_VALUE;
   };
 }
 
-Value *visitLiteral(Expression *literal) { return literal->value; }
+Value visitLiteral(Interpreter *in, const Node *literal) {
+  uint32_t constant = literal->as.literal.constant;
+  if (constant == NIL_CONSTANT) {
+    return NIL_VALUE;
+  }
+  return in->ast->constants[constant];
+}
 
-Value *visitBinary(Expression *expr) {
-  Value *left = accept(expr->left);
-  Value *right = accept(expr->right);
+// Evaluates the operands of a binary node, left first.
+static inline void operands(Interpreter *in, const Node *expr, Value *left,
+                            Value *right) {
+  *left = accept(in, expr->as.binary.left);
+  // the right operand may allocate
+  uint32_t temps = in->heap->temp_count;
+  if (is_obj(*left)) {
+    gc_protect(in->heap, *left);
+  }
+  *right = accept(in, expr->as.binary.right);
+  gc_unprotect(in->heap, temps);
+}
 
-  switch (expr->operator->type) {
+static Value binaryOperation(Interpreter *in, uint8_t op, Value left,
+                             Value right) {
+  switch (op) {
   case MINUS:
-    checkNumeric(left, right);
-    return newNumber(left->value.number - right->value.number);
+    checkNumeric(in, left, right);
+    return number_value(as_number(left) - as_number(right));
   case PLUS:
-    checkNumeric(left, right);
-    return newNumber(left->value.number + right->value.number);
+    if (is_string(left) && is_string(right)) {
+      Value string = string_concat(in->heap, left, right);
+      if (is_nil(string)) {
+        runtimeError(in, "string too long");
+      }
+      return string;
+    }
+    checkNumeric(in, left, right);
+    return number_value(as_number(left) + as_number(right));
   case SLASH:
-    checkNumeric(left, right);
-    return newNumber(left->value.number / right->value.number);
+    checkNumeric(in, left, right);
+    return number_value(as_number(left) / as_number(right));
   case STAR:
-    checkNumeric(left, right);
-    return newNumber(left->value.number * right->value.number);
+    checkNumeric(in, left, right);
+    return number_value(as_number(left) * as_number(right));
   case GREATER:
-    checkNumeric(left, right);
-    return newBoolean(left->value.number > right->value.number);
+    checkNumeric(in, left, right);
+    return bool_value(as_number(left) > as_number(right));
   case GREATER_EQUAL:
-    checkNumeric(left, right);
-    return newBoolean(left->value.number >= right->value.number);
+    checkNumeric(in, left, right);
+    return bool_value(as_number(left) >= as_number(right));
   case LESS:
-    checkNumeric(left, right);
-    return newBoolean(left->value.number < right->value.number);
+    checkNumeric(in, left, right);
+    return bool_value(as_number(left) < as_number(right));
   case LESS_EQUAL:
-    checkNumeric(left, right);
-    return newBoolean(left->value.number <= right->value.number);
+    checkNumeric(in, left, right);
+    return bool_value(as_number(left) <= as_number(right));
   case BANG_EQUAL:
-    return isEqual(left, right);
+    return bool_value(values_equal(left, right));
   case EQUAL_EQUAL:
-    return isEqual(left, right);
+    return bool_value(values_equal(left, right));
   default:
-    return NULL;
+    return NIL_VALUE;
+  }
+}
+
+// The kind a binary node with operator op is quickened to once it has
+// seen two numbers.
+static NodeKind numbersKind(uint8_t op) {
+  switch (op) {
+  case PLUS:
+    return ADD_NUMBERS;
+  case MINUS:
+    return SUBTRACT_NUMBERS;
+  case STAR:
+    return MULTIPLY_NUMBERS;
+  case SLASH:
+    return DIVIDE_NUMBERS;
+  case GREATER:
+    return GREATER_NUMBERS;
+  case GREATER_EQUAL:
+    return GREATER_EQUAL_NUMBERS;
+  case LESS:
+    return LESS_NUMBERS;
+  case LESS_EQUAL:
+    return LESS_EQUAL_NUMBERS;
+  case BANG_EQUAL:
+  case EQUAL_EQUAL:
+    return EQUAL_NUMBERS;
+  default:
+    return BINARY_EXPR;
   }
 }
 
-void checkNumeric(Value *left, Value *right) {
-  if (left->type != NUMBERTYPE || right->type != NUMBERTYPE) {
-    printf("operands should be numeric");
-    exit(-1);
+Value visitBinary(Interpreter *in, Node *expr) {
+  Value left, right;
+  operands(in, expr, &left, &right);
+  if (expr->as.binary.deopts < QUICKEN_DEOPTS_MAX && is_number(left) &&
+      is_number(right)) {
+    NodeKind kind = numbersKind(expr->op);
+    if (kind != BINARY_EXPR) {
+      quicken(in, expr, kind);
+    }
+  }
+  return binaryOperation(in, expr->op, left, right);
+}
+
+// A quickened binary node guards that its operands are still numbers. If
+// they aren't it goes back to being a BINARY_EXPR and the operation is
+// done the generic way, on the operands already evaluated.
+#define NUMBERS(name, make_value, operator)                                    \
+  Value visit##name##Numbers(Interpreter *in, Node *expr) {                    \
+    Value left, right;                                                         \
+    operands(in, expr, &left, &right);                                         \
+    if (!is_number(left) || !is_number(right)) {                               \
+      expr->kind = BINARY_EXPR;                                                \
+      expr->as.binary.deopts++;                                                \
+      in->quickened.deoptimized++;                                             \
+      return binaryOperation(in, expr->op, left, right);                       \
+    }                                                                          \
+    return make_value(as_number(left) operator as_number(right));              \
+  }
+
+NUMBERS(Add, number_value, +)
+NUMBERS(Subtract, number_value, -)
+NUMBERS(Multiply, number_value, *)
+NUMBERS(Divide, number_value, /)
+NUMBERS(Greater, bool_value, >)
+NUMBERS(GreaterEqual, bool_value, >=)
+NUMBERS(Less, bool_value, <)
+NUMBERS(LessEqual, bool_value, <=)
+NUMBERS(Equal, bool_value, ==)
+
+void checkNumeric(Interpreter *in, Value left, Value right) {
+  if (!is_number(left) || !is_number(right)) {
+    fprintf(in->out, "operands should be numeric");
+    longjmp(in->on_error, 1);
+  }
+}
+
+static void markVarMap(Heap *heap, void *context) {
+  VarMap *map = context;
+  for (int i = 0; i < map->size; i++) {
+    gc_mark_value(heap, map->entries[i].value);
   }
 }
 
@@ -175,74 +848,181 @@ VarMap *newVarMap(VarMap *enclosing) {
     printf("Can not allocate memory for VarMap");
     exit(1);
   }
-  map->size = 0;
   map->enclosing = enclosing;
+  if (enclosing != NULL) {
+    map->heap = enclosing->heap;
+  } else {
+    map->heap = malloc(sizeof(Heap));
+    if (map->heap == NULL) {
+      printf("Can not allocate memory for VarMap");
+      exit(1);
+    }
+    heap_init(map->heap);
+    gc_push_roots(map->heap, markVarMap, map);
+  }
+  map->entries = map->inline_entries;
+  map->size = 0;
+  map->capacity = VARMAP_INLINE;
+  map->index = NULL;
+  map->mask = 0;
+  map->kept = NULL;
   return map;
 }
 
-bool var_isdefined(VarMap *map, const char *key) {
-  for (int i = 0; i < map->size; i++) {
-    if (strcmp(map->entries[i].key, key) == 0) {
-      return true;
-    }
-  }
-  if (map->enclosing != NULL) {
-    return var_isdefined(map->enclosing, key);
+struct KeptScript {
+  KeptScript *next;
+  Arena arena;
+  CacheFile cached;
+};
+
+void var_keep_script(VarMap *environment, Arena *arena, CacheFile *cached) {
+  KeptScript *script = malloc(sizeof(KeptScript));
+  if (script == NULL) {
+    printf("Can not allocate memory for VarMap");
+    exit(1);
   }
+  script->next = environment->kept;
+  script->arena = *arena;
+  script->cached = *cached;
+  environment->kept = script;
+}
 
-  return false;
+void freeVarMap(VarMap *map) {
+  if (map->enclosing == NULL) {
+    heap_free(map->heap);
+    free(map->heap);
+  }
+  while (map->kept != NULL) {
+    KeptScript *next = map->kept->next;
+    cache_close(&map->kept->cached);
+    arena_free(&map->kept->arena);
+    free(map->kept);
+    map->kept = next;
+  }
+  if (map->entries != map->inline_entries) {
+    free(map->entries);
+  }
+  free(map->index);
+  free(map);
 }
 
-void var_add(VarMap *map, const char *key, Value *value) {
-  if (map->size == MAX_MAP_SIZE) {
-    printf("Map is full!\n");
+void var_reserve(VarMap *map, uint32_t size) {
+  if (size <= map->capacity) {
     return;
   }
-  strcpy(map->entries[map->size].key, key);
-  map->entries[map->size].value = value;
+  uint32_t capacity = map->capacity;
+  while (capacity < size) {
+    capacity *= 2;
+  }
+  bool small = map->entries == map->inline_entries;
+  size_t bytes = sizeof(MapEntry) * capacity;
+  MapEntry *entries = small ? malloc(bytes) : realloc(map->entries, bytes);
+  if (entries == NULL) {
+    printf("Can not allocate memory for VarMap");
+    exit(1);
+  }
+  if (small) {
+    memcpy(entries, map->inline_entries, sizeof(MapEntry) * map->size);
+  }
+  map->entries = entries;
+  map->capacity = capacity;
+}
 
-  map->size += 1;
+static void index_insert(VarMap *map, uint32_t slot) {
+  uint32_t bucket = map->entries[slot].hash & map->mask;
+  while (map->index[bucket] != 0) {
+    bucket = (bucket + 1) & map->mask;
+  }
+  map->index[bucket] = slot + 1;
 }
 
-bool var_set(VarMap *map, char *key, Value *value) {
-  for (int i = 0; i < map->size; i++) {
-    if (strcmp(map->entries[i].key, key) == 0) {
-      map->entries[i].value = value; // Return the value
-      return true;
-    }
+// Variables are never removed, so rebuilding is all it takes.
+static void grow_index(VarMap *map) {
+  uint32_t buckets =
+      map->index == NULL ? VARMAP_INLINE * 4 : (map->mask + 1) * 2;
+  free(map->index);
+  map->index = calloc(buckets, sizeof(uint32_t));
+  if (map->index == NULL) {
+    printf("Can not allocate memory for VarMap");
+    exit(1);
+  }
+  map->mask = buckets - 1;
+  for (int slot = 0; slot < map->size; slot++) {
+    index_insert(map, slot);
   }
-  return false;
 }
 
-Value *var_get(VarMap *map, const char *key) {
-  for (int i = 0; i < map->size; i++) {
+void var_define(VarMap *map, uint32_t slot, const char *key, Value value) {
+  if (slot < (uint32_t)map->size) {
+    map->entries[slot].value = value;
+    return;
+  }
+  var_reserve(map, slot + 1);
+  MapEntry *entry = &map->entries[slot];
+  entry->key = key;
+  entry->hash = intern_hash(key);
+  entry->value = value;
+  map->size = slot + 1;
+  if (map->size <= VARMAP_INLINE) {
+    return;
+  }
+  // keep the index at most half full
+  if (map->index == NULL || (uint32_t)map->size * 2 > map->mask + 1) {
+    grow_index(map);
+  } else {
+    index_insert(map, slot);
+  }
+}
 
-    if (strcmp(map->entries[i].key, key) == 0) {
-      return map->entries[i].value; // Return the value
+// The entry for key in map itself, or NULL.
+static MapEntry *find(VarMap *map, const char *key) {
+  if (map->index == NULL) {
+    for (int i = 0; i < map->size; i++) {
+      if (map->entries[i].key == key) {
+        return &map->entries[i];
+      }
     }
+    return NULL;
   }
-  if (map->enclosing != NULL) {
-    return var_get(map->enclosing, key);
+  uint32_t bucket = intern_hash(key) & map->mask;
+  while (map->index[bucket] != 0) {
+    MapEntry *entry = &map->entries[map->index[bucket] - 1];
+    if (entry->key == key) {
+      return entry;
+    }
+    bucket = (bucket + 1) & map->mask;
   }
-
-  printf("%s is not defined\n", key);
-  return NULL; // Key not found
+  return NULL;
 }
 
-Value *isEqual(Value *left, Value *right) {
-  if (left->type != right->type) {
-    return newBoolean(false);
+bool var_isdefined(VarMap *map, const char *key) {
+  for (; map != NULL; map = map->enclosing) {
+    if (find(map, key) != NULL) {
+      return true;
+    }
   }
-  switch (left->type) {
-  case STRINGTYPE:
-    return newBoolean(strcmp(left->value.string, right->value.string) == 0);
-  case NUMBERTYPE:
-    return newBoolean(left->value.number == right->value.number);
-  case BOOLEANTYPE:
-    return newBoolean(left->value.boolean == right->value.boolean);
-  case EXPR: // MUST NOT HAPPEN :(=)
-    return NULL;
+  return false;
+}
+
+void var_add(VarMap *map, const char *key, Value value) {
+  var_define(map, map->size, key, value);
+}
+
+bool var_set(VarMap *map, const char *key, Value value) {
+  MapEntry *entry = find(map, key);
+  if (entry == NULL) {
+    return false;
   }
+  entry->value = value;
+  return true;
 }
 
-bool streq(char *left, char *right) { return strcmp(left, right) == 0; }
+Value var_get(VarMap *map, const char *key) {
+  for (; map != NULL; map = map->enclosing) {
+    MapEntry *entry = find(map, key);
+    if (entry != NULL) {
+      return entry->value;
+    }
+  }
+  return NIL_VALUE; // Key not found
+}
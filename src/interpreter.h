@@ -1,28 +1,72 @@
 #ifndef INTERPRETER_H
 #define INTERPRETER_H
 
+#include "cache.h"
+#include "gc.h"
 #include "parser.h"
 
-#define MAX_MAP_SIZE 1000
+// Scopes with up to this many variables need no allocation besides the
+// VarMap itself.
+#define VARMAP_INLINE 8
 
 typedef struct VarMap VarMap;
+typedef struct KeptScript KeptScript;
 
+// A map without an enclosing one is an environment: it gets a Heap of its
+// own, with its values as roots, which freeVarMap frees along with it.
 VarMap *newVarMap(VarMap *enclosing);
-void interpret(VarMap *environment, ExpressionList *statements);
+void freeVarMap(VarMap *map);
+// What quickening did to the nodes of a run, see interpreter.c
+typedef struct {
+  uint64_t specialized; // rewritten for what they had seen
+  uint64_t deoptimized; // rewritten back when a guard failed
+} QuickenStats;
+
+// Runs statements in environment, printing to out. With jit hot
+// arithmetic is compiled to native code where there's a JIT, see jit.h.
+// Nodes of ast are quickened as they run; stats, unless NULL, gets what
+// that did added to it. Returns false if a runtime error stopped
+// execution.
+bool interpret(VarMap *environment, Ast *ast, bool jit, QuickenStats *stats,
+               FILE *out);
 
 typedef struct {
-  char key[50]; // Array of strings for keys
-  Value *value; // Integer values associated with keys
+  const char *key; // interned, compared by address
+  uint32_t hash;   // intern_hash(key), kept for growing the index
+  Value value;
 } MapEntry;
 
+// Entries are stored by slot, in the order they were defined, so the
+// engines can use the slots resolve() hands out directly. Lookups by name
+// go through an open-addressing index once there are more than
+// VARMAP_INLINE entries.
 struct VarMap {
   VarMap *enclosing;
-  MapEntry entries[MAX_MAP_SIZE]; // Array of key-value pairs
-  int size;                       // Current size of the map
+  Heap *heap; // where the objects its values refer to live
+  MapEntry *entries; // inline_entries until it has to grow
+  int size;          // defined slots
+  uint32_t capacity; // of entries
+  uint32_t *index;   // slot + 1 per bucket, 0 for free; NULL while small
+  uint32_t mask;     // buckets in index - 1
+  KeptScript *kept;  // see var_keep_script
+  MapEntry inline_entries[VARMAP_INLINE];
 };
 
+// A function runs the code of the script that declared it, so an
+// environment that may hold one keeps that script's arena and cache file
+// until it's freed. Takes both over.
+void var_keep_script(VarMap *environment, Arena *arena, CacheFile *cached);
+
+// Makes room for slots 0 to size - 1. entries doesn't move while no more
+// than capacity slots are defined.
+void var_reserve(VarMap *map, uint32_t size);
+// Defines key in slot, which must be the next free one or already hold key.
+void var_define(VarMap *map, uint32_t slot, const char *key, Value value);
+
+// keys must be interned (see intern.h)
 bool var_isdefined(VarMap *map, const char *key);
-void var_add(VarMap *map, const char *key, Value *value);
-Value *var_get(VarMap *map, const char *key);
-bool var_set(VarMap *map, char *key, Value *value);
+void var_add(VarMap *map, const char *key, Value value);
+// nil if the variable doesn't exist
+Value var_get(VarMap *map, const char *key);
+bool var_set(VarMap *map, const char *key, Value value);
 #endif
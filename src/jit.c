@@ -0,0 +1,424 @@
+// mmap and friends are POSIX, hidden by a strict -std=c17
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define HAVE_JIT
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_JIT
+
+#define REGION_SIZE (64 * 1024)
+#define CODE_MAX 4096 // bytes of code for one node
+#define GIVEN_UP UINT32_MAX
+
+// System V: stack in rdi, base in rsi, globals in rdx, value in rcx.
+// Returns 0 if a guard failed, 1 if *value was set.
+typedef int (*JitCode)(Value *stack, const uint32_t *base, MapEntry *globals,
+                       Value *value);
+
+typedef struct {
+  uint32_t count; // runs so far, GIVEN_UP if it isn't compiled
+  uint32_t bailouts;
+  JitCode code;
+} JitNode;
+
+// The nodes of one Ast: functions run the Ast that declared them.
+typedef struct JitTable {
+  const Ast *ast;
+  JitNode *nodes;
+  struct JitTable *next;
+} JitTable;
+
+// Executable memory, writable only while code is copied in.
+typedef struct Region {
+  uint8_t *code;
+  uint32_t used;
+  struct Region *next;
+} Region;
+
+struct Jit {
+  JitTable *tables;
+  JitTable *current; // the last one used
+  Region *regions;
+};
+
+typedef struct {
+  const Ast *ast;
+  uint16_t level;
+  uint8_t code[CODE_MAX];
+  uint32_t count;
+  bool failed;
+} Emitter;
+
+// Registers emit_load_constant() loads. Besides them and xmm0 to xmm15 the
+// code uses r10 for the base of a variable's scope.
+enum { RAX = 0, R8 = 8, R9 = 9 };
+#define XMM_COUNT 16
+
+// Everything the guards jump to comes first.
+#define BAIL 0
+
+static void emit_byte(Emitter *e, uint8_t byte) {
+  if (e->count == CODE_MAX) {
+    e->failed = true;
+    return;
+  }
+  e->code[e->count++] = byte;
+}
+
+static void emit_bytes(Emitter *e, const uint8_t *bytes, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    emit_byte(e, bytes[i]);
+  }
+}
+
+static void emit32(Emitter *e, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    emit_byte(e, value >> (8 * i));
+  }
+}
+
+static void emit64(Emitter *e, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    emit_byte(e, value >> (8 * i));
+  }
+}
+
+#define EMIT(e, ...)                                                           \
+  emit_bytes((e), (const uint8_t[]){__VA_ARGS__},                              \
+             sizeof((const uint8_t[]){__VA_ARGS__}))
+
+// mov reg, imm64 for rax or r8 to r10
+static void emit_load_constant(Emitter *e, int reg, uint64_t value) {
+  EMIT(e, reg >= 8 ? 0x49 : 0x48, 0xb8 + (reg & 7));
+  emit64(e, value);
+}
+
+// An SSE instruction between two xmm registers: prefix [REX] 0F op modrm.
+static void emit_sse(Emitter *e, uint8_t prefix, uint8_t op, int reg,
+                     int rm) {
+  emit_byte(e, prefix);
+  if (reg >= 8 || rm >= 8) {
+    emit_byte(e, 0x40 | (reg >= 8) << 2 | (rm >= 8));
+  }
+  EMIT(e, 0x0f, op, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// movq xmm, rax
+static void emit_to_xmm(Emitter *e, int xmm) {
+  EMIT(e, 0x66, 0x48 | (xmm >= 8) << 2, 0x0f, 0x6e, 0xc0 | (xmm & 7) << 3);
+}
+
+// movq rax, xmm
+static void emit_from_xmm(Emitter *e, int xmm) {
+  EMIT(e, 0x66, 0x48 | (xmm >= 8) << 2, 0x0f, 0x7e, 0xc0 | (xmm & 7) << 3);
+}
+
+// Jumps to BAIL unless rax holds a number, see is_number(). r8 holds QNAN.
+static void emit_number_guard(Emitter *e) {
+  EMIT(e, 0x49, 0x89, 0xc1); // mov r9, rax
+  EMIT(e, 0x4d, 0x21, 0xc1); // and r9, r8
+  EMIT(e, 0x4d, 0x39, 0xc1); // cmp r9, r8
+  EMIT(e, 0x0f, 0x84);       // je BAIL
+  emit32(e, BAIL - (e->count + 4));
+}
+
+// Where a variable lives, as the operand of a load or store of rax: a
+// global, or a local indexed by r10 once its scope's base is loaded.
+static bool variable_operand(Emitter *e, const Node *node, bool *global) {
+  if (node->op & (VAR_UPVALUE | VAR_CELL)) {
+    return false;
+  }
+  *global = node->depth == e->level;
+  if (!*global) {
+    // mov r10d, [rsi - 4 * depth]
+    EMIT(e, 0x44, 0x8b, 0x96);
+    emit32(e, -4 * (int32_t)node->depth);
+  }
+  return true;
+}
+
+static void emit_variable_access(Emitter *e, uint8_t op, bool global,
+                                 uint32_t slot) {
+  if (global) {
+    // [rdx + slot * sizeof(MapEntry) + offsetof(MapEntry, value)]
+    EMIT(e, 0x48, op, 0x82);
+    emit32(e, slot * sizeof(MapEntry) + offsetof(MapEntry, value));
+  } else {
+    // [rdi + r10 * 8 + slot * 8]
+    EMIT(e, 0x4a, op, 0x84, 0xd7);
+    emit32(e, slot * sizeof(Value));
+  }
+}
+
+// Puts the number node evaluates to in xmm. Fails on anything that
+// wouldn't be a number.
+static bool compile_number(Emitter *e, NodeIndex index, int xmm) {
+  if (index == NO_NODE || xmm >= XMM_COUNT) {
+    return false;
+  }
+  const Node *node = ast_node(e->ast, index);
+  switch (node_parsed_kind(node)) {
+  case LITERAL_EXPR: {
+    uint32_t constant = node->as.literal.constant;
+    if (constant == NIL_CONSTANT || !is_number(e->ast->constants[constant])) {
+      return false;
+    }
+    emit_load_constant(e, RAX, e->ast->constants[constant]);
+    emit_to_xmm(e, xmm);
+    return true;
+  }
+  case VARIABLE_EXPR: {
+    bool global;
+    if (!variable_operand(e, node, &global)) {
+      return false;
+    }
+    emit_variable_access(e, 0x8b, global, node->as.variable.slot);
+    emit_number_guard(e);
+    emit_to_xmm(e, xmm);
+    return true;
+  }
+  case GROUP_EXPR:
+    return compile_number(e, node->as.group.expression, xmm);
+  case UNARY_EXPR:
+    if (node->op != MINUS || !compile_number(e, node->as.unary.right, xmm)) {
+      return false;
+    }
+    // flip the sign bit like C's -
+    emit_from_xmm(e, xmm);
+    EMIT(e, 0x48, 0x0f, 0xba, 0xf8, 63); // btc rax, 63
+    emit_to_xmm(e, xmm);
+    return true;
+  case BINARY_EXPR: {
+    uint8_t op;
+    switch (node->op) {
+    case PLUS:
+      op = 0x58; // addsd
+      break;
+    case MINUS:
+      op = 0x5c; // subsd
+      break;
+    case STAR:
+      op = 0x59; // mulsd
+      break;
+    case SLASH:
+      op = 0x5e; // divsd
+      break;
+    default:
+      return false;
+    }
+    if (!compile_number(e, node->as.binary.left, xmm) ||
+        !compile_number(e, node->as.binary.right, xmm + 1)) {
+      return false;
+    }
+    emit_sse(e, 0xf2, op, xmm, xmm + 1);
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+// Puts the value of node in rax: a comparison of numbers or a number.
+static bool compile_value(Emitter *e, NodeIndex index) {
+  const Node *node = index == NO_NODE ? NULL : ast_node(e->ast, index);
+  if (node == NULL || node_parsed_kind(node) != BINARY_EXPR ||
+      (node->op != GREATER && node->op != GREATER_EQUAL &&
+       node->op != LESS && node->op != LESS_EQUAL)) {
+    if (!compile_number(e, index, 0)) {
+      return false;
+    }
+    emit_from_xmm(e, 0);
+    return true;
+  }
+  if (!compile_number(e, node->as.binary.left, 0) ||
+      !compile_number(e, node->as.binary.right, 1)) {
+    return false;
+  }
+  // seta and setae are false when either is NaN, like C's > and >=; a < b
+  // is b > a
+  bool swap = node->op == LESS || node->op == LESS_EQUAL;
+  bool equal = node->op == GREATER_EQUAL || node->op == LESS_EQUAL;
+  emit_sse(e, 0x66, 0x2e, swap ? 1 : 0, swap ? 0 : 1); // ucomisd
+  EMIT(e, 0x0f, equal ? 0x93 : 0x97, 0xc0);          // seta al / setae al
+  EMIT(e, 0x0f, 0xb6, 0xc0);                         // movzx eax, al
+  // TRUE_VALUE is FALSE_VALUE + 1
+  emit_load_constant(e, R9, FALSE_VALUE);
+  EMIT(e, 0x4c, 0x01, 0xc8); // add rax, r9
+  return true;
+}
+
+static bool compile_node(Emitter *e, NodeIndex index) {
+  EMIT(e, 0x31, 0xc0, 0xc3); // BAIL: xor eax, eax; ret
+  emit_load_constant(e, R8, QNAN);
+  const Node *node = ast_node(e->ast, index);
+  if (node->kind == ASSIGN_STMT) {
+    // evaluates to nil, like visitAssignStmt
+    if (!compile_value(e, node->as.assign.value)) {
+      return false;
+    }
+    bool global;
+    if (!variable_operand(e, node, &global)) {
+      return false;
+    }
+    emit_variable_access(e, 0x89, global, node->as.assign.slot);
+    emit_load_constant(e, RAX, NIL_VALUE);
+  } else if (!compile_value(e, index)) {
+    return false;
+  }
+  EMIT(e, 0x48, 0x89, 0x01);             // mov [rcx], rax
+  EMIT(e, 0xb8, 0x01, 0x00, 0x00, 0x00); // mov eax, 1
+  EMIT(e, 0xc3);                         // ret
+  return !e->failed;
+}
+
+// Copies code into executable memory. Returns its address, NULL if the
+// memory can't be had.
+static const uint8_t *install(Jit *jit, const uint8_t *code, uint32_t size) {
+  Region *region = jit->regions;
+  if (region == NULL || REGION_SIZE - region->used < size) {
+    region = malloc(sizeof(Region));
+    if (region == NULL) {
+      printf("Cannot allocate memory for the JIT");
+      exit(1);
+    }
+    region->code = mmap(NULL, REGION_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region->code == MAP_FAILED) {
+      free(region);
+      return NULL;
+    }
+    region->used = 0;
+    region->next = jit->regions;
+    jit->regions = region;
+  } else if (mprotect(region->code, REGION_SIZE, PROT_READ | PROT_WRITE) !=
+             0) {
+    return NULL;
+  }
+  uint8_t *start = region->code + region->used;
+  memcpy(start, code, size);
+  // the next node's code starts on a cache line
+  region->used = (region->used + size + 63) & ~63u;
+  if (mprotect(region->code, REGION_SIZE, PROT_READ | PROT_EXEC) != 0) {
+    return NULL;
+  }
+  return start;
+}
+
+static bool compile(Jit *jit, const Ast *ast, NodeIndex index,
+                    uint16_t level, JitNode *node) {
+  Emitter *e = malloc(sizeof(Emitter));
+  if (e == NULL) {
+    printf("Cannot allocate memory for the JIT");
+    exit(1);
+  }
+  e->ast = ast;
+  e->level = level;
+  e->count = 0;
+  e->failed = false;
+  const uint8_t *code = NULL;
+  if (compile_node(e, index)) {
+    code = install(jit, e->code, e->count);
+  }
+  free(e);
+  if (code == NULL) {
+    return false;
+  }
+  // skip BAIL
+  node->code = (JitCode)(void *)(code + 3);
+  return true;
+}
+
+static JitTable *table(Jit *jit, const Ast *ast) {
+  for (JitTable *t = jit->tables; t != NULL; t = t->next) {
+    if (t->ast == ast) {
+      return t;
+    }
+  }
+  JitTable *t = malloc(sizeof(JitTable));
+  JitNode *nodes = calloc(ast->node_count + 1, sizeof(JitNode));
+  if (t == NULL || nodes == NULL) {
+    printf("Cannot allocate memory for the JIT");
+    exit(1);
+  }
+  t->ast = ast;
+  t->nodes = nodes;
+  t->next = jit->tables;
+  jit->tables = t;
+  return t;
+}
+
+Jit *jit_new(void) {
+  Jit *jit = malloc(sizeof(Jit));
+  if (jit == NULL) {
+    printf("Cannot allocate memory for the JIT");
+    exit(1);
+  }
+  jit->tables = NULL;
+  jit->current = NULL;
+  jit->regions = NULL;
+  return jit;
+}
+
+void jit_free(Jit *jit) {
+  if (jit == NULL) {
+    return;
+  }
+  for (JitTable *t = jit->tables, *next; t != NULL; t = next) {
+    next = t->next;
+    free(t->nodes);
+    free(t);
+  }
+  for (Region *region = jit->regions, *next; region != NULL;
+       region = next) {
+    next = region->next;
+    munmap(region->code, REGION_SIZE);
+    free(region);
+  }
+  free(jit);
+}
+
+Value jit_run(Jit *jit, const Ast *ast, NodeIndex index,
+              const JitFrame *frame) {
+  if (jit->current == NULL || jit->current->ast != ast) {
+    jit->current = table(jit, ast);
+  }
+  JitNode *node = &jit->current->nodes[index];
+  if (node->code == NULL) {
+    if (node->count == GIVEN_UP || ++node->count < JIT_HOT) {
+      return JIT_NOT_RUN;
+    }
+    if (!compile(jit, ast, index, frame->level, node)) {
+      node->count = GIVEN_UP;
+      return JIT_NOT_RUN;
+    }
+  }
+  Value value;
+  if (node->code(frame->stack, frame->base, frame->globals, &value)) {
+    return value;
+  }
+  if (++node->bailouts == JIT_BAILOUTS_MAX) {
+    node->code = NULL;
+    node->count = GIVEN_UP;
+  }
+  return JIT_NOT_RUN;
+}
+
+#else
+
+Jit *jit_new(void) { return NULL; }
+
+void jit_free(Jit *jit) { (void)jit; }
+
+Value jit_run(Jit *jit, const Ast *ast, NodeIndex index,
+              const JitFrame *frame) {
+  return JIT_NOT_RUN;
+}
+#endif
@@ -0,0 +1,42 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "interpreter.h"
+#include <stdbool.h>
+
+// A baseline JIT for the tree walker, on x86-64 Linux only. A node of
+// arithmetic that has run JIT_HOT times is compiled to native code keeping
+// the numbers in SSE registers: +, -, * and / of numbers, negation,
+// literals and variables that are neither upvalues nor in cells, with a
+// comparison or an assignment of the result at the top. The code checks
+// that every variable it reads holds a number. If one doesn't it bails
+// out before it has written anything and the interpreter evaluates the
+// node instead.
+
+#define JIT_HOT 100
+// bailouts before a node goes back to the interpreter for good
+#define JIT_BAILOUTS_MAX 16
+// a NaN no Lox value has, see value.h
+#define JIT_NOT_RUN ((Value)QNAN)
+
+typedef struct Jit Jit;
+
+// Where the variables of the running code are: the locals d scopes out
+// are at stack[base[-d] + slot], the globals at level 0.
+typedef struct {
+  Value *stack;
+  const uint32_t *base;
+  MapEntry *globals;
+  uint16_t level;
+} JitFrame;
+
+// NULL where there's no JIT
+Jit *jit_new(void);
+void jit_free(Jit *jit);
+
+// Counts a run of node index of ast, compiling it once it is hot. Returns
+// what the native code evaluated it to, or JIT_NOT_RUN if the interpreter
+// has to.
+Value jit_run(Jit *jit, const Ast *ast, NodeIndex index,
+              const JitFrame *frame);
+#endif
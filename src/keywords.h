@@ -0,0 +1,18 @@
+#ifndef KEYWORDS_H
+#define KEYWORDS_H
+
+#include "tokens.h"
+
+// The reserved words. The scanner does not search this table: keywords_gen
+// turns it into a perfect hash at build time (target/keyword_hash.h).
+typedef struct {
+  const char *key;
+  const TokenType value;
+} Item;
+
+static const Item keywords[] = {
+    {"and", AND},   {"class", CLASS}, {"else", ELSE},     {"false", FALSE},
+    {"for", FOR},   {"fun", FUN},     {"if", IF},         {"nil", NIL},
+    {"or", OR},     {"print", PRINT}, {"return", RETURN}, {"super", SUPER},
+    {"this", THIS}, {"true", TRUE},   {"var", VAR},       {"while", WHILE}};
+#endif
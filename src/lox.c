@@ -1,7 +1,10 @@
+#include "batch.h"
 #include "interpreter.h"
-#include "parser.h"
-#include "scanner.h"
+#include "optimizer.h"
+#include "runner.h"
+#include "source.h"
 #include "utils.h"
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,54 +12,109 @@
 
 int run_file(char *file);
 void run_prompt(void);
-void run(char *source);
+bool run(const char *source, int length);
+static int usage(void);
 static VarMap *environment;
+static RunOptions options = {.scan_threads = 1,
+                             .optimize = OPTIMIZE_DEFAULT};
 
 int main(int argc, char *argv[]) {
+  int jobs = 0;
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0'; arg++) {
+    if (strcmp(argv[arg], "--jobs") == 0 && arg + 1 < argc) {
+      jobs = atoi(argv[++arg]);
+      if (jobs < 1) {
+        return usage();
+      }
+    } else if (strcmp(argv[arg], "--scan-jobs") == 0 && arg + 1 < argc) {
+      options.scan_threads = atoi(argv[++arg]);
+      if (options.scan_threads < 1) {
+        return usage();
+      }
+    } else if (strcmp(argv[arg], "--engine=tree") == 0) {
+      options.engine = ENGINE_TREE;
+    } else if (strcmp(argv[arg], "--engine=vm") == 0) {
+      options.engine = ENGINE_VM;
+    } else if (strcmp(argv[arg], "--engine=closures") == 0) {
+      options.engine = ENGINE_THUNKS;
+    } else if (strcmp(argv[arg], "--cache-dir") == 0 && arg + 1 < argc) {
+      options.cache_dir = argv[++arg];
+    } else if (strcmp(argv[arg], "--gc-stats") == 0) {
+      options.gc_stats = true;
+    } else if (strcmp(argv[arg], "--gc-stress") == 0) {
+      options.gc_stress = true;
+    } else if (strcmp(argv[arg], "--gc-growth") == 0 && arg + 1 < argc) {
+      options.gc_growth = strtod(argv[++arg], NULL);
+      if (!(options.gc_growth > 1)) {
+        return usage();
+      }
+    } else if (strcmp(argv[arg], "--jit") == 0) {
+      options.jit = true;
+    } else if (strcmp(argv[arg], "--stats") == 0) {
+      options.stats = true;
+    } else if (strcmp(argv[arg], "--shape-stats") == 0) {
+      options.shape_stats = true;
+    } else if (strcmp(argv[arg], "--dump-ast") == 0) {
+      options.dump_ast = true;
+    } else if (strncmp(argv[arg], "-O", 2) == 0 && argv[arg][2] >= '0' &&
+               argv[arg][2] <= '0' + OPTIMIZE_MAX && argv[arg][3] == '\0') {
+      options.optimize = argv[arg][2] - '0';
+    } else {
+      return usage();
+    }
+  }
+  int scripts = argc - arg;
+
+  if (jobs > 0) {
+    if (scripts == 0) {
+      return usage();
+    }
+    return run_batch(jobs, argv + arg, scripts, &options);
+  }
+
   environment = newVarMap(NULL);
 
   setvbuf(stdout, NULL, _IONBF, 0);
-  if (argc > 2) {
-    puts("Usage: lox [script]");
-    return EXIT_FAILURE;
-  } else if (argc == 2) {
-    return run_file(argv[1]);
+  if (scripts > 1) {
+    return usage();
+  } else if (scripts == 1) {
+    return run_file(argv[arg]);
   } else {
     run_prompt();
   }
   return EXIT_SUCCESS;
 }
 
-int run_file(char *filename) {
+static int usage(void) {
+  puts("Usage: lox [options] [script | -]");
+  puts("       lox --jobs N [options] script...");
+  puts("Options: --scan-jobs N  -O0 | -O1 | -O2  --dump-ast");
+  puts("         --engine=tree | --engine=vm | --engine=closures  --jit");
+  puts("         --cache-dir DIR");
+  puts("         --gc-stats  --gc-stress  --gc-growth FACTOR");
+  puts("         --shape-stats  --stats");
+  return EXIT_FAILURE;
+}
 
-  FILE *file = fopen(filename, "r");
-  if (file == NULL) {
-    printf("unable to open file '%s'\n", filename);
+int run_file(char *filename) {
+  Source source;
+  if (!source_load(&source, filename, stdout)) {
     return EXIT_FAILURE;
   }
-  char line[255];
-
-  char *content = malloc(1);
-  if (content == NULL) {
-    puts("Out of memory");
+  if (source.length > INT_MAX) {
+    printf("file '%s' is too large\n", filename);
+    source_free(&source);
     return EXIT_FAILURE;
   }
-  content[0] = '\0';
-
-  while (fgets(line, sizeof(line), file)) {
-    content = realloc(content, strlen(content) + strlen(line) + 1);
-    if (content == NULL) {
-      return EXIT_FAILURE;
-    }
-    strcat(content, line);
-  }
 
-  fclose(file);
-
-  run(content);
+  bool ok = run(source.text, (int)source.length);
 
   // FREE UP
-  free(content);
+  source_free(&source);
+  if (!ok) {
+    return -1;
+  }
 
   // if (scan_result.had_error) {
   //   return 65;
@@ -77,14 +135,13 @@ void run_prompt(void) {
     }
 
     int len = (int)strlen(line);
-    run(substring(line, 1, len - 1));
+    char *source = substring(line, 1, len - 1);
+    run(source, len - 1);
+    free(source);
   }
 }
 
-void run(char *source) {
-  ScanResult scan_result = scan_tokens(source);
-  // tokenlist_print(&scan_result.token_list);
-  ExpressionList *list = parse(&scan_result.token_list);
-  // exprlist_print(list);
-  interpret(environment, list);
+// Returns false if the script failed to resolve or stopped on an error.
+bool run(const char *source, int length) {
+  return run_script(environment, source, length, &options, stdout);
 }
@@ -0,0 +1,185 @@
+#include "object.h"
+#include "gc.h"
+#include "intern.h"
+#include "parser.h"
+#include "shape.h"
+#include <stdlib.h>
+
+static ObjString *new_string(Heap *heap, int length, size_t inline_size) {
+  ObjString *string = (ObjString *)gc_allocate(
+      heap, sizeof(ObjString) + inline_size, OBJ_STRING);
+  string->length = length;
+  string->hash = 0;
+  string->chars = NULL;
+  string->left = NULL;
+  string->right = NULL;
+  return string;
+}
+
+ObjClosure *new_closure(Heap *heap, const Function *function,
+                        uint32_t upvalue_count) {
+  ObjClosure *closure = (ObjClosure *)gc_allocate(
+      heap, sizeof(ObjClosure) + sizeof(Value) * upvalue_count, OBJ_CLOSURE);
+  closure->function = function;
+  closure->upvalue_count = upvalue_count;
+  for (uint32_t i = 0; i < upvalue_count; i++) {
+    closure->upvalues[i] = NIL_VALUE;
+  }
+  return closure;
+}
+
+Value new_cell(Heap *heap, Value value) {
+  uint32_t temps = heap->temp_count;
+  gc_protect(heap, value);
+  ObjCell *cell = (ObjCell *)gc_allocate(heap, sizeof(ObjCell), OBJ_CELL);
+  gc_unprotect(heap, temps);
+  cell->value = value;
+  return obj_value(&cell->obj);
+}
+
+Value new_class(Heap *heap, const char *name, const ObjClass *superclass,
+                const Value *methods, uint32_t method_count) {
+  uint32_t inherited = superclass == NULL ? 0 : superclass->method_count;
+  ObjClass *klass = (ObjClass *)gc_allocate(
+      heap,
+      sizeof(ObjClass) + sizeof(Method) * (inherited + method_count),
+      OBJ_CLASS);
+  klass->name = name;
+  klass->field_hint = 0;
+  klass->method_count = inherited;
+  if (inherited > 0) {
+    memcpy(klass->methods, superclass->methods, sizeof(Method) * inherited);
+  }
+  for (uint32_t i = 0; i < method_count; i++) {
+    const Function *function = as_closure(methods[i])->function;
+    const char *method = function->ast->names[function->name];
+    uint32_t j = 0;
+    while (j < klass->method_count && klass->methods[j].name != method) {
+      j++;
+    }
+    if (j == klass->method_count) {
+      klass->method_count += 1;
+    }
+    klass->methods[j] = (Method){method, methods[i]};
+  }
+  klass->init = class_method(klass, intern("init", 4));
+  klass->shape = shape_root(heap, klass);
+  return obj_value(&klass->obj);
+}
+
+Value class_method(const ObjClass *klass, const char *name) {
+  for (uint32_t i = 0; i < klass->method_count; i++) {
+    if (klass->methods[i].name == name) {
+      return klass->methods[i].method;
+    }
+  }
+  return NIL_VALUE;
+}
+
+// Instances get room for as many fields as the class's have ended up with
+// so far, so most never have to grow.
+Value new_instance(Heap *heap, ObjClass *klass) {
+  uint32_t capacity = klass->field_hint;
+  ObjInstance *instance = (ObjInstance *)gc_allocate(
+      heap, sizeof(ObjInstance) + sizeof(Value) * capacity, OBJ_INSTANCE);
+  instance->shape = klass->shape;
+  instance->capacity = capacity;
+  instance->fields = instance->inline_fields;
+  return obj_value(&instance->obj);
+}
+
+Value new_bound_method(Heap *heap, Value receiver, ObjClosure *method) {
+  uint32_t temps = heap->temp_count;
+  gc_protect(heap, receiver);
+  gc_protect(heap, obj_value(&method->obj));
+  ObjBoundMethod *bound = (ObjBoundMethod *)gc_allocate(
+      heap, sizeof(ObjBoundMethod), OBJ_BOUND_METHOD);
+  gc_unprotect(heap, temps);
+  bound->receiver = receiver;
+  bound->method = method;
+  return obj_value(&bound->obj);
+}
+
+Value string_concat(Heap *heap, Value left, Value right) {
+  ObjString *l = as_string(left);
+  ObjString *r = as_string(right);
+  if (l->length > STRING_LENGTH_MAX - r->length) {
+    return NIL_VALUE;
+  }
+  int length = l->length + r->length;
+  uint32_t temps = heap->temp_count;
+  gc_protect(heap, left);
+  gc_protect(heap, right);
+  ObjString *string;
+  if (length < STRING_FLAT_MAX) {
+    // both halves are short, so they aren't ropes
+    string = new_string(heap, length, length + 1);
+    string->chars = string->inline_chars;
+    memcpy(string->chars, l->chars, l->length);
+    memcpy(string->chars + l->length, r->chars, r->length);
+    string->chars[length] = '\0';
+    string->hash = hash_string(string->chars, length);
+  } else {
+    string = new_string(heap, length, 0);
+    string->left = l;
+    string->right = r;
+  }
+  gc_unprotect(heap, temps);
+  return obj_value(&string->obj);
+}
+
+// Copies the leaves from right to left, with a stack of the ropes still to
+// visit: a rope built by appending in a loop is as deep as it is long.
+static void flatten(ObjString *rope) {
+  char *chars = malloc(rope->length + 1);
+  ObjString **stack = malloc(sizeof(ObjString *) * 16);
+  if (chars == NULL || stack == NULL) {
+    printf("Cannot allocate memory for a string");
+    exit(1);
+  }
+  uint32_t count = 0;
+  uint32_t capacity = 16;
+  int end = rope->length;
+  stack[count++] = rope;
+  while (count > 0) {
+    ObjString *string = stack[--count];
+    if (string->chars != NULL) {
+      end -= string->length;
+      memcpy(chars + end, string->chars, string->length);
+      continue;
+    }
+    if (count + 2 > capacity) {
+      capacity *= 2;
+      stack = realloc(stack, sizeof(ObjString *) * capacity);
+      if (stack == NULL) {
+        printf("Cannot allocate memory for a string");
+        exit(1);
+      }
+    }
+    stack[count++] = string->left;
+    stack[count++] = string->right;
+  }
+  free(stack);
+  chars[rope->length] = '\0';
+  rope->chars = chars;
+  rope->hash = hash_string(chars, rope->length);
+  // the halves can be collected now
+  rope->left = NULL;
+  rope->right = NULL;
+}
+
+const char *string_chars(ObjString *string) {
+  if (string->chars == NULL) {
+    flatten(string);
+  }
+  return string->chars;
+}
+
+bool strings_equal(ObjString *left, ObjString *right) {
+  if (left->length != right->length) {
+    return false;
+  }
+  const char *l = string_chars(left);
+  const char *r = string_chars(right);
+  return left->hash == right->hash && memcmp(l, r, left->length) == 0;
+}
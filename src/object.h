@@ -0,0 +1,196 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include "value.h"
+#include <limits.h>
+#include <stddef.h>
+
+typedef enum {
+  OBJ_STRING,
+  OBJ_CLOSURE,
+  OBJ_CELL,
+  OBJ_CLASS,
+  OBJ_INSTANCE,
+  OBJ_BOUND_METHOD,
+} ObjType;
+
+// Header of every object a Value can point to. Objects made at run time are
+// linked into the list of their Heap (see gc.h); interned strings live
+// until the process exits, are in no list and are always marked.
+struct Obj {
+  Obj *next;
+  uint8_t type;
+  bool marked;
+};
+
+// Short strings keep their characters inline, in the same allocation.
+// Concatenations of STRING_FLAT_MAX or more characters are ropes instead:
+// they only point to their halves until something needs the characters, so
+// appending to a long string in a loop doesn't copy it every time.
+#define STRING_FLAT_MAX 64
+// longest a string can get, with room for its NUL
+#define STRING_LENGTH_MAX (INT_MAX - 1)
+
+typedef struct ObjString ObjString;
+
+struct ObjString {
+  Obj obj;
+  int length;
+  uint32_t hash;      // hash_string(chars, length), once chars is set
+  char *chars;        // NUL-terminated; NULL for a rope not flattened yet
+  ObjString *left;    // the halves of a rope, NULL once it is flattened
+  ObjString *right;
+  char inline_chars[]; // chars of a string that isn't a rope
+};
+
+static inline bool is_obj_type(Value value, ObjType type) {
+  return is_obj(value) && as_obj(value)->type == type;
+}
+
+static inline bool is_string(Value value) {
+  return is_obj_type(value, OBJ_STRING);
+}
+
+static inline ObjString *as_string(Value value) {
+  return (ObjString *)as_obj(value);
+}
+
+// The string object whose chars these are, like the ones intern() returns.
+static inline ObjString *string_header(const char *chars) {
+  return (ObjString *)(chars - offsetof(ObjString, inline_chars));
+}
+
+// The characters of string, flattening it first if it is a rope.
+const char *string_chars(ObjString *string);
+bool strings_equal(ObjString *left, ObjString *right);
+
+// interned must come from intern()
+static inline Value string_value(const char *interned) {
+  return obj_value(&string_header(interned)->obj);
+}
+
+typedef struct Heap Heap;
+typedef struct Function Function; // see parser.h
+
+// Closures are flat: they copy the values of the variables they use when
+// they're made, so they never keep a whole scope alive. A variable that is
+// captured and also assigned lives in a cell instead, which all its users
+// share.
+typedef struct {
+  Obj obj;
+  const Function *function;
+  uint32_t upvalue_count;
+  Value upvalues[];
+} ObjClosure;
+
+typedef struct {
+  Obj obj;
+  Value value;
+} ObjCell;
+
+typedef struct Shape Shape; // see shape.h
+
+// Methods are copied down from the superclass when a class is made, so
+// finding one never walks up the hierarchy.
+typedef struct {
+  const char *name; // interned
+  Value method;     // an ObjClosure
+} Method;
+
+typedef struct {
+  Obj obj;
+  const char *name;
+  Shape *shape;        // of its instances before they get any field
+  Value init;          // the 'init' method, nil if it has none
+  uint32_t field_hint; // fields its instances have ended up with so far
+  uint32_t method_count;
+  Method methods[];
+} ObjClass;
+
+// Instances with the same fields, added in the same order, share a Shape
+// that maps the field names to slots, so the fields are a plain array.
+typedef struct {
+  Obj obj;
+  Shape *shape;
+  uint32_t capacity;    // of fields
+  Value *fields;        // inline_fields until it has to grow
+  Value inline_fields[];
+} ObjInstance;
+
+// A method read off an instance without calling it.
+typedef struct {
+  Obj obj;
+  Value receiver;
+  ObjClosure *method;
+} ObjBoundMethod;
+
+// Calls nested deeper than this are a runtime error, before the engines
+// that recurse in C run out of stack. Tail calls don't nest.
+#define CALL_DEPTH_MAX 2048
+
+static inline bool is_closure(Value value) {
+  return is_obj_type(value, OBJ_CLOSURE);
+}
+
+static inline ObjClosure *as_closure(Value value) {
+  return (ObjClosure *)as_obj(value);
+}
+
+static inline ObjCell *as_cell(Value value) { return (ObjCell *)as_obj(value); }
+
+static inline bool is_class(Value value) {
+  return is_obj_type(value, OBJ_CLASS);
+}
+
+static inline ObjClass *as_class(Value value) {
+  return (ObjClass *)as_obj(value);
+}
+
+static inline bool is_instance(Value value) {
+  return is_obj_type(value, OBJ_INSTANCE);
+}
+
+static inline ObjInstance *as_instance(Value value) {
+  return (ObjInstance *)as_obj(value);
+}
+
+static inline bool is_bound_method(Value value) {
+  return is_obj_type(value, OBJ_BOUND_METHOD);
+}
+
+static inline ObjBoundMethod *as_bound_method(Value value) {
+  return (ObjBoundMethod *)as_obj(value);
+}
+
+// The upvalues are nil until the caller copies the captured values in.
+ObjClosure *new_closure(Heap *heap, const Function *function,
+                        uint32_t upvalue_count);
+Value new_cell(Heap *heap, Value value);
+// methods are closures, overriding the superclass's of the same name;
+// superclass may be NULL. Both must be reachable by the collector.
+Value new_class(Heap *heap, const char *name, const ObjClass *superclass,
+                const Value *methods, uint32_t method_count);
+// klass must be reachable by the collector.
+Value new_instance(Heap *heap, ObjClass *klass);
+Value new_bound_method(Heap *heap, Value receiver, ObjClosure *method);
+// The method called name, or nil.
+Value class_method(const ObjClass *klass, const char *name);
+
+// A new string in heap: the characters of left followed by those of right.
+// nil if that would be longer than STRING_LENGTH_MAX, which ropes make
+// cheap to get to.
+Value string_concat(Heap *heap, Value left, Value right);
+
+// Lox ==. Interned strings are equal when their pointers are; strings built
+// at run time have to be compared by their characters.
+static inline bool values_equal(Value left, Value right) {
+  if (is_number(left) && is_number(right)) {
+    return as_number(left) == as_number(right);
+  }
+  if (left == right) {
+    return true;
+  }
+  return is_string(left) && is_string(right) &&
+         strings_equal(as_string(left), as_string(right));
+}
+#endif
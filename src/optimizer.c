@@ -0,0 +1,338 @@
+#include "optimizer.h"
+#include "intern.h"
+#include <stdlib.h>
+
+// What -O2 knows about one variable name of the script.
+typedef struct {
+  const char *name; // interned, NULL for a free slot
+  int declarations;
+  bool assigned;
+  bool live;         // declared with a literal and still in scope
+  bool global;       // declared outside any block or function
+  uint32_t constant; // its value while live
+} Binding;
+
+typedef struct {
+  Ast *ast;
+  int level;
+  int scopes;    // blocks, functions and classes the optimizer is in
+  int functions; // ... of which functions
+  Binding *bindings; // open addressing on the interned name
+  uint32_t binding_mask;
+} Optimizer;
+
+static NodeIndex optimize_expression(Optimizer *o, NodeIndex index);
+static bool optimize_statement(Optimizer *o, NodeIndex index);
+static void optimize_list(Optimizer *o, uint32_t first, uint32_t *count);
+static void end_scope(Optimizer *o, uint32_t first, uint32_t count);
+
+static Binding *binding(Optimizer *o, const char *name) {
+  uint32_t slot = intern_hash(name) & o->binding_mask;
+  while (o->bindings[slot].name != NULL && o->bindings[slot].name != name) {
+    slot = (slot + 1) & o->binding_mask;
+  }
+  o->bindings[slot].name = name;
+  return &o->bindings[slot];
+}
+
+// A variable can be propagated when the script declares it exactly once,
+// never assigns it and it doesn't exist yet (a second 'var' is an error that
+// keeps the old value). Only a function can shadow a name, with a second
+// declaration, so a name declared once identifies its variable.
+static void find_bindings(Optimizer *o, VarMap *environment) {
+  uint32_t capacity = 16;
+  while (capacity < o->ast->name_count * 2) {
+    capacity *= 2;
+  }
+  o->bindings = calloc(capacity, sizeof(Binding));
+  if (o->bindings == NULL) {
+    printf("Cannot allocate memory for the optimizer");
+    exit(1);
+  }
+  o->binding_mask = capacity - 1;
+
+  for (uint32_t i = 0; i < o->ast->node_count; i++) {
+    const Node *node = ast_node(o->ast, i);
+    if (node->kind == VARIABLE_STMT) {
+      const char *name = o->ast->names[node->as.assign.name];
+      Binding *b = binding(o, name);
+      b->declarations += 1;
+      if (environment != NULL && var_isdefined(environment, name)) {
+        b->assigned = true;
+      }
+    } else if (node->kind == ASSIGN_STMT) {
+      binding(o, o->ast->names[node->as.assign.name])->assigned = true;
+    }
+  }
+}
+
+// nil literals have no entry in the constants table, so they aren't folded.
+static bool is_constant(Optimizer *o, NodeIndex index) {
+  const Node *node = ast_node(o->ast, index);
+  return node->kind == LITERAL_EXPR &&
+         node->as.literal.constant != NIL_CONSTANT;
+}
+
+static Value constant(Optimizer *o, NodeIndex index) {
+  return o->ast->constants[ast_node(o->ast, index)->as.literal.constant];
+}
+
+static bool is_literal(Optimizer *o, NodeIndex index, bool (*is_type)(Value)) {
+  return is_constant(o, index) && is_type(constant(o, index));
+}
+
+static void make_literal(Optimizer *o, NodeIndex index, Value value) {
+  Node *node = &o->ast->nodes[index];
+  node->kind = LITERAL_EXPR;
+  node->op = 0;
+  node->as.literal.constant = ast_add_constant(o->ast, value);
+}
+
+// Only folds what visitUnary can't fail on or print.
+static void fold_unary(Optimizer *o, NodeIndex index) {
+  const Node *node = ast_node(o->ast, index);
+  NodeIndex right = node->as.unary.right;
+  if (node->op == MINUS && is_literal(o, right, is_number)) {
+    make_literal(o, index, number_value(-as_number(constant(o, right))));
+  } else if (node->op == BANG && is_literal(o, right, is_bool)) {
+    make_literal(o, index, bool_value(is_falsey(constant(o, right))));
+  }
+}
+
+// Mirrors visitBinary. Operands of the wrong type are left for the
+// interpreter to report.
+static void fold_binary(Optimizer *o, NodeIndex index) {
+  const Node *node = ast_node(o->ast, index);
+  NodeIndex left = node->as.binary.left;
+  NodeIndex right = node->as.binary.right;
+
+  // != isn't folded: visitBinary doesn't negate it, so neither would this
+  if (node->op == EQUAL_EQUAL) {
+    if (is_constant(o, left) && is_constant(o, right)) {
+      bool equal = values_equal(constant(o, left), constant(o, right));
+      make_literal(o, index, bool_value(equal));
+    }
+    return;
+  }
+
+  if (!is_literal(o, left, is_number) || !is_literal(o, right, is_number)) {
+    return;
+  }
+  double l = as_number(constant(o, left));
+  double r = as_number(constant(o, right));
+  Value value;
+  switch (node->op) {
+  case MINUS:
+    value = number_value(l - r);
+    break;
+  case PLUS:
+    value = number_value(l + r);
+    break;
+  case SLASH:
+    value = number_value(l / r);
+    break;
+  case STAR:
+    value = number_value(l * r);
+    break;
+  case GREATER:
+    value = bool_value(l > r);
+    break;
+  case GREATER_EQUAL:
+    value = bool_value(l >= r);
+    break;
+  case LESS:
+    value = bool_value(l < r);
+    break;
+  case LESS_EQUAL:
+    value = bool_value(l <= r);
+    break;
+  default:
+    return;
+  }
+  make_literal(o, index, value);
+}
+
+// Returns the node to use in place of index.
+static NodeIndex optimize_expression(Optimizer *o, NodeIndex index) {
+  if (index == NO_NODE) {
+    return NO_NODE;
+  }
+  Node *node = &o->ast->nodes[index];
+  switch ((NodeKind)node->kind) {
+  case GROUP_EXPR:
+    return optimize_expression(o, node->as.group.expression);
+  case BINARY_EXPR:
+    node->as.binary.left = optimize_expression(o, node->as.binary.left);
+    node->as.binary.right = optimize_expression(o, node->as.binary.right);
+    fold_binary(o, index);
+    return index;
+  case UNARY_EXPR:
+    node->as.unary.right = optimize_expression(o, node->as.unary.right);
+    fold_unary(o, index);
+    return index;
+  case ASSIGN_STMT:
+    node->as.assign.value = optimize_expression(o, node->as.assign.value);
+    return index;
+  case VARIABLE_EXPR:
+    if (o->level >= 2) {
+      // A function can outlive the script: the environment keeps it, and
+      // a later script in it may assign the globals it reads.
+      Binding *b = binding(o, o->ast->names[node->as.variable.name]);
+      if (b->live && !(b->global && o->functions > 0)) {
+        node->kind = LITERAL_EXPR;
+        node->op = 0;
+        node->as.literal.constant = b->constant;
+      }
+    }
+    return index;
+  case CALL_EXPR: {
+    node->as.call.callee = optimize_expression(o, node->as.call.callee);
+    NodeIndex *arguments = &o->ast->lists[node->as.call.first];
+    for (uint32_t i = 0; i < node->as.call.count; i++) {
+      arguments[i] = optimize_expression(o, arguments[i]);
+    }
+    return index;
+  }
+  case FUNCTION_EXPR: {
+    // the parameters are never left out
+    Function *function = ast_function(o->ast, node);
+    uint32_t body = function->count - function->arity;
+    o->scopes++;
+    o->functions++;
+    optimize_list(o, function->first + function->arity, &body);
+    o->functions--;
+    o->scopes--;
+    function->count = function->arity + body;
+    end_scope(o, function->first, function->count);
+    return index;
+  }
+  case CLASS_EXPR: {
+    uint32_t first = node->as.klass.first;
+    uint32_t count = node->as.klass.count;
+    o->scopes++;
+    for (uint32_t i = 0; i < count; i++) {
+      NodeIndex member = o->ast->lists[first + i];
+      if (ast_node(o->ast, member)->kind == VARIABLE_STMT) {
+        optimize_statement(o, member); // 'super'
+      } else {
+        optimize_expression(o, member);
+      }
+    }
+    o->scopes--;
+    end_scope(o, first, count);
+    return index;
+  }
+  case GET_EXPR:
+    node->as.property.object = optimize_expression(o, node->as.property.object);
+    return index;
+  case SET_EXPR:
+    optimize_expression(o, node->as.set.target);
+    node->as.set.value = optimize_expression(o, node->as.set.value);
+    return index;
+  default:
+    return index;
+  }
+}
+
+// Drops the statements of a block, or the script, that optimize to nothing.
+static void optimize_list(Optimizer *o, uint32_t first, uint32_t *count) {
+  NodeIndex *statements = &o->ast->lists[first];
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < *count; i++) {
+    if (optimize_statement(o, statements[i])) {
+      statements[kept++] = statements[i];
+    }
+  }
+  *count = kept;
+}
+
+// The variables declared in a scope go out of scope at its end.
+static void end_scope(Optimizer *o, uint32_t first, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    const Node *statement = ast_node(o->ast, o->ast->lists[first + i]);
+    if (statement->kind == VARIABLE_STMT) {
+      binding(o, o->ast->names[statement->as.assign.name])->live = false;
+    }
+  }
+}
+
+// Returns false if the statement can be left out.
+static bool optimize_statement(Optimizer *o, NodeIndex index) {
+  Node *node = &o->ast->nodes[index];
+  switch ((NodeKind)node->kind) {
+  case EXPR_STMT: {
+    NodeIndex expression = optimize_expression(o, node->as.group.expression);
+    node->as.group.expression = expression;
+    NodeKind kind = ast_node(o->ast, expression)->kind;
+    return kind != LITERAL_EXPR && kind != ERROR_EXPR;
+  }
+  case PRINT_STMT:
+    node->as.group.expression =
+        optimize_expression(o, node->as.group.expression);
+    return true;
+  case VARIABLE_STMT: {
+    NodeIndex value = optimize_expression(o, node->as.assign.value);
+    node->as.assign.value = value;
+    if (o->level >= 2 && value != NO_NODE) {
+      Binding *b = binding(o, o->ast->names[node->as.assign.name]);
+      if (is_constant(o, value) && b->declarations == 1 && !b->assigned) {
+        b->live = true;
+        b->global = o->scopes == 0;
+        b->constant = ast_node(o->ast, value)->as.literal.constant;
+      }
+    }
+    return true;
+  }
+  case BLOCK_STMT: {
+    uint32_t first = node->as.block.first;
+    uint32_t count = node->as.block.count;
+    o->scopes++;
+    optimize_list(o, first, &count);
+    o->scopes--;
+    node = &o->ast->nodes[index];
+    node->as.block.count = count;
+    end_scope(o, first, count);
+    return true;
+  }
+  case RETURN_STMT:
+    node->as.group.expression =
+        optimize_expression(o, node->as.group.expression);
+    return true;
+  case WHILE_STMT: {
+    NodeIndex condition = optimize_expression(o, node->as.loop.condition);
+    node->as.loop.condition = condition;
+    if (condition != NO_NODE && is_constant(o, condition) &&
+        is_falsey(constant(o, condition))) {
+      return false;
+    }
+    node->as.loop.increment = optimize_expression(o, node->as.loop.increment);
+    NodeIndex body = node->as.loop.body;
+    if (!optimize_statement(o, body)) {
+      Node *empty = &o->ast->nodes[body];
+      empty->kind = BLOCK_STMT;
+      empty->as.block.count = 0;
+    }
+    return true;
+  }
+  default:
+    return true;
+  }
+}
+
+void optimize(Ast *ast, int level, VarMap *environment) {
+  if (level <= OPTIMIZE_NONE) {
+    return;
+  }
+  Optimizer optimizer;
+  optimizer.ast = ast;
+  optimizer.level = level;
+  optimizer.scopes = 0;
+  optimizer.functions = 0;
+  optimizer.bindings = NULL;
+  optimizer.binding_mask = 0;
+  find_bindings(&optimizer, environment);
+
+  optimize_list(&optimizer, ast->first_statement, &ast->statement_count);
+
+  free(optimizer.bindings);
+}
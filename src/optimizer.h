@@ -0,0 +1,19 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "interpreter.h"
+
+// -O0 runs the AST as parsed.
+// -O1 folds operators over literals, drops redundant groups and expression
+//     statements without effects.
+// -O2 also replaces variables that are never reassigned by their literal
+//     value.
+#define OPTIMIZE_NONE 0
+#define OPTIMIZE_DEFAULT 1
+#define OPTIMIZE_MAX 2
+
+// Rewrites ast in place. environment is the one the script will run in:
+// variables that already exist there are left alone. New constants are
+// allocated in ast->arena.
+void optimize(Ast *ast, int level, VarMap *environment);
+#endif
@@ -1,437 +1,839 @@
 #include "parser.h"
+#include "intern.h"
+#include "utils.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-bool is_at_end(void);
-Token *peek(void);
-void expr_print(const Expression *expr);
-Expression *declaration(void);
-bool match1(TokenType t);
-bool match2(TokenType type1, TokenType type2);
-bool match3(TokenType type1, TokenType type2, TokenType type3);
-bool match4(TokenType type1, TokenType type2, TokenType type3, TokenType type4);
-bool check(TokenType t);
-Token *advance(void);
-Token *previous(void);
-Expression *var_declaration(void);
-Expression *expression(void);
-Expression *statement(void);
-Expression *printStatement(void);
-ExpressionList *parse_block(void);
-Expression *expressionStatement(void);
-Expression *assignment(void);
-Expression *equality(void);
-Expression *comparison(void);
-Expression *term(void);
-Expression *factor(void);
-Expression *unary(void);
-Expression *primary(void);
-Expression *newExpression(char *type);
-Token *consume(TokenType type, char *message);
-
-static TokenList *tokens;
-static int current;
-
-ExpressionList *parse(TokenList *tokens_to_parse) {
-  ExpressionList *statements = newExpressionList();
-
-  tokens = tokens_to_parse;
-  current = 0;
-
-  while (!is_at_end()) {
-    exprlist_add(statements, declaration());
-  }
-  return statements;
-}
-
-Expression *declaration(void) {
-  if (match1(VAR)) {
-    return var_declaration();
+typedef struct Parser Parser;
+
+bool is_at_end(Parser *p);
+Token *peek(Parser *p);
+NodeIndex declaration(Parser *p);
+bool match1(Parser *p, TokenType t);
+bool check(Parser *p, TokenType t);
+Token *advance(Parser *p);
+Token *previous(Parser *p);
+NodeIndex var_declaration(Parser *p);
+NodeIndex fun_declaration(Parser *p);
+NodeIndex class_declaration(Parser *p);
+NodeIndex expression(Parser *p);
+NodeIndex statement(Parser *p);
+NodeIndex printStatement(Parser *p);
+NodeIndex whileStatement(Parser *p);
+NodeIndex forStatement(Parser *p);
+NodeIndex returnStatement(Parser *p);
+NodeIndex expressionStatement(Parser *p);
+Token *consume(Parser *p, TokenType type, char *message);
+static void error_at(Parser *p, Token *token, const char *message);
+static void synchronize(Parser *p, int start);
+static double token_number(Token *token);
+static NodeIndex add_node(Parser *p, Node node);
+static uint32_t add_name(Parser *p, const char *name);
+static void push_pending(Parser *p, NodeIndex statement);
+static uint32_t pop_pending(Parser *p, uint32_t base);
+
+// All state of one parse, so several scripts can be parsed concurrently.
+struct Parser {
+  TokenList *tokens;
+  Ast *ast;
+  int current;
+  Token error_token;
+  FILE *out; // where errors are reported
+  bool had_error;
+  bool panic; // errors are not reported until the next statement
+  // statements of the blocks and arguments of the calls being parsed, moved
+  // to ast->lists as each one closes so that every list ends up contiguous
+  NodeIndex *pending;
+  uint32_t pending_count;
+  uint32_t pending_capacity;
+};
+
+Ast *parse(TokenList *tokens_to_parse, Arena *arena, FILE *out) {
+  Ast *ast = arena_alloc(arena, sizeof(Ast));
+  memset(ast, 0, sizeof(Ast));
+  ast->arena = arena;
+
+  Parser parser;
+  parser.tokens = tokens_to_parse;
+  parser.ast = ast;
+  parser.current = 0;
+  parser.pending = NULL;
+  parser.pending_count = 0;
+  parser.pending_capacity = 0;
+  parser.out = out;
+  parser.had_error = false;
+  parser.panic = false;
+  Parser *p = &parser;
+
+  while (!is_at_end(p)) {
+    push_pending(p, declaration(p));
+  }
+  ast->statement_count = p->pending_count;
+  ast->first_statement = pop_pending(p, 0);
+
+  free(parser.pending);
+  return parser.had_error ? NULL : ast;
+}
+
+NodeIndex declaration(Parser *p) {
+  int start = p->current;
+  NodeIndex node;
+  if (match1(p, VAR)) {
+    node = var_declaration(p);
+  } else if (match1(p, FUN)) {
+    node = fun_declaration(p);
+  } else if (match1(p, CLASS)) {
+    node = class_declaration(p);
   } else {
-    return statement();
+    node = statement(p);
   }
+  if (p->panic) {
+    synchronize(p, start);
+  }
+  return node;
+}
+
+// After an error, skips to what looks like the start of the next statement:
+// past a ';' or '}' that ends one, or up to a keyword that begins one or the
+// '}' that may close the block it is in. A declaration that went wrong on
+// its first token loses at least that one, so that parsing always moves on.
+static void synchronize(Parser *p, int start) {
+  p->panic = false;
+  if (p->current == start) {
+    advance(p);
+  }
+  while (!is_at_end(p)) {
+    TokenType last = previous(p)->type;
+    if (last == SEMICOLON || last == RIGHT_BRACE) {
+      return;
+    }
+    switch (peek(p)->type) {
+    case CLASS:
+    case FUN:
+    case VAR:
+    case FOR:
+    case IF:
+    case WHILE:
+    case PRINT:
+    case RETURN:
+    case RIGHT_BRACE:
+      return;
+    default:
+      advance(p);
+    }
+  }
+}
+
+NodeIndex var_declaration(Parser *p) {
+  Token *name = consume(p, IDENTIFIER, "Expected a variable name");
+  NodeIndex initializer = NO_NODE;
+  if (match1(p, EQUAL)) {
+    initializer = expression(p);
+  }
+  consume(p, SEMICOLON, "Expected semicolon");
+  if (name->type == ERROR) {
+    Node error = {.kind = ERROR_EXPR};
+    return add_node(p, error);
+  }
+  Node variableStatement = {.kind = VARIABLE_STMT};
+  variableStatement.as.assign.name = add_name(p, name->symbol);
+  variableStatement.as.assign.value = initializer;
+  return add_node(p, variableStatement);
+}
+
+// Parses the parameters and the body of a function or method into a
+// FUNCTION_EXPR. They are one list: they are a single scope.
+static NodeIndex function(Parser *p, Token *name) {
+  consume(p, LEFT_PAREN, "Expected '(' after the function name");
+  uint32_t base = p->pending_count;
+  if (!check(p, RIGHT_PAREN)) {
+    do {
+      Token *parameter = consume(p, IDENTIFIER, "Expected a parameter name");
+      if (parameter->type != ERROR) {
+        Node declaration = {.kind = VARIABLE_STMT};
+        declaration.as.assign.name = add_name(p, parameter->symbol);
+        declaration.as.assign.value = NO_NODE;
+        push_pending(p, add_node(p, declaration));
+      }
+    } while (match1(p, COMMA));
+  }
+  uint32_t arity = p->pending_count - base;
+  consume(p, RIGHT_PAREN, "Expected ')' after the parameters");
+  consume(p, LEFT_BRACE, "Expected '{' before the function body");
+  while (!check(p, RIGHT_BRACE) && !is_at_end(p)) {
+    push_pending(p, declaration(p));
+  }
+  consume(p, RIGHT_BRACE, "Expected '}' after the function body");
+  if (name->type == ERROR) {
+    p->pending_count = base;
+    Node error = {.kind = ERROR_EXPR};
+    return add_node(p, error);
+  }
+
+  Ast *ast = p->ast;
+  ast->functions = arena_grow(ast->arena, ast->functions, ast->function_count,
+                              &ast->function_capacity, sizeof(Function));
+  Function *function = &ast->functions[ast->function_count];
+  memset(function, 0, sizeof(Function));
+  function->name = add_name(p, name->symbol);
+  function->arity = arity;
+  function->count = p->pending_count - base;
+  function->first = pop_pending(p, base);
+  Node value = {.kind = FUNCTION_EXPR};
+  value.as.function.index = ast->function_count++;
+  return add_node(p, value);
+}
+
+static NodeIndex declare(Parser *p, uint32_t name, NodeIndex value) {
+  Node declaration = {.kind = VARIABLE_STMT};
+  declaration.as.assign.name = name;
+  declaration.as.assign.value = value;
+  return add_node(p, declaration);
 }
 
-Expression *var_declaration(void) {
-  Token *name = consume(IDENTIFIER, "Expected a variable name");
-  Expression *initializer = NULL;
-  if (match1(EQUAL)) {
-    initializer = expression();
+NodeIndex fun_declaration(Parser *p) {
+  Token *name = consume(p, IDENTIFIER, "Expected a function name");
+  NodeIndex value = function(p, name);
+  if (ast_node(p->ast, value)->kind == ERROR_EXPR) {
+    return value;
   }
-  consume(SEMICOLON, "Expected semicolon");
-  Expression *variableStatement = newExpression("VariableStmt");
-  variableStatement->name = name->lexeme;
-  variableStatement->left = initializer;
-  return variableStatement;
+  return declare(p, ast_function(p->ast, ast_node(p->ast, value))->name,
+                 value);
 }
 
-Expression *statement(void) {
-  if (match1(PRINT)) {
-    return printStatement();
+// The methods of a subclass are made in a scope of their own holding the
+// superclass as 'super', which they capture like any other variable.
+NodeIndex class_declaration(Parser *p) {
+  Token *name = consume(p, IDENTIFIER, "Expected a class name");
+  uint32_t base = p->pending_count;
+  Node klass = {.kind = CLASS_EXPR};
+  if (match1(p, LESS)) {
+    Token *superclass = consume(p, IDENTIFIER, "Expected a superclass name");
+    if (superclass->type != ERROR) {
+      Node variable = {.kind = VARIABLE_EXPR};
+      variable.as.variable.name = add_name(p, superclass->symbol);
+      NodeIndex value = add_node(p, variable);
+      push_pending(p, declare(p, add_name(p, intern("super", 5)), value));
+      klass.op = CLASS_SUBCLASS;
+    }
   }
-  if (match1(LEFT_BRACE)) {
-    Expression *block = newExpression("Block");
+  consume(p, LEFT_BRACE, "Expected '{' before the class body");
+  while (!check(p, RIGHT_BRACE) && !is_at_end(p)) {
+    Token *method = consume(p, IDENTIFIER, "Expected a method name");
+    if (method->type == ERROR) {
+      advance(p);
+      continue;
+    }
+    NodeIndex value = function(p, method);
+    if (ast_node(p->ast, value)->kind != ERROR_EXPR) {
+      push_pending(p, value);
+    }
+  }
+  consume(p, RIGHT_BRACE, "Expected '}' after the class body");
+  if (name->type == ERROR) {
+    p->pending_count = base;
+    Node error = {.kind = ERROR_EXPR};
+    return add_node(p, error);
+  }
+  klass.as.klass.name = add_name(p, name->symbol);
+  klass.as.klass.count = p->pending_count - base;
+  klass.as.klass.first = pop_pending(p, base);
+  return declare(p, klass.as.klass.name, add_node(p, klass));
+}
 
-    ExpressionList *block_statements = newExpressionList();
+NodeIndex statement(Parser *p) {
+  if (match1(p, PRINT)) {
+    return printStatement(p);
+  }
+  if (match1(p, RETURN)) {
+    return returnStatement(p);
+  }
+  if (match1(p, WHILE)) {
+    return whileStatement(p);
+  }
+  if (match1(p, FOR)) {
+    return forStatement(p);
+  }
+  if (match1(p, LEFT_BRACE)) {
+    uint32_t base = p->pending_count;
 
-    while (!check(RIGHT_BRACE) && !is_at_end()) {
-      exprlist_add(block_statements, declaration());
+    while (!check(p, RIGHT_BRACE) && !is_at_end(p)) {
+      push_pending(p, declaration(p));
     }
-    advance();
+    consume(p, RIGHT_BRACE, "Expected '}' after the block");
 
-    block->block = block_statements;
-    return block;
+    Node block = {.kind = BLOCK_STMT};
+    block.as.block.count = p->pending_count - base;
+    block.as.block.first = pop_pending(p, base);
+    return add_node(p, block);
   }
 
-  return expressionStatement();
+  return expressionStatement(p);
+}
+
+NodeIndex printStatement(Parser *p) {
+  NodeIndex value = expression(p);
+  consume(p, SEMICOLON, "Expected semicolon");
+  Node print = {.kind = PRINT_STMT};
+  print.as.group.expression = value;
+  return add_node(p, print);
 }
 
-Expression *printStatement(void) {
-  Expression *value = expression();
-  consume(SEMICOLON, "Expected semicolon");
-  Expression *print = newExpression("PrintStmt");
-  print->left = value;
-  return print;
+// The value of 'return f(x);' is a tail call: the frame of the function
+// returning can be reused for f.
+NodeIndex returnStatement(Parser *p) {
+  NodeIndex value = NO_NODE;
+  if (!check(p, SEMICOLON)) {
+    value = expression(p);
+    if (ast_node(p->ast, value)->kind == CALL_EXPR) {
+      p->ast->nodes[value].op = CALL_TAIL;
+    }
+  }
+  consume(p, SEMICOLON, "Expected semicolon");
+  Node statement = {.kind = RETURN_STMT};
+  statement.as.group.expression = value;
+  return add_node(p, statement);
 }
 
-Expression *expressionStatement(void) {
-  Expression *value = expression();
-  consume(SEMICOLON, "Expected semicolon");
-  Expression *statement = newExpression("ExprStmt");
-  statement->left = value;
-  return statement;
+NodeIndex whileStatement(Parser *p) {
+  consume(p, LEFT_PAREN, "Expected '(' after 'while'");
+  NodeIndex condition = expression(p);
+  consume(p, RIGHT_PAREN, "Expected ')' after condition");
+  Node loop = {.kind = WHILE_STMT};
+  loop.as.loop.condition = condition;
+  loop.as.loop.body = statement(p);
+  loop.as.loop.increment = NO_NODE;
+  return add_node(p, loop);
 }
 
-Expression *expression(void) { return assignment(); }
+// A for loop is a while loop with an increment, in a block of its own
+// with the initializer if there is one.
+NodeIndex forStatement(Parser *p) {
+  consume(p, LEFT_PAREN, "Expected '(' after 'for'");
+  NodeIndex initializer = NO_NODE;
+  if (match1(p, VAR)) {
+    initializer = var_declaration(p);
+  } else if (!match1(p, SEMICOLON)) {
+    initializer = expressionStatement(p);
+  }
+  Node loop = {.kind = WHILE_STMT};
+  loop.as.loop.condition = NO_NODE;
+  if (!check(p, SEMICOLON)) {
+    loop.as.loop.condition = expression(p);
+  }
+  consume(p, SEMICOLON, "Expected ';' after loop condition");
+  loop.as.loop.increment = NO_NODE;
+  if (!check(p, RIGHT_PAREN)) {
+    loop.as.loop.increment = expression(p);
+  }
+  consume(p, RIGHT_PAREN, "Expected ')' after for clauses");
+  loop.as.loop.body = statement(p);
+  NodeIndex index = add_node(p, loop);
+  if (initializer == NO_NODE) {
+    return index;
+  }
+
+  uint32_t base = p->pending_count;
+  push_pending(p, initializer);
+  push_pending(p, index);
+  Node block = {.kind = BLOCK_STMT};
+  block.as.block.count = 2;
+  block.as.block.first = pop_pending(p, base);
+  return add_node(p, block);
+}
 
-Expression *assignment(void) {
-  Expression *expr = equality();
-  if (match1(EQUAL)) {
-    Token *equals = previous();
-    Expression *value = assignment();
-    if (strcmp(expr->type, "Variable") == 0) {
-      Expression *assign = newExpression("AssignStmt");
-      assign->name = expr->name;
-      assign->left = value;
-      return assign;
-    }
-    Expression *error = newExpression("Error");
-    error->operator= equals;
-    return error;
-  }
-  return expr;
-}
+NodeIndex expressionStatement(Parser *p) {
+  NodeIndex value = expression(p);
+  consume(p, SEMICOLON, "Expected semicolon");
+  Node statement = {.kind = EXPR_STMT};
+  statement.as.group.expression = value;
+  return add_node(p, statement);
+}
 
-Expression *equality(void) {
-  Expression *expr = comparison();
-  while (match2(BANG_EQUAL, EQUAL_EQUAL)) {
-    Token *operator= previous();
-    Expression *right = comparison();
-    Expression *binary = newExpression("BinaryExpr");
-    binary->operator= operator;
-    binary->left = expr;
-    binary->right = right;
-    expr = binary;
-  }
-  return expr;
+// Expressions are parsed by precedence climbing over the rules table below:
+// one call per operand and operator instead of a call per precedence level.
+typedef enum {
+  PREC_NONE,
+  PREC_ASSIGNMENT, // =
+  PREC_EQUALITY,   // == !=
+  PREC_COMPARISON, // < > <= >=
+  PREC_TERM,       // + -
+  PREC_FACTOR,     // * /
+  PREC_UNARY,      // ! -
+  PREC_CALL        // ()
+} Precedence;
+
+// token is the one the rule was chosen for, already consumed
+typedef NodeIndex (*PrefixFn)(Parser *p, Token *token);
+typedef NodeIndex (*InfixFn)(Parser *p, Token *token, NodeIndex left);
+
+typedef struct {
+  PrefixFn prefix;
+  InfixFn infix;
+  Precedence precedence; // of the infix operator
+} ParseRule;
+
+static NodeIndex parse_precedence(Parser *p, Precedence precedence);
+
+NodeIndex expression(Parser *p) {
+  return parse_precedence(p, PREC_ASSIGNMENT);
 }
 
-Expression *comparison(void) {
-  Expression *expr = term();
-  while (match4(GREATER, GREATER_EQUAL, LESS, LESS_EQUAL)) {
-    Token *operator= previous();
-    Expression *right = term();
-    Expression *binary = newExpression("BinaryExpr");
-    binary->operator= operator;
-    binary->left = expr;
-    binary->right = right;
-    expr = binary;
-  }
-  return expr;
+static NodeIndex literal(Parser *p, uint32_t constant) {
+  Node literal = {.kind = LITERAL_EXPR};
+  literal.as.literal.constant = constant;
+  return add_node(p, literal);
 }
 
-Expression *term(void) {
-  Expression *expr = factor();
-  while (match2(MINUS, PLUS)) {
-    Token *operator= previous();
-    Expression *right = factor();
-    Expression *binary = newExpression("BinaryExpr");
-    binary->operator= operator;
-    binary->left = expr;
-    binary->right = right;
-    expr = binary;
-  }
-  return expr;
+static NodeIndex boolean(Parser *p, Token *token) {
+  Value value = bool_value(token->type == TRUE);
+  return literal(p, ast_add_constant(p->ast, value));
 }
 
-Expression *factor(void) {
-  Expression *expr = unary();
-  while (match2(SLASH, STAR)) {
-    Token *operator= previous();
-    Expression *right = unary();
-    Expression *binary = newExpression("BinaryExpr");
-    binary->operator= operator;
-    binary->left = expr;
-    binary->right = right;
-    expr = binary;
-  }
-  return expr;
+static NodeIndex nil(Parser *p, Token *token) {
+  return literal(p, NIL_CONSTANT);
 }
 
-Expression *unary(void) {
-  if (match2(BANG, MINUS)) {
-    Token *operator= previous();
-    Expression *right = unary();
-    Expression *unary = newExpression("Unary");
-    unary->operator= operator;
-    unary->right = right;
-    return unary;
-  }
-  return primary();
+static NodeIndex number(Parser *p, Token *token) {
+  Value value = number_value(token_number(token));
+  return literal(p, ast_add_constant(p->ast, value));
 }
 
-Expression *primary(void) {
-  Expression *r = newExpression("Literal");
-  if (match1(FALSE)) {
-    r->value = newBoolean(false);
-    return r;
-  }
-  if (match1(TRUE)) {
-    r->value = newBoolean(true);
-    return r;
-  }
+static NodeIndex string(Parser *p, Token *token) {
+  Value value = string_value(token->symbol);
+  return literal(p, ast_add_constant(p->ast, value));
+}
 
-  if (match1(NIL)) {
-    r->name = "nil";
-    r->value = NULL;
-    return r;
-  }
+static NodeIndex variable(Parser *p, Token *token) {
+  Node var = {.kind = VARIABLE_EXPR};
+  var.as.variable.name = add_name(p, token->symbol);
+  return add_node(p, var);
+}
 
-  if (check(NUMBER)) {
-    advance();
-    r->value = newNumber(strtod(previous()->literal, NULL));
-    return r;
-  }
-  if (check(STRING)) {
-    advance();
-    r->value = newString(previous()->literal);
-    return r;
-  }
-  if (match1(IDENTIFIER)) {
-    Expression *var = newExpression("Variable");
-    var->name = previous()->lexeme;
-    return var;
-  }
-  if (match1(LEFT_PAREN)) {
-    Expression *expr = expression();
-    Expression *group = newExpression("Group");
-    consume(RIGHT_PAREN, "Expect ')' after expression.");
-    group->left = expr;
-    return group;
-  }
+static NodeIndex keyword_variable(Parser *p, const char *name) {
+  Node var = {.kind = VARIABLE_EXPR};
+  var.as.variable.name = add_name(p, intern(name, (int)strlen(name)));
+  return add_node(p, var);
+}
 
-  Expression *error = newExpression("Error");
-  return error;
+// 'this' is the variable in slot 0 of a method.
+static NodeIndex this_(Parser *p, Token *token) {
+  return keyword_variable(p, "this");
 }
 
-Token *consume(TokenType type, char *message) {
-  // printf("%s==%s\n", token_name(type), token_name(peek()->type));
-  if (check(type)) {
-    return advance();
-  }
+// 'super.name' is looked up in the superclass and bound to 'this'.
+static NodeIndex super_(Parser *p, Token *token) {
+  consume(p, DOT, "Expected '.' after 'super'");
+  Token *name = consume(p, IDENTIFIER, "Expected a superclass method name");
+  if (name->type == ERROR) {
+    Node error = {.kind = ERROR_EXPR};
+    return add_node(p, error);
+  }
+  Node super = {.kind = SUPER_EXPR};
+  super.as.super.superclass = keyword_variable(p, "super");
+  super.as.super.receiver = keyword_variable(p, "this");
+  super.as.super.name = add_name(p, name->symbol);
+  return add_node(p, super);
+}
+
+static NodeIndex grouping(Parser *p, Token *token) {
+  NodeIndex expr = expression(p);
+  consume(p, RIGHT_PAREN, "Expect ')' after expression.");
+  Node group = {.kind = GROUP_EXPR};
+  group.as.group.expression = expr;
+  return add_node(p, group);
+}
 
-  Token *t = newToken();
-  t->type = ERROR;
-  t->lexeme = message;
+static NodeIndex unary(Parser *p, Token *token) {
+  NodeIndex right = parse_precedence(p, PREC_UNARY);
+  Node unary = {.kind = UNARY_EXPR, .op = token->type};
+  unary.as.unary.right = right;
+  return add_node(p, unary);
+}
 
-  tokenlist_add(tokens, t);
-  return tokenlist_last(tokens);
+static NodeIndex binary(Parser *p, Token *token, NodeIndex left);
+static NodeIndex assignment(Parser *p, Token *token, NodeIndex left);
+static NodeIndex call(Parser *p, Token *token, NodeIndex callee);
+static NodeIndex dot(Parser *p, Token *token, NodeIndex object);
+
+static const ParseRule rules[] = {
+    [LEFT_PAREN] = {grouping, call, PREC_CALL},
+    [DOT] = {NULL, dot, PREC_CALL},
+    [MINUS] = {unary, binary, PREC_TERM},
+    [PLUS] = {NULL, binary, PREC_TERM},
+    [SLASH] = {NULL, binary, PREC_FACTOR},
+    [STAR] = {NULL, binary, PREC_FACTOR},
+    [BANG] = {unary, NULL, PREC_NONE},
+    [BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
+    [EQUAL] = {NULL, assignment, PREC_ASSIGNMENT},
+    [EQUAL_EQUAL] = {NULL, binary, PREC_EQUALITY},
+    [GREATER] = {NULL, binary, PREC_COMPARISON},
+    [GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
+    [LESS] = {NULL, binary, PREC_COMPARISON},
+    [LESS_EQUAL] = {NULL, binary, PREC_COMPARISON},
+    [IDENTIFIER] = {variable, NULL, PREC_NONE},
+    [STRING] = {string, NULL, PREC_NONE},
+    [NUMBER] = {number, NULL, PREC_NONE},
+    [FALSE] = {boolean, NULL, PREC_NONE},
+    [NIL] = {nil, NULL, PREC_NONE},
+    [TRUE] = {boolean, NULL, PREC_NONE},
+    [THIS] = {this_, NULL, PREC_NONE},
+    [SUPER] = {super_, NULL, PREC_NONE},
+    [ERROR] = {NULL, NULL, PREC_NONE},
+};
+
+// Binary operators are left associative: the right operand only takes
+// operators that bind tighter.
+static NodeIndex binary(Parser *p, Token *token, NodeIndex left) {
+  NodeIndex right = parse_precedence(p, rules[token->type].precedence + 1);
+  Node binary = {.kind = BINARY_EXPR, .op = token->type};
+  binary.as.binary.left = left;
+  binary.as.binary.right = right;
+  return add_node(p, binary);
 }
 
-bool match1(TokenType type) {
-  if (check(type)) {
-    advance();
-    return true;
+static NodeIndex assignment(Parser *p, Token *token, NodeIndex left) {
+  NodeIndex value = parse_precedence(p, PREC_ASSIGNMENT);
+  const Node *target = ast_node(p->ast, left);
+  if (target->kind == VARIABLE_EXPR) {
+    Node assign = {.kind = ASSIGN_STMT};
+    assign.as.assign.name = target->as.variable.name;
+    assign.as.assign.value = value;
+    return add_node(p, assign);
+  }
+  if (target->kind == GET_EXPR) {
+    Node set = {.kind = SET_EXPR};
+    set.as.set.target = left;
+    set.as.set.value = value;
+    return add_node(p, set);
+  }
+  error_at(p, token, "Invalid assignment target");
+  Node error = {.kind = ERROR_EXPR, .op = token->type};
+  return add_node(p, error);
+}
+
+static NodeIndex call(Parser *p, Token *token, NodeIndex callee) {
+  uint32_t base = p->pending_count;
+  if (!check(p, RIGHT_PAREN)) {
+    do {
+      push_pending(p, expression(p));
+    } while (match1(p, COMMA));
+  }
+  consume(p, RIGHT_PAREN, "Expected ')' after the arguments");
+  Node call = {.kind = CALL_EXPR};
+  call.as.call.callee = callee;
+  call.as.call.count = p->pending_count - base;
+  call.as.call.first = pop_pending(p, base);
+  return add_node(p, call);
+}
+
+static NodeIndex dot(Parser *p, Token *token, NodeIndex object) {
+  Token *name = consume(p, IDENTIFIER, "Expected a property name after '.'");
+  if (name->type == ERROR) {
+    Node error = {.kind = ERROR_EXPR};
+    return add_node(p, error);
+  }
+  Node get = {.kind = GET_EXPR};
+  get.as.property.object = object;
+  get.as.property.name = add_name(p, name->symbol);
+  get.as.property.cache = 0;
+  return add_node(p, get);
+}
+
+static NodeIndex parse_precedence(Parser *p, Precedence precedence) {
+  Token *token = peek(p);
+  PrefixFn prefix = rules[token->type].prefix;
+  NodeIndex left;
+  if (prefix != NULL) {
+    advance(p);
+    left = prefix(p, token);
   } else {
-    return false;
+    // not an expression; declaration() skips it
+    error_at(p, token, "Expected an expression");
+    Node error = {.kind = ERROR_EXPR};
+    left = add_node(p, error);
+  }
+
+  for (;;) {
+    token = peek(p);
+    const ParseRule *rule = &rules[token->type];
+    if (rule->infix == NULL || rule->precedence < precedence) {
+      return left;
+    }
+    advance(p);
+    left = rule->infix(p, token, left);
   }
 }
 
-bool match2(TokenType type1, TokenType type2) {
-  if (check(type1) || check(type2)) {
-    advance();
-    return true;
-  } else {
-    return false;
+Token *consume(Parser *p, TokenType type, char *message) {
+  // printf("%s==%s\n", token_name(type), token_name(peek(p)->type));
+  if (check(p, type)) {
+    return advance(p);
   }
+
+  error_at(p, peek(p), message);
+  p->error_token.type = ERROR;
+  p->error_token.start = message;
+  p->error_token.length = (int)strlen(message);
+  p->error_token.line = peek(p)->line;
+  p->error_token.symbol = NULL;
+  return &p->error_token;
 }
 
-bool match3(TokenType type1, TokenType type2, TokenType type3) {
-  if (check(type1) || check(type2) || check(type3)) {
-    advance();
-    return true;
+// Reports the first error of a statement on out, in the scanner's format.
+static void error_at(Parser *p, Token *token, const char *message) {
+  if (p->panic) {
+    return;
+  }
+  p->panic = true;
+  p->had_error = true;
+  if (token->type == END_OF_FILE) {
+    fprintf(p->out, "*[Line %i] Error at end : %s\n", token->line, message);
   } else {
-    return false;
+    fprintf(p->out, "*[Line %i] Error at '%.*s' : %s\n", token->line,
+            token->length, token->start, message);
   }
 }
 
-bool match4(TokenType type1, TokenType type2, TokenType type3,
-            TokenType type4) {
-  if (check(type1) || check(type2) || check(type3) || check(type4)) {
-    advance();
+// Numbers are not NUL-terminated in the source, so strtod could read past the
+// token (e.g. into an identifier starting with 'e').
+static double token_number(Token *token) {
+  char buffer[64];
+  if (token->length < (int)sizeof(buffer)) {
+    memcpy(buffer, token->start, token->length);
+    buffer[token->length] = '\0';
+    return strtod(buffer, NULL);
+  }
+  char *text = substring(token->start, 1, token->length);
+  double number = strtod(text, NULL);
+  free(text);
+  return number;
+}
+
+bool match1(Parser *p, TokenType type) {
+  if (check(p, type)) {
+    advance(p);
     return true;
   } else {
     return false;
   }
 }
 
-Token *advance(void) {
-  if (!is_at_end()) {
-    current += 1;
+Token *advance(Parser *p) {
+  if (!is_at_end(p)) {
+    p->current += 1;
   }
-  return previous();
+  return previous(p);
 }
 
-Token *previous(void) { return tokenlist_get(tokens, current - 1); }
+// The parser never moves past END_OF_FILE, so these need no bounds checks.
+Token *previous(Parser *p) { return &p->tokens->tokens[p->current - 1]; }
 
-bool check(TokenType type) { return peek()->type == type; }
+bool check(Parser *p, TokenType type) { return peek(p)->type == type; }
 
-bool is_at_end(void) { return peek()->type == END_OF_FILE; }
+bool is_at_end(Parser *p) { return peek(p)->type == END_OF_FILE; }
 
-Token *peek(void) { return tokenlist_get(tokens, current); }
+Token *peek(Parser *p) { return &p->tokens->tokens[p->current]; }
 
-ExpressionList *newExpressionList() {
-  ExpressionList *list = malloc(sizeof(ExpressionList));
-  if (list == NULL) {
-    printf("Cannot allocate memory for ExpressionList");
-    exit(1);
-  }
-
-  list->expressions = malloc(sizeof(Expression) * 32);
-  if (list->expressions == NULL) {
-    printf("Cannot allocate memory for ExpressionList");
-    exit(1);
-  }
-  list->size = 0;
-  list->capacity = 32;
-  return list;
+static NodeIndex add_node(Parser *p, Node node) {
+  Ast *ast = p->ast;
+  ast->nodes = arena_grow(ast->arena, ast->nodes, ast->node_count,
+                          &ast->node_capacity, sizeof(Node));
+  ast->nodes[ast->node_count] = node;
+  return ast->node_count++;
 }
 
-void exprlist_add(ExpressionList *list, Expression *value) {
-  if (list->size >= list->capacity) {
-    list->capacity *= 2;
-    list->expressions =
-        realloc(list->expressions, sizeof(Expression) * list->capacity);
-  }
-  list->expressions[list->size++] = value;
+uint32_t ast_add_constant(Ast *ast, Value value) {
+  ast->constants = arena_grow(ast->arena, ast->constants,
+                              ast->constant_count, &ast->constant_capacity,
+                              sizeof(Value));
+  ast->constants[ast->constant_count] = value;
+  return ast->constant_count++;
 }
 
-Expression *exprlist_get(ExpressionList *list, int index) {
-  if (index >= list->size || index < 0) {
-    printf("Index %d out of bounds for list of size %d\n", index, list->size);
-    exit(1);
-  }
-  return list->expressions[index];
+static uint32_t add_name(Parser *p, const char *name) {
+  Ast *ast = p->ast;
+  ast->names = arena_grow(ast->arena, ast->names, ast->name_count,
+                          &ast->name_capacity, sizeof(const char *));
+  ast->names[ast->name_count] = name;
+  return ast->name_count++;
 }
 
-void exprlist_print(ExpressionList *list) {
-  for (int i = 0; i < list->size; i++) {
-    Expression *expr = exprlist_get(list, i);
-    expr_print(expr);
-  }
-  printf("\n");
-}
-
-void exprlist_free(ExpressionList *list) { free(list->expressions); }
-
-void expr_print(const Expression *expr) {
-  printf("Expr[type: %s", expr->type);
-  if (expr->left != NULL) {
-    printf(", left: ");
-    expr_print(expr->left);
-  }
-  if (expr->right != NULL) {
-    printf(", right: ");
-    expr_print(expr->right);
-  }
-  if (expr->operator!= NULL && expr->operator->lexeme != NULL) {
-    printf(", operator: %s", expr->operator->lexeme);
-  }
-  if (expr->name != NULL) {
-    printf(", name: %s", expr->name);
-    if (strcmp(expr->name, "nil") == 0 && expr->value == NULL) {
-      printf(", value: NULL");
+static void push_pending(Parser *p, NodeIndex statement) {
+  if (p->pending_count == p->pending_capacity) {
+    p->pending_capacity =
+        p->pending_capacity == 0 ? 32 : p->pending_capacity * 2;
+    p->pending = realloc(p->pending, sizeof(NodeIndex) * p->pending_capacity);
+    if (p->pending == NULL) {
+      printf("Cannot allocate memory for statement list");
+      exit(1);
     }
   }
-  if (expr->value != NULL) {
-    printf(", value: %s", value_string(expr->value));
-  }
-  printf("]");
+  p->pending[p->pending_count++] = statement;
 }
 
-Expression *newExpression(char *type) {
-  Expression *e = malloc(sizeof(Expression));
-  e->type = type;
-  e->left = NULL;
-  e->right = NULL;
-  e->name = NULL;
-  e->operator= NULL;
-  e->value = NULL;
-  e->block = NULL;
-  return e;
+// Moves the pending statements from base on to the AST's lists and returns
+// where they start there.
+static uint32_t pop_pending(Parser *p, uint32_t base) {
+  Ast *ast = p->ast;
+  uint32_t first = ast->list_count;
+  for (uint32_t i = base; i < p->pending_count; i++) {
+    ast->lists = arena_grow(ast->arena, ast->lists, ast->list_count,
+                            &ast->list_capacity, sizeof(NodeIndex));
+    ast->lists[ast->list_count++] = p->pending[i];
+  }
+  p->pending_count = base;
+  return first;
 }
 
-Value *newString(char *string) {
-  Value *value = newValue();
-  value->type = STRINGTYPE;
-  value->value.string = string;
-  return value;
+void ast_print(const Ast *ast, FILE *out) {
+  for (uint32_t i = 0; i < ast->statement_count; i++) {
+    expr_print(ast, ast_statement(ast, i), out);
+    fprintf(out, "\n");
+  }
 }
 
-Value *newBoolean(bool boolean) {
-  Value *value = newValue();
-  value->type = BOOLEANTYPE;
-  value->value.boolean = boolean;
-  return value;
+void expr_print(const Ast *ast, NodeIndex index, FILE *out) {
+  const Node *node = ast_node(ast, index);
+  fprintf(out, "Expr[type: %s", node_kind_name(node->kind));
+  switch (node->kind) {
+  case BINARY_EXPR:
+    fprintf(out, ", left: ");
+    expr_print(ast, node->as.binary.left, out);
+    fprintf(out, ", right: ");
+    expr_print(ast, node->as.binary.right, out);
+    fprintf(out, ", operator: %s", token_name(node->op));
+    break;
+  case UNARY_EXPR:
+    fprintf(out, ", right: ");
+    expr_print(ast, node->as.unary.right, out);
+    fprintf(out, ", operator: %s", token_name(node->op));
+    break;
+  case LITERAL_EXPR:
+    if (node->as.literal.constant == NIL_CONSTANT) {
+      fprintf(out, ", value: NULL");
+    } else {
+      char buffer[VALUE_STRING_SIZE];
+      fprintf(out, ", value: %s",
+              value_string(ast->constants[node->as.literal.constant], buffer));
+    }
+    break;
+  case GROUP_EXPR:
+  case EXPR_STMT:
+  case PRINT_STMT:
+    fprintf(out, ", left: ");
+    expr_print(ast, node->as.group.expression, out);
+    break;
+  case RETURN_STMT:
+    if (node->as.group.expression != NO_NODE) {
+      fprintf(out, ", left: ");
+      expr_print(ast, node->as.group.expression, out);
+    }
+    break;
+  case VARIABLE_EXPR:
+    fprintf(out, ", name: %s", ast->names[node->as.variable.name]);
+    break;
+  case ASSIGN_STMT:
+  case VARIABLE_STMT:
+    if (node->as.assign.value != NO_NODE) {
+      fprintf(out, ", left: ");
+      expr_print(ast, node->as.assign.value, out);
+    }
+    fprintf(out, ", name: %s", ast->names[node->as.assign.name]);
+    break;
+  case BLOCK_STMT:
+    fprintf(out, ", block: ");
+    for (uint32_t i = 0; i < node->as.block.count; i++) {
+      expr_print(ast, ast->lists[node->as.block.first + i], out);
+    }
+    break;
+  case WHILE_STMT:
+    if (node->as.loop.condition != NO_NODE) {
+      fprintf(out, ", condition: ");
+      expr_print(ast, node->as.loop.condition, out);
+    }
+    fprintf(out, ", body: ");
+    expr_print(ast, node->as.loop.body, out);
+    if (node->as.loop.increment != NO_NODE) {
+      fprintf(out, ", increment: ");
+      expr_print(ast, node->as.loop.increment, out);
+    }
+    break;
+  case FUNCTION_EXPR: {
+    const Function *function = ast_function(ast, node);
+    fprintf(out, ", name: %s, arity: %u, body: ", ast->names[function->name],
+            function->arity);
+    for (uint32_t i = 0; i < function->count; i++) {
+      expr_print(ast, ast->lists[function->first + i], out);
+    }
+    break;
+  }
+  case CALL_EXPR:
+    fprintf(out, ", callee: ");
+    expr_print(ast, node->as.call.callee, out);
+    fprintf(out, ", arguments: ");
+    for (uint32_t i = 0; i < node->as.call.count; i++) {
+      expr_print(ast, ast->lists[node->as.call.first + i], out);
+    }
+    break;
+  case CLASS_EXPR:
+    fprintf(out, ", name: %s, body: ", ast->names[node->as.klass.name]);
+    for (uint32_t i = 0; i < node->as.klass.count; i++) {
+      expr_print(ast, ast->lists[node->as.klass.first + i], out);
+    }
+    break;
+  case GET_EXPR:
+    fprintf(out, ", object: ");
+    expr_print(ast, node->as.property.object, out);
+    fprintf(out, ", name: %s", ast->names[node->as.property.name]);
+    break;
+  case SET_EXPR:
+    fprintf(out, ", target: ");
+    expr_print(ast, node->as.set.target, out);
+    fprintf(out, ", value: ");
+    expr_print(ast, node->as.set.value, out);
+    break;
+  case SUPER_EXPR:
+    fprintf(out, ", name: %s", ast->names[node->as.super.name]);
+    break;
+  case ERROR_EXPR:
+    break;
+  }
+  fprintf(out, "]");
 }
 
-Value *newNumber(double number) {
-  Value *value = newValue();
-  value->type = NUMBERTYPE;
-  value->value.number = number;
-  return value;
+char *d_to_s(double d, char *str) {
+  snprintf(str, VALUE_STRING_SIZE, "%lf", d);
+  return str;
 }
 
-Value *newValue(void) {
-  Value *value = malloc(sizeof(Value));
-  if (value == NULL) {
-    printf("can't allocate memory for Value");
-    exit(1);
+const char *value_string(Value value, char *buffer) {
+  if (is_string(value)) {
+    return string_chars(as_string(value));
   }
-  return value;
-}
-
-char *d_to_s(double d) {
-  char *str = (char *)malloc(50);
-  if (str == NULL) {
-    puts("cannot allocate memory for string");
-    exit(1);
+  if (is_bool(value)) {
+    return as_bool(value) ? "true" : "false";
   }
-  snprintf(str, sizeof(str), "%lf", d); //
-  return str;
-}
-
-const char *value_string(Value *v) {
-  switch (v->type) {
-  case STRINGTYPE:
-    return v->value.string;
-  case BOOLEANTYPE:
-    return v->value.boolean ? "true" : "false";
-  case NUMBERTYPE:
-    return d_to_s(v->value.number);
-  case EXPR:
-    return v->value.expr->type;
+  if (is_nil(value)) {
+    return "nil";
+  }
+  if (is_closure(value) || is_bound_method(value)) {
+    const Function *function = is_closure(value)
+                                   ? as_closure(value)->function
+                                   : as_bound_method(value)->method->function;
+    snprintf(buffer, VALUE_STRING_SIZE, "<fn %s>",
+             function->ast->names[function->name]);
+    return buffer;
+  }
+  if (is_class(value)) {
+    return as_class(value)->name;
+  }
+  if (is_instance(value)) {
+    snprintf(buffer, VALUE_STRING_SIZE, "%s instance",
+             as_instance(value)->shape->klass->name);
+    return buffer;
   }
+  return d_to_s(as_number(value), buffer);
 }
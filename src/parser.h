@@ -1,56 +1,236 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include "arena.h"
+#include "object.h"
+#include "shape.h"
 #include "tokens.h"
+#include <stdint.h>
+#include <stdio.h>
 
-typedef struct Expression Expression;
-typedef struct ExpressionList ExpressionList;
-
-typedef union ValueHolder {
-  double number;
-  char *string;
-  bool boolean;
-  Expression *expr;
-} ValueHolder;
-
-typedef enum { NUMBERTYPE, STRINGTYPE, BOOLEANTYPE, EXPR } Type;
-
-typedef struct Value {
-  Type type;
-  ValueHolder value;
-} Value;
-
-struct Expression {
-  char *type;
-  Expression *left;
-  Expression *right;
-  Token *operator;
-  char *name;
-  Value *value;
-  ExpressionList *block;
+typedef enum {
+  BINARY_EXPR,
+  UNARY_EXPR,
+  LITERAL_EXPR,
+  GROUP_EXPR,
+  VARIABLE_EXPR,
+  ASSIGN_STMT,
+  ERROR_EXPR,
+  EXPR_STMT,
+  PRINT_STMT,
+  VARIABLE_STMT,
+  BLOCK_STMT,
+  WHILE_STMT,
+  FUNCTION_EXPR,
+  CALL_EXPR,
+  RETURN_STMT,
+  CLASS_EXPR,
+  GET_EXPR,
+  SET_EXPR,
+  SUPER_EXPR,
+  // Kinds the tree walker quickens nodes to once they have run, see
+  // interpreter.c. A binary node of numbers keeps its operator in op.
+  ADD_NUMBERS,
+  SUBTRACT_NUMBERS,
+  MULTIPLY_NUMBERS,
+  DIVIDE_NUMBERS,
+  GREATER_NUMBERS,
+  GREATER_EQUAL_NUMBERS,
+  LESS_NUMBERS,
+  LESS_EQUAL_NUMBERS,
+  EQUAL_NUMBERS, // == and !=
+  LOCAL_EXPR,    // VARIABLE_EXPR of a local neither captured nor an upvalue
+  GLOBAL_EXPR    // VARIABLE_EXPR of a global
+} NodeKind;
+
+static inline const char *node_kind_name(NodeKind kind) {
+  static const char *kinds[] = {
+      "BinaryExpr", "Unary",    "Literal",   "Group",        "Variable",
+      "AssignStmt", "Error",    "ExprStmt",  "PrintStmt",    "VariableStmt",
+      "Block",      "WhileStmt", "Function", "Call",         "ReturnStmt",
+      "Class",      "Get",       "Set",      "Super",
+      "AddNumbers", "SubtractNumbers", "MultiplyNumbers", "DivideNumbers",
+      "GreaterNumbers", "GreaterEqualNumbers", "LessNumbers",
+      "LessEqualNumbers", "EqualNumbers", "Local", "Global"};
+
+  return kinds[kind];
+}
+
+// Nodes refer to each other by their index in Ast.nodes.
+typedef uint32_t NodeIndex;
+#define NO_NODE UINT32_MAX
+// LITERAL_EXPR constant of nil
+#define NIL_CONSTANT UINT32_MAX
+
+// Node.op of VARIABLE_EXPR, ASSIGN_STMT and VARIABLE_STMT, set by resolve()
+#define VAR_UPVALUE 1 // slot is an index in the running closure's upvalues
+#define VAR_CELL 2    // captured and assigned: the value is in an ObjCell
+// Node.op of a CALL_EXPR whose value is returned right away
+#define CALL_TAIL 1
+// Node.op of a CLASS_EXPR with a superclass
+#define CLASS_SUBCLASS 1
+
+// A node only holds the payload of its kind; names, literal values and
+// statement lists live in side tables of the Ast.
+typedef struct {
+  uint8_t kind;   // NodeKind
+  uint8_t op;     // TokenType of a BINARY_EXPR or UNARY_EXPR operator, or
+                  // the flags above
+  uint16_t depth; // scopes to go out for a variable, set by resolve()
+  union {
+    struct {
+      NodeIndex left, right;
+      uint32_t deopts; // times the tree walker deoptimized it, see
+                       // interpreter.c; 0 until it runs
+    } binary;
+    struct {
+      NodeIndex right;
+    } unary;
+    struct {
+      uint32_t constant; // index in Ast.constants or NIL_CONSTANT
+    } literal;
+    struct {
+      NodeIndex expression;
+    } group; // also EXPR_STMT, PRINT_STMT and RETURN_STMT
+    struct {
+      uint32_t name; // index in Ast.names
+      uint32_t slot; // index in the VarMap depth scopes out
+    } variable;
+    struct {
+      uint32_t name;
+      NodeIndex value; // NO_NODE for 'var x;'
+      uint32_t slot;
+    } assign; // also VARIABLE_STMT
+    struct {
+      uint32_t first; // index in Ast.lists
+      uint32_t count;
+    } block;
+    struct {
+      NodeIndex condition; // NO_NODE for 'for (;;)'
+      NodeIndex body;
+      NodeIndex increment; // of a for loop, NO_NODE if there is none
+    } loop; // WHILE_STMT, for loops too
+    struct {
+      NodeIndex callee;
+      uint32_t first; // arguments in Ast.lists
+      uint32_t count;
+    } call;
+    struct {
+      uint32_t index; // in Ast.functions
+    } function;
+    struct {
+      uint32_t name;
+      // the FUNCTION_EXPRs of the methods in Ast.lists, after the
+      // VARIABLE_STMT of 'super' if it is a CLASS_SUBCLASS
+      uint32_t first;
+      uint32_t count;
+    } klass;
+    struct {
+      NodeIndex object;
+      uint32_t name;
+      uint32_t cache; // index in Ast.caches, set by resolve()
+    } property; // GET_EXPR, also the callee of a method call
+    struct {
+      NodeIndex target; // the GET_EXPR of the property
+      NodeIndex value;
+    } set;
+    struct {
+      NodeIndex superclass; // VARIABLE_EXPRs of 'super' and 'this'
+      NodeIndex receiver;
+      uint32_t name;
+    } super;
+  } as;
+} Node;
+
+// The kind node was parsed as, before the tree walker quickened it.
+static inline NodeKind node_parsed_kind(const Node *node) {
+  if (node->kind >= LOCAL_EXPR) {
+    return VARIABLE_EXPR;
+  }
+  if (node->kind >= ADD_NUMBERS) {
+    return BINARY_EXPR;
+  }
+  return (NodeKind)node->kind;
+}
+
+// 'fun f(a) {...}' is parsed as a VARIABLE_STMT for f whose value is a
+// FUNCTION_EXPR, and classes the same way. Parameters are VARIABLE_STMTs
+// without a value. Slot 0 of a function is the callee's, which in a
+// method is 'this'; the parameters come after it.
+struct Function {
+  uint32_t name;  // index in Ast.names
+  uint32_t arity;
+  uint32_t first; // the parameters and then the body in Ast.lists
+  uint32_t count;
+  // set by resolve()
+  struct Ast *ast;
+  uint16_t level; // scope level of the parameters and the body
+  uint32_t first_capture; // in Ast.captures
+  uint32_t capture_count;
+  bool initializer; // a class's init, whose calls return slot 0
+  // set by the engine that compiles it
+  const void *code;
 };
 
-typedef struct ExpressionList {
-  Expression **expressions;
-  int size;
-  int capacity;
-} ExpressionList;
+// A value a closure copies when it's made: a variable of the function
+// making it, depth scopes out from where the declaration is, or one of that
+// function's upvalues.
+typedef struct {
+  uint32_t slot; // or index in the upvalues
+  uint16_t depth;
+  bool local;
+} Capture;
+
+// A parsed script. All arrays are allocated in the arena given to parse().
+// Children are always stored before their parents.
+typedef struct Ast {
+  Node *nodes;
+  uint32_t node_count;
+  uint32_t node_capacity;
+  Value *constants;
+  uint32_t constant_count;
+  uint32_t constant_capacity;
+  const char **names; // interned
+  uint32_t name_count;
+  uint32_t name_capacity;
+  NodeIndex *lists; // statements of blocks, each block's contiguous
+  uint32_t list_count;
+  uint32_t list_capacity;
+  Function *functions;
+  uint32_t function_count;
+  uint32_t function_capacity;
+  Capture *captures; // made by resolve(), not cached
+  uint32_t capture_count;
+  uint32_t capture_capacity;
+  PropertyCache *caches; // one per GET_EXPR, made by resolve()
+  uint32_t cache_count;
+  uint32_t first_statement; // the script's top level statements in lists
+  uint32_t statement_count;
+  Arena *arena;
+} Ast;
+
+static inline const Node *ast_node(const Ast *ast, NodeIndex index) {
+  return &ast->nodes[index];
+}
 
-const char *value_string(Value *v);
-Value *newValue(void);
-Value *newString(char *string);
-Value *newNumber(double number);
-Value *newBoolean(bool boolean);
+static inline NodeIndex ast_statement(const Ast *ast, uint32_t i) {
+  return ast->lists[ast->first_statement + i];
+}
 
-ExpressionList *parse(TokenList *tokens);
-ExpressionList *newExpressionList();
-// void exprlist_init(ExpressionList *list);
+static inline Function *ast_function(const Ast *ast, const Node *node) {
+  return &ast->functions[node->as.function.index];
+}
 
-void exprlist_add(ExpressionList *list, Expression *value);
+// The AST is allocated in arena, which must outlive it. The tokens are no
+// longer needed once parse() returns. Syntax errors are reported on out;
+// if there were any, NULL is returned.
+Ast *parse(TokenList *tokens, Arena *arena, FILE *out);
 
-Expression *exprlist_get(ExpressionList *list, int index);
+// Appends value to the constants table and returns its index.
+uint32_t ast_add_constant(Ast *ast, Value value);
 
-void exprlist_print(ExpressionList *list);
+void expr_print(const Ast *ast, NodeIndex index, FILE *out);
 
-void exprlist_free(ExpressionList *list);
+// Prints each top level statement on a line of its own.
+void ast_print(const Ast *ast, FILE *out);
 #endif
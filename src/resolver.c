@@ -0,0 +1,502 @@
+#include "resolver.h"
+#include "intern.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Within a function a name can't be declared again while it is visible, so
+// a single table with the innermost declaration per name covers all scopes.
+// A function may declare a name the code around it has: the outer
+// declaration is set aside in Resolver.shadowed until the scope ends.
+typedef struct {
+  const char *name; // interned, NULL for a free slot
+  bool declared;    // false once its scope has been left
+  uint16_t level;   // scope nesting level, 0 for the environment
+  uint32_t slot;
+  uint32_t function; // index in Resolver.functions of the one declaring it
+  bool initialized;  // false while its own declaration is resolved
+  bool captured;
+  bool assigned;
+  bool captured_early; // by itself, a function that calls itself
+  NodeIndex node;      // the declaration
+  NodeIndex uses;      // linked through Resolver.next_use
+} Declaration;
+
+typedef enum { TYPE_FUNCTION, TYPE_METHOD, TYPE_INITIALIZER } FunctionType;
+
+// A function being resolved; the first one is the script itself.
+typedef struct {
+  FunctionType type;
+  uint16_t level; // of its parameters and body
+  Capture *captures;
+  uint32_t capture_count;
+  uint32_t capture_capacity;
+} FunctionScope;
+
+typedef struct {
+  Ast *ast;
+  FILE *out;
+  bool had_error;
+  Declaration *declarations; // open addressing on the interned name
+  uint32_t mask;
+  uint16_t level;
+  uint32_t *scope_size; // variables declared so far, per open scope
+  FunctionScope *functions;
+  uint32_t function_count; // open functions, the script included
+  uint32_t function_capacity;
+  NodeIndex *next_use; // by node, see Declaration.uses
+  Declaration *shadowed; // outer declarations, innermost scope last
+  uint32_t shadowed_count;
+  uint32_t shadowed_capacity;
+  const char *this_name; // interned
+  const char *super_name;
+  const char *init_name;
+} Resolver;
+
+static void resolve_statement(Resolver *r, NodeIndex index);
+static void resolve_expression(Resolver *r, NodeIndex index);
+
+static void *grow(void *array, uint32_t *capacity, size_t size) {
+  *capacity = *capacity == 0 ? 8 : *capacity * 2;
+  array = realloc(array, size * *capacity);
+  if (array == NULL) {
+    printf("Cannot allocate memory for the resolver");
+    exit(1);
+  }
+  return array;
+}
+
+static Declaration *declaration(Resolver *r, const char *name) {
+  uint32_t slot = intern_hash(name) & r->mask;
+  while (r->declarations[slot].name != NULL &&
+         r->declarations[slot].name != name) {
+    slot = (slot + 1) & r->mask;
+  }
+  r->declarations[slot].name = name;
+  return &r->declarations[slot];
+}
+
+static Declaration *declare(Resolver *r, NodeIndex index) {
+  Node *node = &r->ast->nodes[index];
+  const char *name = r->ast->names[node->as.assign.name];
+  Declaration *d = declaration(r, name);
+  if (d->declared && d->function == r->function_count - 1) {
+    fprintf(r->out, "%s is already defined\n", name);
+    r->had_error = true;
+    return NULL;
+  }
+  if (d->declared) {
+    if (r->shadowed_count == r->shadowed_capacity) {
+      r->shadowed =
+          grow(r->shadowed, &r->shadowed_capacity, sizeof(Declaration));
+    }
+    r->shadowed[r->shadowed_count++] = *d;
+  }
+  d->declared = true;
+  d->level = r->level;
+  d->slot = r->scope_size[r->level]++;
+  d->function = r->function_count - 1;
+  d->initialized = false;
+  d->captured = false;
+  d->assigned = false;
+  d->captured_early = false;
+  d->node = index;
+  d->uses = NO_NODE;
+  node->as.assign.slot = d->slot;
+  return d;
+}
+
+// The index in the upvalues of function f of the variable d, which one of
+// the functions around f declares.
+static uint32_t capture(Resolver *r, uint32_t f, Declaration *d) {
+  Capture wanted;
+  if (d->function == f - 1) {
+    // relative to the function's declaration, one level out of its body
+    wanted.local = true;
+    wanted.depth = r->functions[f].level - 1 - d->level;
+    wanted.slot = d->slot;
+  } else {
+    wanted.local = false;
+    wanted.depth = 0;
+    wanted.slot = capture(r, f - 1, d);
+  }
+  d->captured = true;
+  d->captured_early |= !d->initialized;
+
+  FunctionScope *scope = &r->functions[f];
+  for (uint32_t i = 0; i < scope->capture_count; i++) {
+    const Capture *c = &scope->captures[i];
+    if (c->local == wanted.local && c->depth == wanted.depth &&
+        c->slot == wanted.slot) {
+      return i;
+    }
+  }
+  if (scope->capture_count == scope->capture_capacity) {
+    scope->captures =
+        grow(scope->captures, &scope->capture_capacity, sizeof(Capture));
+  }
+  scope->captures[scope->capture_count] = wanted;
+  return scope->capture_count++;
+}
+
+// Sets the depth and slot of a variable read or assignment. Variables of
+// the functions around the current one are read from its upvalues.
+static Declaration *resolve_name(Resolver *r, NodeIndex index, uint32_t name,
+                                 uint32_t *slot) {
+  Node *node = &r->ast->nodes[index];
+  Declaration *d = declaration(r, r->ast->names[name]);
+  if (!d->declared) {
+    if (d->name == r->this_name) {
+      fprintf(r->out, "Can't use 'this' outside of a class\n");
+    } else if (d->name == r->super_name) {
+      fprintf(r->out, "Can't use 'super' outside of a subclass\n");
+    } else {
+      fprintf(r->out, "%s is not defined\n", r->ast->names[name]);
+    }
+    r->had_error = true;
+    return NULL;
+  }
+  if (d->level == 0) {
+    node->depth = r->level;
+    *slot = d->slot;
+    return d;
+  }
+  r->next_use[index] = d->uses;
+  d->uses = index;
+  uint32_t current = r->function_count - 1;
+  if (d->function == current) {
+    node->depth = r->level - d->level;
+    *slot = d->slot;
+  } else {
+    node->op |= VAR_UPVALUE;
+    node->depth = 0;
+    *slot = capture(r, current, d);
+  }
+  return d;
+}
+
+static void resolve_function(Resolver *r, const Node *node,
+                             FunctionType type);
+static void resolve_class(Resolver *r, const Node *node);
+
+static void resolve_expression(Resolver *r, NodeIndex index) {
+  if (index == NO_NODE) {
+    return;
+  }
+  Node *node = &r->ast->nodes[index];
+  switch ((NodeKind)node->kind) {
+  case BINARY_EXPR:
+    resolve_expression(r, node->as.binary.left);
+    resolve_expression(r, node->as.binary.right);
+    break;
+  case UNARY_EXPR:
+    resolve_expression(r, node->as.unary.right);
+    break;
+  case GROUP_EXPR:
+  case EXPR_STMT:
+  case PRINT_STMT:
+    resolve_expression(r, node->as.group.expression);
+    break;
+  case VARIABLE_EXPR:
+    resolve_name(r, index, node->as.variable.name, &node->as.variable.slot);
+    break;
+  case ASSIGN_STMT: {
+    if (r->ast->names[node->as.assign.name] == r->this_name) {
+      fprintf(r->out, "Can't assign to 'this'\n");
+      r->had_error = true;
+    }
+    resolve_expression(r, node->as.assign.value);
+    Declaration *d =
+        resolve_name(r, index, node->as.assign.name, &node->as.assign.slot);
+    if (d != NULL) {
+      d->assigned = true;
+    }
+    break;
+  }
+  case CALL_EXPR:
+    resolve_expression(r, node->as.call.callee);
+    for (uint32_t i = 0; i < node->as.call.count; i++) {
+      resolve_expression(r, r->ast->lists[node->as.call.first + i]);
+    }
+    break;
+  case FUNCTION_EXPR:
+    resolve_function(r, node, TYPE_FUNCTION);
+    break;
+  case CLASS_EXPR:
+    resolve_class(r, node);
+    break;
+  case GET_EXPR:
+    resolve_expression(r, node->as.property.object);
+    node->as.property.cache = r->ast->cache_count++;
+    break;
+  case SET_EXPR:
+    resolve_expression(r, node->as.set.target);
+    resolve_expression(r, node->as.set.value);
+    break;
+  case SUPER_EXPR:
+    resolve_expression(r, node->as.super.superclass);
+    resolve_expression(r, node->as.super.receiver);
+    break;
+  default:
+    break;
+  }
+}
+
+static bool begin_scope(Resolver *r) {
+  if (r->level == UINT16_MAX) {
+    fprintf(r->out, "Blocks are nested too deeply\n");
+    r->had_error = true;
+    return false;
+  }
+  r->level += 1;
+  uint32_t *scope_size =
+      realloc(r->scope_size, sizeof(uint32_t) * (r->level + 1));
+  if (scope_size == NULL) {
+    printf("Cannot allocate memory for the resolver");
+    exit(1);
+  }
+  r->scope_size = scope_size;
+  r->scope_size[r->level] = 0;
+  return true;
+}
+
+// Closes the scope the statements declare their variables in. A variable
+// that is captured and may change after that lives in a cell, so its
+// declaration and every use are marked once all of them are known.
+static void end_scope(Resolver *r, uint32_t first, uint32_t count) {
+  const NodeIndex *statements = &r->ast->lists[first];
+  for (uint32_t i = 0; i < count; i++) {
+    const Node *statement = ast_node(r->ast, statements[i]);
+    if (statement->kind != VARIABLE_STMT) {
+      continue;
+    }
+    Declaration *d = declaration(r, r->ast->names[statement->as.assign.name]);
+    if (d->level != r->level || d->node != statements[i]) {
+      continue;
+    }
+    d->declared = false;
+    if (d->captured && (d->assigned || d->captured_early)) {
+      r->ast->nodes[d->node].op |= VAR_CELL;
+      for (NodeIndex use = d->uses; use != NO_NODE; use = r->next_use[use]) {
+        r->ast->nodes[use].op |= VAR_CELL;
+      }
+    }
+  }
+  // what the scope shadowed is visible again, with its uses so far
+  while (r->shadowed_count > 0) {
+    const Declaration *outer = &r->shadowed[r->shadowed_count - 1];
+    Declaration *d = declaration(r, outer->name);
+    if (d->declared) {
+      break;
+    }
+    *d = *outer;
+    r->shadowed_count--;
+  }
+  r->level -= 1;
+}
+
+static void resolve_scope(Resolver *r, uint32_t first, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    resolve_statement(r, r->ast->lists[first + i]);
+  }
+  end_scope(r, first, count);
+}
+
+// Slot 0 is the callee's, which a method calls 'this'. A method nested in
+// another one has a 'this' of its own, so the outer one is put back after.
+static void resolve_function(Resolver *r, const Node *node,
+                             FunctionType type) {
+  Function *function = ast_function(r->ast, node);
+  if (!begin_scope(r)) {
+    return;
+  }
+  if (r->function_count == r->function_capacity) {
+    r->functions =
+        grow(r->functions, &r->function_capacity, sizeof(FunctionScope));
+  }
+  FunctionScope *scope = &r->functions[r->function_count++];
+  scope->type = type;
+  function->initializer = type == TYPE_INITIALIZER;
+  scope->level = r->level;
+  scope->captures = NULL;
+  scope->capture_count = 0;
+  scope->capture_capacity = 0;
+  r->scope_size[r->level] = 1;
+  Declaration *self = declaration(r, r->this_name);
+  Declaration outer = *self;
+  if (type != TYPE_FUNCTION) {
+    *self = (Declaration){.name = r->this_name,
+                          .declared = true,
+                          .level = r->level,
+                          .slot = 0,
+                          .function = r->function_count - 1,
+                          .initialized = true,
+                          .node = NO_NODE,
+                          .uses = NO_NODE};
+  }
+
+  resolve_scope(r, function->first, function->count);
+  if (type != TYPE_FUNCTION) {
+    *self = outer;
+  }
+
+  // nested functions are done, so this one's captures are complete
+  scope = &r->functions[--r->function_count];
+  Ast *ast = r->ast;
+  function->ast = ast;
+  function->level = scope->level;
+  function->first_capture = ast->capture_count;
+  function->capture_count = scope->capture_count;
+  for (uint32_t i = 0; i < scope->capture_count; i++) {
+    ast->captures =
+        arena_grow(ast->arena, ast->captures, ast->capture_count,
+                   &ast->capture_capacity, sizeof(Capture));
+    ast->captures[ast->capture_count++] = scope->captures[i];
+  }
+  free(scope->captures);
+}
+
+// The methods are resolved in a scope of their own, which declares 'super'
+// in a subclass. A class nested in a method of another one doesn't see
+// that one's 'super'.
+static void resolve_class(Resolver *r, const Node *node) {
+  if (!begin_scope(r)) {
+    return;
+  }
+  uint32_t first = node->as.klass.first;
+  uint32_t count = node->as.klass.count;
+  const NodeIndex *members = &r->ast->lists[first];
+  Declaration *super = declaration(r, r->super_name);
+  Declaration outer = *super;
+  super->declared = false;
+  uint32_t i = 0;
+  if (node->op & CLASS_SUBCLASS) {
+    const Node *inherits = ast_node(r->ast, members[0]);
+    const Node *superclass = ast_node(r->ast, inherits->as.assign.value);
+    if (r->ast->names[superclass->as.variable.name] ==
+        r->ast->names[node->as.klass.name]) {
+      fprintf(r->out, "A class can't inherit from itself\n");
+      r->had_error = true;
+    }
+    resolve_statement(r, members[i++]);
+  }
+  for (; i < count; i++) {
+    const Node *method = ast_node(r->ast, members[i]);
+    const Function *function = ast_function(r->ast, method);
+    bool init = r->ast->names[function->name] == r->init_name;
+    resolve_function(r, method, init ? TYPE_INITIALIZER : TYPE_METHOD);
+  }
+  end_scope(r, first, count);
+  *super = outer;
+}
+
+static void resolve_statement(Resolver *r, NodeIndex index) {
+  Node *node = &r->ast->nodes[index];
+  switch ((NodeKind)node->kind) {
+  case VARIABLE_STMT: {
+    NodeIndex value = node->as.assign.value;
+    NodeKind kind =
+        value == NO_NODE ? ERROR_EXPR : ast_node(r->ast, value)->kind;
+    Declaration *d;
+    if (kind == FUNCTION_EXPR || kind == CLASS_EXPR) {
+      // a function can call itself, a method can use its class
+      d = declare(r, index);
+      resolve_expression(r, value);
+    } else {
+      // 'var a = a;' reads an outer a, which can't exist
+      resolve_expression(r, value);
+      d = declare(r, index);
+    }
+    if (d != NULL) {
+      d->initialized = true;
+    }
+    break;
+  }
+  case BLOCK_STMT:
+    if (begin_scope(r)) {
+      resolve_scope(r, node->as.block.first, node->as.block.count);
+    }
+    break;
+  case WHILE_STMT:
+    resolve_expression(r, node->as.loop.condition);
+    resolve_statement(r, node->as.loop.body);
+    resolve_expression(r, node->as.loop.increment);
+    break;
+  case RETURN_STMT:
+    if (r->function_count == 1) {
+      fprintf(r->out, "Can't return from top-level code\n");
+      r->had_error = true;
+    } else if (r->functions[r->function_count - 1].type == TYPE_INITIALIZER &&
+               node->as.group.expression != NO_NODE) {
+      fprintf(r->out, "Can't return a value from an initializer\n");
+      r->had_error = true;
+    }
+    resolve_expression(r, node->as.group.expression);
+    break;
+  default:
+    resolve_expression(r, index);
+    break;
+  }
+}
+
+bool resolve(Ast *ast, VarMap *environment, FILE *out) {
+  Resolver resolver;
+  Resolver *r = &resolver;
+  r->ast = ast;
+  r->out = out;
+  r->had_error = false;
+  r->level = 0;
+
+  r->this_name = intern("this", 4);
+  r->super_name = intern("super", 5);
+  r->init_name = intern("init", 4);
+  ast->cache_count = 0;
+
+  // room for 'this' and 'super' too
+  uint32_t capacity = 16;
+  while (capacity < (ast->name_count + environment->size + 2) * 2) {
+    capacity *= 2;
+  }
+  r->declarations = calloc(capacity, sizeof(Declaration));
+  r->scope_size = malloc(sizeof(uint32_t));
+  r->next_use = malloc(sizeof(NodeIndex) * (ast->node_count + 1));
+  r->functions = NULL;
+  r->function_count = 0;
+  r->function_capacity = 0;
+  r->shadowed = NULL;
+  r->shadowed_count = 0;
+  r->shadowed_capacity = 0;
+  if (r->declarations == NULL || r->scope_size == NULL ||
+      r->next_use == NULL) {
+    printf("Cannot allocate memory for the resolver");
+    exit(1);
+  }
+  r->mask = capacity - 1;
+  r->functions = grow(NULL, &r->function_capacity, sizeof(FunctionScope));
+  r->functions[r->function_count++] =
+      (FunctionScope){TYPE_FUNCTION, 0, NULL, 0, 0};
+
+  // the environment must be the outermost scope
+  for (int i = 0; i < environment->size; i++) {
+    Declaration *d = declaration(r, environment->entries[i].key);
+    d->declared = true;
+    d->level = 0;
+    d->slot = i;
+  }
+  r->scope_size[0] = environment->size;
+
+  for (uint32_t i = 0; i < ast->statement_count; i++) {
+    resolve_statement(r, ast_statement(ast, i));
+  }
+
+  // the engines index the environment's entries by slot while running
+  var_reserve(environment, r->scope_size[0]);
+  ast->caches = arena_alloc(ast->arena, sizeof(PropertyCache) *
+                                            (ast->cache_count + 1));
+  memset(ast->caches, 0, sizeof(PropertyCache) * ast->cache_count);
+  free(r->declarations);
+  free(r->scope_size);
+  free(r->next_use);
+  free(r->functions);
+  free(r->shadowed);
+  return !r->had_error;
+}
@@ -0,0 +1,14 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include "interpreter.h"
+
+// Gives every declaration a slot in the VarMap of its scope and every
+// variable read or assignment the number of scopes to go out (depth) and the
+// slot to use there. environment is the outermost scope the script will run
+// in; the variables it already has are visible to the script.
+//
+// Undefined and redefined variables are reported to out. Returns false if
+// there were any: the script must not be run then.
+bool resolve(Ast *ast, VarMap *environment, FILE *out);
+#endif
@@ -0,0 +1,100 @@
+#include "runner.h"
+#include "arena.h"
+#include "cache.h"
+#include "compiler.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "resolver.h"
+#include "scanner.h"
+#include "thunks.h"
+#include "vm.h"
+
+static Ast *scan_and_parse(const char *source, int length,
+                           const RunOptions *options, Arena *arena,
+                           FILE *out) {
+  ScanResult scan_result =
+      options->scan_threads > 1
+          ? scan_tokens_parallel(source, length, options->scan_threads, out)
+          : scan_tokens(source, length, out);
+  // tokenlist_print(&scan_result.token_list);
+
+  Ast *tree = parse(&scan_result.token_list, arena, out);
+  tokenlist_free(&scan_result.token_list);
+  // a cached script would no longer report its scan errors
+  if (tree != NULL && options->cache_dir != NULL && !scan_result.had_error) {
+    cache_store(options->cache_dir, source, length, tree);
+  }
+  return tree;
+}
+
+bool run_script(VarMap *environment, const char *source, int length,
+                const RunOptions *options, FILE *out) {
+  // Everything built at compile time is released together once the script
+  // has run, unless it declared functions the environment may still call.
+  // Otherwise the environment only keeps interned names and copied values.
+  Arena ast;
+  arena_init(&ast);
+  CacheFile cached = {NULL, 0};
+  Ast *tree = NULL;
+  if (options->cache_dir != NULL) {
+    tree = cache_load(options->cache_dir, source, length, &ast, &cached);
+  }
+  if (tree == NULL) {
+    tree = scan_and_parse(source, length, options, &ast, out);
+  }
+  if (tree == NULL) {
+    arena_free(&ast);
+    return false;
+  }
+  if (options->dump_ast) {
+    fprintf(out, "AST:\n");
+    ast_print(tree, out);
+  }
+  if (!resolve(tree, environment, out)) {
+    cache_close(&cached);
+    arena_free(&ast);
+    return false;
+  }
+  optimize(tree, options->optimize, environment);
+  if (options->dump_ast) {
+    fprintf(out, "AST -O%d:\n", options->optimize);
+    ast_print(tree, out);
+  }
+  Heap *heap = environment->heap;
+  heap->stress = options->gc_stress;
+  if (options->gc_growth > 0) {
+    heap->growth_factor = options->gc_growth;
+  }
+  bool ok;
+  QuickenStats quickened = {0, 0};
+  switch (options->engine) {
+  case ENGINE_VM:
+    ok = vm_run(environment, compile(tree, &ast), out);
+    break;
+  case ENGINE_THUNKS:
+    ok = thunks_run(environment, thunks_compile(tree, &ast), out);
+    break;
+  default:
+    ok = interpret(environment, tree, options->jit, &quickened, out);
+    break;
+  }
+  if (options->gc_stats) {
+    gc_print_stats(heap, out);
+  }
+  if (options->shape_stats) {
+    shape_print_stats(heap, out);
+  }
+  if (options->stats) {
+    fprintf(out, "quickening: %llu nodes specialized, %llu deoptimized\n",
+            (unsigned long long)quickened.specialized,
+            (unsigned long long)quickened.deoptimized);
+  }
+
+  if (tree->function_count > 0) {
+    var_keep_script(environment, &ast, &cached);
+  } else {
+    cache_close(&cached);
+    arena_free(&ast);
+  }
+  return ok;
+}
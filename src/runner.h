@@ -0,0 +1,33 @@
+#ifndef RUNNER_H
+#define RUNNER_H
+
+#include "interpreter.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+typedef enum {
+  ENGINE_TREE,  // walks the AST, the reference implementation
+  ENGINE_VM,    // compiles to bytecode first
+  ENGINE_THUNKS // lowers the AST to a tree of C function pointers
+} Engine;
+
+typedef struct {
+  int scan_threads; // more than 1 scans large scripts in parallel chunks
+  int optimize;     // -O level, see optimizer.h
+  bool dump_ast;    // print the AST before and after optimizing
+  Engine engine;
+  const char *cache_dir; // where parsed scripts are cached, NULL for nowhere
+  bool gc_stats;         // report the collector's totals after each script
+  bool gc_stress;        // collect on every allocation
+  double gc_growth;      // heap growth factor, 0 for GC_GROWTH_FACTOR
+  bool shape_stats;      // report shape transitions and inline cache hits
+  bool jit;              // compile hot arithmetic, tree engine only
+  bool stats;            // report the tree walker's quickened nodes
+} RunOptions;
+
+// Scans, parses and interprets one script in environment. Everything the
+// script prints, including errors, goes to out. Returns false if it has
+// undefined variables or a runtime error stopped it.
+bool run_script(VarMap *environment, const char *source, int length,
+                const RunOptions *options, FILE *out);
+#endif
@@ -0,0 +1,181 @@
+// open_memstream is POSIX, hidden by a strict -std=c17
+#define _DEFAULT_SOURCE
+
+#include "scan_simd.h"
+#include "scanner.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Below this a single thread is faster than starting the others.
+#define MIN_CHUNK_LENGTH (256 * 1024)
+#define MAX_THREADS 64
+
+typedef struct {
+  const char *source;
+  int length;
+  int first_line;
+  bool last; // gets the END_OF_FILE token
+  FILE *out;
+  ScanResult result;
+  char *errors; // scanner messages, captured by open_memstream
+  size_t errors_length;
+  // phase two: where this chunk's tokens go in the merged list
+  Token *destination;
+} Chunk;
+
+static void *scan_worker(void *arg) {
+  Chunk *chunk = arg;
+  chunk->errors = NULL;
+  chunk->errors_length = 0;
+  FILE *buffer = open_memstream(&chunk->errors, &chunk->errors_length);
+  // without a buffer, report directly; messages may then come out of order
+  FILE *errors = buffer != NULL ? buffer : chunk->out;
+  chunk->result = scan_chunk(chunk->source, chunk->length, chunk->first_line,
+                             chunk->last, errors);
+  if (buffer != NULL) {
+    fclose(buffer);
+  }
+  return NULL;
+}
+
+static void *copy_worker(void *arg) {
+  Chunk *chunk = arg;
+  TokenList *list = &chunk->result.token_list;
+  if (chunk->destination != list->tokens) {
+    memcpy(chunk->destination, list->tokens, sizeof(Token) * list->size);
+    tokenlist_free(list);
+  }
+  return NULL;
+}
+
+// The pre-pass. Walks the source with the same rules the scanner uses for
+// strings and comments, so it knows whether a newline is in code, and splits
+// after the first code newline past each 1/count of the source. Newlines are
+// counted on the way, which gives every chunk its first line number. Returns
+// the number of chunks found (fewer than count for short or odd sources).
+static int split(const char *source, int length, int count, Chunk *chunks) {
+  const ScanKernels *kernels = scan_kernels();
+  const char *p = source;
+  const char *end = source + length;
+  int line = 1;
+  int found = 1;
+  const char *target = source + (long)length * found / count;
+
+  chunks[0].source = source;
+  chunks[0].first_line = 1;
+  while (found < count) {
+    p = kernels->code(p, end);
+    if (p == end) {
+      break;
+    }
+    char c = *p;
+    if (c == '"') {
+      p = kernels->string(p + 1, end, &line);
+      if (p < end) {
+        p++; // closing quote
+      }
+    } else if (c == '/' && p + 1 < end && p[1] == '/') {
+      p = kernels->comment(p + 2, end);
+    } else {
+      p++;
+      if (c == '\n') {
+        line += 1;
+        if (p >= target && p < end) {
+          chunks[found].source = p;
+          chunks[found].first_line = line;
+          found++;
+          target = source + (long)length * found / count;
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < found; i++) {
+    const char *chunk_end = i + 1 < found ? chunks[i + 1].source : end;
+    chunks[i].length = (int)(chunk_end - chunks[i].source);
+    chunks[i].last = i + 1 == found;
+  }
+  return found;
+}
+
+static void run_all(Chunk *chunks, int count, void *(*work)(void *)) {
+  pthread_t threads[MAX_THREADS];
+  bool started[MAX_THREADS];
+  // chunk 0 runs on the calling thread
+  for (int i = 1; i < count; i++) {
+    started[i] = pthread_create(&threads[i], NULL, work, &chunks[i]) == 0;
+    if (!started[i]) {
+      work(&chunks[i]);
+    }
+  }
+  work(&chunks[0]);
+  for (int i = 1; i < count; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+}
+
+ScanResult scan_tokens_parallel(const char *source, int length, int threads,
+                                FILE *out) {
+  int count = length / MIN_CHUNK_LENGTH;
+  if (count > threads) {
+    count = threads;
+  }
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > 0 && count > cpus) {
+    count = (int)cpus;
+  }
+  if (count > MAX_THREADS) {
+    count = MAX_THREADS;
+  }
+  if (count < 2) {
+    return scan_tokens(source, length, out);
+  }
+
+  Chunk chunks[MAX_THREADS];
+  count = split(source, length, count, chunks);
+  if (count < 2) {
+    return scan_tokens(source, length, out);
+  }
+
+  for (int i = 0; i < count; i++) {
+    chunks[i].out = out;
+  }
+  run_all(chunks, count, scan_worker);
+
+  ScanResult merged;
+  merged.had_error = false;
+  int size = 0;
+  for (int i = 0; i < count; i++) {
+    size += chunks[i].result.token_list.size;
+    merged.had_error |= chunks[i].result.had_error;
+    if (chunks[i].errors != NULL) {
+      fwrite(chunks[i].errors, 1, chunks[i].errors_length, out);
+      free(chunks[i].errors);
+    }
+  }
+
+  TokenList *list = &merged.token_list;
+  // the first chunk's tokens are already in place at the front
+  list->tokens =
+      realloc(chunks[0].result.token_list.tokens, sizeof(Token) * size);
+  if (list->tokens == NULL) {
+    printf("Cannot allocate memory for TokenList");
+    exit(1);
+  }
+  list->size = size;
+  list->capacity = size;
+  chunks[0].result.token_list.tokens = list->tokens;
+
+  Token *destination = list->tokens;
+  for (int i = 0; i < count; i++) {
+    chunks[i].destination = destination;
+    destination += chunks[i].result.token_list.size;
+  }
+  run_all(chunks, count, copy_worker);
+  return merged;
+}
@@ -0,0 +1,312 @@
+#include "scan_simd.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+static inline bool is_ident_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_';
+}
+
+static const char *scalar_whitespace(const char *p, const char *end,
+                                     int *lines) {
+  while (p < end) {
+    char c = *p;
+    if (c == '\n') {
+      *lines += 1;
+    } else if (c != ' ' && c != '\t' && c != '\r') {
+      break;
+    }
+    p++;
+  }
+  return p;
+}
+
+static const char *scalar_comment(const char *p, const char *end) {
+  while (p < end && *p != '\n') {
+    p++;
+  }
+  return p;
+}
+
+static const char *scalar_string(const char *p, const char *end, int *lines) {
+  while (p < end && *p != '"') {
+    if (*p == '\n') {
+      *lines += 1;
+    }
+    p++;
+  }
+  return p;
+}
+
+static const char *scalar_identifier(const char *p, const char *end) {
+  while (p < end && is_ident_char(*p)) {
+    p++;
+  }
+  return p;
+}
+
+static const char *scalar_code(const char *p, const char *end) {
+  while (p < end && *p != '"' && *p != '/' && *p != '\n') {
+    p++;
+  }
+  return p;
+}
+
+static const ScanKernels scalar_kernels = {
+    "scalar",          scalar_whitespace, scalar_comment, scalar_string,
+    scalar_identifier, scalar_code};
+
+#ifdef HAVE_X86_KERNELS
+
+// The kernels below all work the same way: compare a block of bytes against
+// the interesting characters, turn the result into a bitmask with movemask
+// and stop at its lowest set bit. Newlines are counted with a popcount of the
+// newline mask up to that bit. The scalar versions finish the last partial
+// block.
+
+static inline unsigned below(int index) { return (1u << index) - 1; }
+
+static const char *sse2_whitespace(const char *p, const char *end,
+                                   int *lines) {
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  while (p + 16 <= end) {
+    __m128i c = _mm_loadu_si128((const __m128i *)p);
+    __m128i nl = _mm_cmpeq_epi8(c, lf);
+    __m128i ws = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(c, space), _mm_cmpeq_epi8(c, tab)),
+        _mm_or_si128(_mm_cmpeq_epi8(c, cr), nl));
+    unsigned stop = ~(unsigned)_mm_movemask_epi8(ws) & 0xFFFF;
+    unsigned newlines = (unsigned)_mm_movemask_epi8(nl);
+    if (stop != 0) {
+      int i = __builtin_ctz(stop);
+      *lines += __builtin_popcount(newlines & below(i));
+      return p + i;
+    }
+    *lines += __builtin_popcount(newlines);
+    p += 16;
+  }
+  return scalar_whitespace(p, end, lines);
+}
+
+static const char *sse2_comment(const char *p, const char *end) {
+  const __m128i lf = _mm_set1_epi8('\n');
+  while (p + 16 <= end) {
+    __m128i c = _mm_loadu_si128((const __m128i *)p);
+    unsigned stop = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(c, lf));
+    if (stop != 0) {
+      return p + __builtin_ctz(stop);
+    }
+    p += 16;
+  }
+  return scalar_comment(p, end);
+}
+
+static const char *sse2_string(const char *p, const char *end, int *lines) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i lf = _mm_set1_epi8('\n');
+  while (p + 16 <= end) {
+    __m128i c = _mm_loadu_si128((const __m128i *)p);
+    unsigned stop = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(c, quote));
+    unsigned newlines = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(c, lf));
+    if (stop != 0) {
+      int i = __builtin_ctz(stop);
+      *lines += __builtin_popcount(newlines & below(i));
+      return p + i;
+    }
+    *lines += __builtin_popcount(newlines);
+    p += 16;
+  }
+  return scalar_string(p, end, lines);
+}
+
+// Bytes >= 0x80 compare as negative, so they fall outside every range.
+// OR-ing in 0x20 folds upper case onto lower case and maps no other byte
+// into 'a'..'z'.
+static inline __m128i sse2_ident_mask(__m128i c) {
+  __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+  __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+  __m128i under = _mm_cmpeq_epi8(c, _mm_set1_epi8('_'));
+  return _mm_or_si128(_mm_or_si128(alpha, digit), under);
+}
+
+static const char *sse2_identifier(const char *p, const char *end) {
+  while (p + 16 <= end) {
+    __m128i c = _mm_loadu_si128((const __m128i *)p);
+    unsigned stop = ~(unsigned)_mm_movemask_epi8(sse2_ident_mask(c)) & 0xFFFF;
+    if (stop != 0) {
+      return p + __builtin_ctz(stop);
+    }
+    p += 16;
+  }
+  return scalar_identifier(p, end);
+}
+
+static const char *sse2_code(const char *p, const char *end) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i slash = _mm_set1_epi8('/');
+  const __m128i lf = _mm_set1_epi8('\n');
+  while (p + 16 <= end) {
+    __m128i c = _mm_loadu_si128((const __m128i *)p);
+    __m128i special =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, quote),
+                                  _mm_cmpeq_epi8(c, slash)),
+                     _mm_cmpeq_epi8(c, lf));
+    unsigned stop = (unsigned)_mm_movemask_epi8(special);
+    if (stop != 0) {
+      return p + __builtin_ctz(stop);
+    }
+    p += 16;
+  }
+  return scalar_code(p, end);
+}
+
+static const ScanKernels sse2_kernels = {
+    "sse2", sse2_whitespace, sse2_comment, sse2_string, sse2_identifier,
+    sse2_code};
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static const char *avx2_whitespace(const char *p, const char *end,
+                                        int *lines) {
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  while (p + 32 <= end) {
+    __m256i c = _mm256_loadu_si256((const __m256i *)p);
+    __m256i nl = _mm256_cmpeq_epi8(c, lf);
+    __m256i ws = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(c, space), _mm256_cmpeq_epi8(c, tab)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(c, cr), nl));
+    unsigned stop = ~(unsigned)_mm256_movemask_epi8(ws);
+    unsigned newlines = (unsigned)_mm256_movemask_epi8(nl);
+    if (stop != 0) {
+      int i = __builtin_ctz(stop);
+      *lines += __builtin_popcount(newlines & below(i));
+      return p + i;
+    }
+    *lines += __builtin_popcount(newlines);
+    p += 32;
+  }
+  return sse2_whitespace(p, end, lines);
+}
+
+AVX2 static const char *avx2_comment(const char *p, const char *end) {
+  const __m256i lf = _mm256_set1_epi8('\n');
+  while (p + 32 <= end) {
+    __m256i c = _mm256_loadu_si256((const __m256i *)p);
+    unsigned stop = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, lf));
+    if (stop != 0) {
+      return p + __builtin_ctz(stop);
+    }
+    p += 32;
+  }
+  return sse2_comment(p, end);
+}
+
+AVX2 static const char *avx2_string(const char *p, const char *end,
+                                    int *lines) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  while (p + 32 <= end) {
+    __m256i c = _mm256_loadu_si256((const __m256i *)p);
+    unsigned stop =
+        (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, quote));
+    unsigned newlines =
+        (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, lf));
+    if (stop != 0) {
+      int i = __builtin_ctz(stop);
+      *lines += __builtin_popcount(newlines & below(i));
+      return p + i;
+    }
+    *lines += __builtin_popcount(newlines);
+    p += 32;
+  }
+  return sse2_string(p, end, lines);
+}
+
+AVX2 static const char *avx2_identifier(const char *p, const char *end) {
+  while (p + 32 <= end) {
+    __m256i c = _mm256_loadu_si256((const __m256i *)p);
+    __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    __m256i alpha =
+        _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+    __m256i digit =
+        _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+    __m256i under = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('_'));
+    __m256i ident = _mm256_or_si256(_mm256_or_si256(alpha, digit), under);
+    unsigned stop = ~(unsigned)_mm256_movemask_epi8(ident);
+    if (stop != 0) {
+      return p + __builtin_ctz(stop);
+    }
+    p += 32;
+  }
+  return sse2_identifier(p, end);
+}
+
+AVX2 static const char *avx2_code(const char *p, const char *end) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i slash = _mm256_set1_epi8('/');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  while (p + 32 <= end) {
+    __m256i c = _mm256_loadu_si256((const __m256i *)p);
+    __m256i special =
+        _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(c, quote),
+                                        _mm256_cmpeq_epi8(c, slash)),
+                        _mm256_cmpeq_epi8(c, lf));
+    unsigned stop = (unsigned)_mm256_movemask_epi8(special);
+    if (stop != 0) {
+      return p + __builtin_ctz(stop);
+    }
+    p += 32;
+  }
+  return sse2_code(p, end);
+}
+
+static const ScanKernels avx2_kernels = {
+    "avx2", avx2_whitespace, avx2_comment, avx2_string, avx2_identifier,
+    avx2_code};
+#endif
+
+static const ScanKernels *select_kernels(void) {
+  const char *forced = getenv("LOX_SIMD");
+  if (forced != NULL && strcmp(forced, "scalar") == 0) {
+    return &scalar_kernels;
+  }
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  bool force_sse2 = forced != NULL && strcmp(forced, "sse2") == 0;
+  if (!force_sse2 && __builtin_cpu_supports("avx2")) {
+    return &avx2_kernels;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return &sse2_kernels;
+  }
+#endif
+  return &scalar_kernels;
+}
+
+static const ScanKernels *selected = NULL;
+static pthread_once_t selected_once = PTHREAD_ONCE_INIT;
+
+static void select_once(void) { selected = select_kernels(); }
+
+const ScanKernels *scan_kernels(void) {
+  pthread_once(&selected_once, select_once);
+  return selected;
+}
@@ -0,0 +1,25 @@
+#ifndef SCAN_SIMD_H
+#define SCAN_SIMD_H
+
+// Kernels the scanner uses to skip over runs of bytes that don't produce
+// tokens. Each one starts at p, never reads at or past end, and returns a
+// pointer to the first byte it stopped at (or end). Newlines that are skipped
+// are added to *lines.
+typedef struct {
+  const char *name;
+  // spaces, tabs, carriage returns and newlines
+  const char *(*whitespace)(const char *p, const char *end, int *lines);
+  // a // comment body: stops at the newline, which is not consumed
+  const char *(*comment)(const char *p, const char *end);
+  // a string body: stops at the closing quote, which is not consumed
+  const char *(*string)(const char *p, const char *end, int *lines);
+  // an identifier tail: stops at the first byte not in [A-Za-z0-9_]
+  const char *(*identifier)(const char *p, const char *end);
+  // code outside strings and comments: stops at the next '"', '/' or newline
+  const char *(*code)(const char *p, const char *end);
+} ScanKernels;
+
+// Picks the widest kernels the cpu supports (AVX2, SSE2 or scalar). Setting
+// LOX_SIMD=scalar|sse2|avx2 in the environment overrides the choice.
+const ScanKernels *scan_kernels(void);
+#endif
@@ -1,243 +1,266 @@
 #include "scanner.h"
+#include "intern.h"
+#include "keyword_hash.h"
+#include "scan_simd.h"
 #include "tokens.h"
-#include "utils.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static void scan_token(void);
-static void error(char *message, char c);
-static void report(char *where, char *message, char c);
-static bool is_at_end(void);
-static bool match(char expected);
-static char peek(void);
-static char peek_next(void);
-static void string(void);
+// All state of one scan, so several scripts can be scanned concurrently.
+typedef struct {
+  bool had_error;
+  int current_pos;
+  int start;
+  int current_line;
+  const char *source;
+  const char *source_end;
+  int source_length;
+  TokenList token_list;
+  const ScanKernels *kernels;
+  FILE *out;
+} Scanner;
+
+static void scan_token(Scanner *s);
+static void error(Scanner *s, char *message, char c);
+static void report(Scanner *s, char *where, char *message, char c);
+static bool is_at_end(Scanner *s);
+static bool match(Scanner *s, char expected);
+static char peek(Scanner *s);
+static char peek_next(Scanner *s);
+static void string(Scanner *s);
 static bool is_digit(char c);
-static void number(void);
+static void number(Scanner *s);
 static bool is_alpha(char c);
-static bool is_alphanumeric(char c);
-static void identifier(void);
-
-static bool had_error = false;
-static int current_pos = -1;
-static int start = -1;
-static int current_line = -1;
-static char *source;
-static TokenList token_list;
-
-ScanResult scan_tokens(char *src) {
-  current_pos = 0;
-  start = 0;
-  current_line = 1;
-  source = src;
-
-  tokenlist_init(&token_list);
-  int len = (int)strlen(source);
-
-  while (current_pos < len) {
-    start = current_pos;
-    scan_token();
-  }
-  Token *eof = newToken();
-  eof->type = END_OF_FILE;
-  eof->lexeme = "";
-  eof->literal = "";
+static bool is_whitespace(char c);
+static void identifier(Scanner *s);
+static void skip_to(Scanner *s, const char *p);
+
+ScanResult scan_tokens(const char *src, int length, FILE *out) {
+  return scan_chunk(src, length, 1, true, out);
+}
+
+ScanResult scan_chunk(const char *src, int length, int first_line,
+                      bool add_eof, FILE *out) {
+  Scanner scanner;
+  Scanner *s = &scanner;
+  s->current_pos = 0;
+  s->start = 0;
+  s->current_line = first_line;
+  s->had_error = false;
+  s->source = src;
+  s->source_length = length;
+  s->source_end = src + length;
+  s->kernels = scan_kernels();
+  s->out = out;
 
-  tokenlist_add(&token_list, eof);
+  tokenlist_init(&s->token_list);
+
+  while (s->current_pos < s->source_length) {
+    s->start = s->current_pos;
+    scan_token(s);
+  }
+  if (add_eof) {
+    Token eof = {END_OF_FILE, s->source + s->current_pos, 0, s->current_line,
+                 NULL};
+    tokenlist_add(&s->token_list, eof);
+  }
 
   ScanResult scan_result;
-  scan_result.token_list = token_list;
-  scan_result.had_error = had_error;
+  scan_result.token_list = s->token_list;
+  scan_result.had_error = s->had_error;
 
   // tokenlist_print(&scan_result.token_list);
 
   return scan_result;
 }
 
-static void add_token(TokenType type) {
-  Token *token = newToken();
-  token->type = type;
-  token->lexeme = substring(source, start + 1, current_pos - start);
-  token->literal = NULL;
-  token->line = current_line;
-
-  tokenlist_add(&token_list, token);
+static void add_token_with_symbol(Scanner *s, TokenType type,
+                                  const char *symbol) {
+  Token token = {type, s->source + s->start, s->current_pos - s->start,
+                 s->current_line, symbol};
+  tokenlist_add(&s->token_list, token);
 }
 
-static void add_token_with_literal(TokenType type, char *literal) {
-  Token *token = newToken();
-  token->type = type;
-  token->lexeme = substring(source, start + 1, current_pos - start);
-  token->literal = literal;
-  token->line = current_line;
-
-  tokenlist_add(&token_list, token);
+static void add_token(Scanner *s, TokenType type) {
+  add_token_with_symbol(s, type, NULL);
 }
 
-static char advance(void) {
-  char c = source[current_pos++];
+static char advance(Scanner *s) {
+  char c = s->source[s->current_pos++];
   return c;
 }
 
-static void scan_token(void) {
-  char c = advance();
+static void scan_token(Scanner *s) {
+  char c = advance(s);
 
   switch (c) {
   case '(':
-    add_token(LEFT_PAREN);
+    add_token(s, LEFT_PAREN);
     break;
   case ')':
-    add_token(RIGHT_PAREN);
+    add_token(s, RIGHT_PAREN);
     break;
   case '{':
-    add_token(LEFT_BRACE);
+    add_token(s, LEFT_BRACE);
     break;
   case '}':
-    add_token(RIGHT_BRACE);
+    add_token(s, RIGHT_BRACE);
     break;
   case ',':
-    add_token(COMMA);
+    add_token(s, COMMA);
     break;
   case '.':
-    add_token(DOT);
+    add_token(s, DOT);
     break;
   case '+':
-    add_token(PLUS);
+    add_token(s, PLUS);
     break;
   case '-':
-    add_token(MINUS);
+    add_token(s, MINUS);
     break;
   case '*':
-    add_token(STAR);
+    add_token(s, STAR);
     break;
   case '!':
-    add_token(match('=') ? BANG_EQUAL : BANG);
+    add_token(s, match(s, '=') ? BANG_EQUAL : BANG);
     break;
   case '=':
-    add_token(match('=') ? EQUAL_EQUAL : EQUAL);
+    add_token(s, match(s, '=') ? EQUAL_EQUAL : EQUAL);
     break;
   case '>':
-    add_token(match('=') ? GREATER_EQUAL : GREATER);
+    add_token(s, match(s, '=') ? GREATER_EQUAL : GREATER);
     break;
   case '<':
-    add_token(match('=') ? LESS_EQUAL : LESS);
+    add_token(s, match(s, '=') ? LESS_EQUAL : LESS);
     break;
   case '/':
-    if (match('/')) {
-      while (peek() != '\n' && !is_at_end()) {
-        advance();
-      }
+    if (match(s, '/')) {
+      skip_to(s, s->kernels->comment(s->source + s->current_pos,
+                                     s->source_end));
     } else {
-      add_token(SLASH);
+      add_token(s, SLASH);
     }
     break;
   case ' ':
   case '\t':
   case '\r':
-    break;
   case '\n':
-    current_line += 1;
+    if (c == '\n') {
+      s->current_line += 1;
+    }
+    // single separators are the common case, only hand runs to the kernel
+    if (is_whitespace(peek(s))) {
+      skip_to(s, s->kernels->whitespace(s->source + s->current_pos,
+                                        s->source_end, &s->current_line));
+    }
     break;
   case '"':
-    string();
+    string(s);
     break;
   case ';':
-    add_token(SEMICOLON);
+    add_token(s, SEMICOLON);
     break;
   default:
     if (is_digit(c)) {
-      number();
+      number(s);
     } else if (is_alpha(c)) {
-      identifier();
+      identifier(s);
     } else {
-      error("Unexpected character.", c);
+      error(s, "Unexpected character.", c);
     }
     break;
   }
 }
 
-static void identifier(void) {
-  while (is_alphanumeric(peek())) {
-    advance();
-  }
+static void identifier(Scanner *s) {
+  skip_to(s, s->kernels->identifier(s->source + s->current_pos,
+                                    s->source_end));
 
-  char *text = substring(source, start + 1, current_pos - start);
-  const TokenType *tokentype = get_keyword_token(text);
-  if (tokentype == NULL) {
-    add_token(IDENTIFIER);
+  int length = s->current_pos - s->start;
+  TokenType type = keyword_type(s->source + s->start, length);
+  if (type == IDENTIFIER) {
+    add_token_with_symbol(s, IDENTIFIER, intern(s->source + s->start, length));
   } else {
-    add_token(*tokentype);
+    add_token(s, type);
   }
 }
 
-static void number(void) {
-  while (is_digit(peek()))
-    advance();
-  if (peek() == '.' && is_digit((peek_next())))
-    advance();
-  while (is_digit(peek()))
-    advance();
-  add_token_with_literal(NUMBER,
-                         substring(source, start + 1, current_pos - start));
+static void number(Scanner *s) {
+  while (is_digit(peek(s)))
+    advance(s);
+  if (peek(s) == '.' && is_digit((peek_next(s))))
+    advance(s);
+  while (is_digit(peek(s)))
+    advance(s);
+  add_token(s, NUMBER);
 }
 
 bool is_digit(char c) { return c >= '0' && c <= '9'; }
 
-void string(void) {
-  while (peek() != '"' && !is_at_end()) {
-    if (peek() == '\n')
-      current_line += 1;
-    advance();
-  }
+void string(Scanner *s) {
+  skip_to(s, s->kernels->string(s->source + s->current_pos, s->source_end,
+                                &s->current_line));
 
-  if (is_at_end()) {
-    error("Unterminated string.", '\0');
+  if (is_at_end(s)) {
+    error(s, "Unterminated string.", '\0');
     return;
   }
 
-  advance();
+  advance(s);
+  add_token_with_symbol(
+      s, STRING,
+      intern(s->source + s->start + 1, s->current_pos - s->start - 2));
+}
 
-  char *string = substring(source, start + 2, current_pos - start - 2);
-  add_token_with_literal(STRING, string);
+static void skip_to(Scanner *s, const char *p) {
+  s->current_pos = (int)(p - s->source);
 }
 
-static bool match(char expected) {
-  if (is_at_end()) {
+static bool match(Scanner *s, char expected) {
+  if (is_at_end(s)) {
     return false;
   }
-  if (expected != source[current_pos]) {
+  if (expected != s->source[s->current_pos]) {
     return false;
   }
-  current_pos += 1;
+  s->current_pos += 1;
   return true;
 }
 
-static char peek_next(void) {
-  if (current_pos + 1 >= (int)strlen(source)) {
+static char peek_next(Scanner *s) {
+  if (s->source + s->current_pos + 1 >= s->source_end) {
     return '\0';
   }
-  return source[current_pos + 1];
+  return s->source[s->current_pos + 1];
 }
 
-static char peek(void) {
-  if (is_at_end()) {
+static char peek(Scanner *s) {
+  if (is_at_end(s)) {
     return '\0';
   }
-  return source[current_pos];
+  return s->source[s->current_pos];
 }
+
+static bool is_whitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
 static bool is_alpha(char c) {
   return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_');
 }
 
-static bool is_alphanumeric(char c) { return is_alpha(c) || is_digit(c); }
-
-static bool is_at_end(void) { return current_pos >= (int)strlen(source); }
+static bool is_at_end(Scanner *s) {
+  return s->source + s->current_pos >= s->source_end;
+}
 
-static void error(char *message, char c) { report("", message, c); }
+static void error(Scanner *s, char *message, char c) {
+  report(s, "", message, c);
+}
 
-static void report(char *where, char *message, char c) {
-  printf("*[Line %i] Error %s : %s [%c]\n", current_line, where, message, c);
-  had_error = true;
+static void report(Scanner *s, char *where, char *message, char c) {
+  fprintf(s->out, "*[Line %i] Error %s : %s [%c]\n", s->current_line, where,
+          message, c);
+  s->had_error = true;
 }
@@ -3,43 +3,23 @@
 
 #include "tokens.h"
 #include <stdbool.h>
-#include <string.h>
 
 typedef struct {
   bool had_error;
   TokenList token_list;
 } ScanResult;
 
-ScanResult scan_tokens(char *source);
+// source does not need to be NUL-terminated. Errors are reported on out.
+ScanResult scan_tokens(const char *source, int length, FILE *out);
 
-typedef struct {
-  const char *key;
-  const TokenType value;
-} Item;
-
-static const Item keywords[] = {
-    {"and", AND},   {"class", CLASS}, {"else", ELSE},     {"false", FALSE},
-    {"for", FOR},   {"fun", FUN},     {"if", IF},         {"nil", NIL},
-    {"or", OR},     {"print", PRINT}, {"return", RETURN}, {"super", SUPER},
-    {"this", THIS}, {"true", TRUE},   {"var", VAR},       {"while", WHILE}};
-
-inline static const TokenType *get_keyword_token(char *key) {
-  int low = 0;
-  int high = sizeof(keywords) / sizeof(Item);
-
-  while (low < high) {
-    int mid = (low + high) / 2;
+// Scans a slice of a larger source that starts on line first_line. The slice
+// must start and end outside any token, string or comment.
+ScanResult scan_chunk(const char *source, int length, int first_line,
+                      bool add_eof, FILE *out);
 
-    int c = strcmp(keywords[mid].key, key);
-    if (c == 0) {
-      return &keywords[mid].value;
-    }
-    if (c < 0) {
-      low = mid + 1;
-    } else {
-      high = mid;
-    }
-  }
-  return NULL;
-}
+// Splits source into up to threads chunks at newlines outside strings and
+// comments and scans them concurrently. The result is identical to
+// scan_tokens(source, length, out).
+ScanResult scan_tokens_parallel(const char *source, int length, int threads,
+                                FILE *out);
 #endif
@@ -0,0 +1,143 @@
+#include "shape.h"
+#include <stdlib.h>
+#include <string.h>
+
+static Shape *new_shape(Heap *heap, ObjClass *klass, const Shape *parent,
+                        const char *name) {
+  Shape *shape = malloc(sizeof(Shape));
+  if (shape == NULL) {
+    printf("Cannot allocate memory for a shape");
+    exit(1);
+  }
+  shape->klass = klass;
+  shape->parent = parent;
+  shape->name = name;
+  shape->field_count = parent == NULL ? 0 : parent->field_count + 1;
+  shape->transitions = NULL;
+  shape->sibling = NULL;
+  shape->next = heap->shapes;
+  heap->shapes = shape;
+  heap->shape_stats.shapes += 1;
+  return shape;
+}
+
+Shape *shape_root(Heap *heap, ObjClass *klass) {
+  return new_shape(heap, klass, NULL, NULL);
+}
+
+void shapes_free(Shape *shapes) {
+  while (shapes != NULL) {
+    Shape *next = shapes->next;
+    free(shapes);
+    shapes = next;
+  }
+}
+
+// The slot of field name, or METHOD_SLOT if shape has no such field.
+static uint32_t field_slot(const Shape *shape, const char *name) {
+  for (; shape->parent != NULL; shape = shape->parent) {
+    if (shape->name == name) {
+      return shape->field_count - 1;
+    }
+  }
+  return METHOD_SLOT;
+}
+
+static Shape *transition(Heap *heap, Shape *shape, const char *name) {
+  for (Shape *child = shape->transitions; child != NULL;
+       child = child->sibling) {
+    if (child->name == name) {
+      return child;
+    }
+  }
+  Shape *child = new_shape(heap, shape->klass, shape, name);
+  child->sibling = shape->transitions;
+  shape->transitions = child;
+  if (child->field_count > shape->klass->field_hint) {
+    shape->klass->field_hint = child->field_count;
+  }
+  return child;
+}
+
+static void remember(Heap *heap, PropertyCache *cache, CacheEntry entry) {
+  if (cache->megamorphic) {
+    return;
+  }
+  if (cache->count == CACHE_WAYS) {
+    cache->megamorphic = true;
+    cache->count = 0;
+    heap->shape_stats.megamorphic += 1;
+    return;
+  }
+  cache->entries[cache->count++] = entry;
+}
+
+PropertyKind property_get_miss(Heap *heap, PropertyCache *cache,
+                               ObjInstance *instance, const char *name,
+                               Value *value) {
+  heap->shape_stats.misses += 1;
+  Shape *shape = instance->shape;
+  uint32_t slot = field_slot(shape, name);
+  if (slot != METHOD_SLOT) {
+    remember(heap, cache, (CacheEntry){shape, shape, slot, NIL_VALUE});
+    *value = instance->fields[slot];
+    return PROPERTY_FIELD;
+  }
+  Value method = class_method(shape->klass, name);
+  if (is_nil(method)) {
+    return PROPERTY_MISSING;
+  }
+  remember(heap, cache, (CacheEntry){shape, shape, METHOD_SLOT, method});
+  *value = method;
+  return PROPERTY_METHOD;
+}
+
+void instance_grow(ObjInstance *instance, uint32_t capacity) {
+  uint32_t grown = instance->capacity < 4 ? 4 : instance->capacity * 2;
+  if (grown < capacity) {
+    grown = capacity;
+  }
+  Value *fields = malloc(sizeof(Value) * grown);
+  if (fields == NULL) {
+    printf("Cannot allocate memory for an instance");
+    exit(1);
+  }
+  memcpy(fields, instance->fields, sizeof(Value) * instance->capacity);
+  if (instance->fields != instance->inline_fields) {
+    free(instance->fields);
+  }
+  instance->fields = fields;
+  instance->capacity = grown;
+}
+
+void property_set_miss(Heap *heap, PropertyCache *cache,
+                       ObjInstance *instance, const char *name, Value value) {
+  heap->shape_stats.misses += 1;
+  Shape *shape = instance->shape;
+  uint32_t slot = field_slot(shape, name);
+  Shape *next = shape;
+  if (slot == METHOD_SLOT) {
+    next = transition(heap, shape, name);
+    slot = next->field_count - 1;
+    if (next->field_count > instance->capacity) {
+      instance_grow(instance, next->field_count);
+    }
+    instance->shape = next;
+    heap->shape_stats.transitions += 1;
+  }
+  remember(heap, cache, (CacheEntry){shape, next, slot, NIL_VALUE});
+  instance->fields[slot] = value;
+}
+
+void shape_print_stats(const Heap *heap, FILE *out) {
+  const ShapeStats *s = &heap->shape_stats;
+  uint64_t accesses = s->hits + s->misses;
+  fprintf(out, "shapes: %llu created, %llu transitions\n",
+          (unsigned long long)s->shapes, (unsigned long long)s->transitions);
+  fprintf(out,
+          "inline caches: %llu hits, %llu misses (%.1f%% hit rate), "
+          "%llu megamorphic sites\n",
+          (unsigned long long)s->hits, (unsigned long long)s->misses,
+          accesses == 0 ? 0.0 : 100.0 * s->hits / accesses,
+          (unsigned long long)s->megamorphic);
+}
@@ -0,0 +1,105 @@
+#ifndef SHAPE_H
+#define SHAPE_H
+
+#include "gc.h"
+
+// Hidden classes. An instance starts out with its class's empty shape;
+// adding a field moves it to a child shape, the transition for that name,
+// which every instance adding the same fields in the same order shares.
+// Shapes live as long as their heap, so an address an inline cache holds
+// is never reused for another shape.
+struct Shape {
+  ObjClass *klass;
+  const Shape *parent; // NULL for the empty shape
+  const char *name;    // the field this shape adds to its parent, interned
+  uint32_t field_count; // the new field's slot is field_count - 1
+  Shape *transitions;   // first child
+  Shape *sibling;       // next child of the parent
+  Shape *next;          // in the heap's list
+};
+
+#define CACHE_WAYS 4
+#define METHOD_SLOT UINT32_MAX
+
+// A shape an access site has seen, and what was found for it.
+typedef struct {
+  const Shape *shape;
+  Shape *next;   // a set adding the field moves the instance here
+  uint32_t slot; // of the field, METHOD_SLOT for a method
+  Value method;
+} CacheEntry;
+
+// The inline cache of one property access site: monomorphic with one
+// entry, polymorphic with up to CACHE_WAYS. Once a site has seen more
+// shapes it is megamorphic and stops caching.
+typedef struct {
+  CacheEntry entries[CACHE_WAYS];
+  uint32_t count;
+  bool megamorphic;
+} PropertyCache;
+
+typedef enum {
+  PROPERTY_MISSING,
+  PROPERTY_FIELD,
+  PROPERTY_METHOD,
+} PropertyKind;
+
+// The shape instances of klass start out with.
+Shape *shape_root(Heap *heap, ObjClass *klass);
+void shapes_free(Shape *shapes);
+
+PropertyKind property_get_miss(Heap *heap, PropertyCache *cache,
+                               ObjInstance *instance, const char *name,
+                               Value *value);
+void property_set_miss(Heap *heap, PropertyCache *cache,
+                       ObjInstance *instance, const char *name, Value value);
+
+// Finds name on instance: a field, or else a method of its class, whose
+// closure *value is set to.
+static inline PropertyKind property_get(Heap *heap, PropertyCache *cache,
+                                        ObjInstance *instance,
+                                        const char *name, Value *value) {
+  const Shape *shape = instance->shape;
+  for (uint32_t i = 0; i < cache->count; i++) {
+    const CacheEntry *entry = &cache->entries[i];
+    if (entry->shape == shape) {
+      heap->shape_stats.hits += 1;
+      if (entry->slot == METHOD_SLOT) {
+        *value = entry->method;
+        return PROPERTY_METHOD;
+      }
+      *value = instance->fields[entry->slot];
+      return PROPERTY_FIELD;
+    }
+  }
+  return property_get_miss(heap, cache, instance, name, value);
+}
+
+void instance_grow(ObjInstance *instance, uint32_t capacity);
+
+// Sets field name of instance, adding it if there is none. Doesn't
+// allocate on the heap.
+static inline void property_set(Heap *heap, PropertyCache *cache,
+                                ObjInstance *instance, const char *name,
+                                Value value) {
+  const Shape *shape = instance->shape;
+  for (uint32_t i = 0; i < cache->count; i++) {
+    const CacheEntry *entry = &cache->entries[i];
+    if (entry->shape == shape) {
+      heap->shape_stats.hits += 1;
+      if (entry->next != shape) {
+        if (entry->next->field_count > instance->capacity) {
+          instance_grow(instance, entry->next->field_count);
+        }
+        instance->shape = entry->next;
+        heap->shape_stats.transitions += 1;
+      }
+      instance->fields[entry->slot] = value;
+      return;
+    }
+  }
+  property_set_miss(heap, cache, instance, name, value);
+}
+
+void shape_print_stats(const Heap *heap, FILE *out);
+#endif
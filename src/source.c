@@ -0,0 +1,100 @@
+// mmap/madvise are POSIX, hidden by a strict -std=c17
+#define _DEFAULT_SOURCE
+
+#include "source.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool read_all(Source *source, int fd, FILE *out);
+
+bool source_load(Source *source, const char *filename, FILE *out) {
+  source->text = NULL;
+  source->length = 0;
+  source->mapped = false;
+
+  if (strcmp(filename, "-") == 0) {
+    return read_all(source, STDIN_FILENO, out);
+  }
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(out, "unable to open file '%s'\n", filename);
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text != MAP_FAILED) {
+      // the scanner makes a single front-to-back pass
+      madvise(text, st.st_size, MADV_SEQUENTIAL);
+      close(fd);
+      source->text = text;
+      source->length = st.st_size;
+      source->mapped = true;
+      return true;
+    }
+  }
+
+  // not mappable (fifo, device, empty file, ...)
+  bool ok = read_all(source, fd, out);
+  close(fd);
+  if (!ok) {
+    fprintf(out, "unable to read file '%s'\n", filename);
+  }
+  return ok;
+}
+
+// Reads fd to the end into a buffer that doubles as it fills, so loading
+// stays linear in the size of the input.
+static bool read_all(Source *source, int fd, FILE *out) {
+  size_t capacity = 4096;
+  size_t length = 0;
+  char *text = malloc(capacity);
+  if (text == NULL) {
+    fputs("Out of memory\n", out);
+    return false;
+  }
+
+  for (;;) {
+    if (length == capacity) {
+      capacity *= 2;
+      char *grown = realloc(text, capacity);
+      if (grown == NULL) {
+        free(text);
+        fputs("Out of memory\n", out);
+        return false;
+      }
+      text = grown;
+    }
+    ssize_t n = read(fd, text + length, capacity - length);
+    if (n < 0) {
+      free(text);
+      return false;
+    }
+    if (n == 0) {
+      break;
+    }
+    length += n;
+  }
+
+  source->text = text;
+  source->length = length;
+  source->mapped = false;
+  return true;
+}
+
+void source_free(Source *source) {
+  if (source->mapped) {
+    munmap((void *)source->text, source->length);
+  } else {
+    free((void *)source->text);
+  }
+  source->text = NULL;
+  source->length = 0;
+}
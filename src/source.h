@@ -0,0 +1,22 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// A script's text. Regular files are memory-mapped read-only, anything else
+// (pipes, stdin, ttys) is read in one go into a heap buffer. The text is not
+// guaranteed to be NUL-terminated: always use length.
+typedef struct {
+  const char *text;
+  size_t length;
+  bool mapped;
+} Source;
+
+// Loads filename, or stdin when filename is "-". Returns false (and prints a
+// message on out) if the script can't be read.
+bool source_load(Source *source, const char *filename, FILE *out);
+
+void source_free(Source *source);
+#endif
@@ -0,0 +1,998 @@
+#include "thunks.h"
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every frame's locals are on one stack: a function's start at its
+// callee's slot and its arguments follow. The values of the calls being
+// made go above them, from top.
+typedef struct {
+  VarMap *environment;
+  Heap *heap;
+  Value *stack;
+  uint32_t stack_capacity;
+  uint32_t frame; // index of the running function's locals
+  uint32_t top;   // next free slot
+  Value *locals;  // stack + frame, moved along with the stack
+  ObjClosure *closure; // NULL in the script
+  uint32_t depth;      // calls running
+  bool returning;      // a return statement has run
+  bool tail_call;      // ... and left a call for call() to make
+  ObjClosure *tail_method; // to run with the receiver the tail call left
+  Value result;
+  FILE *out;
+  jmp_buf on_error;
+} Exec;
+
+typedef Value (*ThunkFn)(const Thunk *t, Exec *x);
+
+struct Thunk {
+  ThunkFn run;
+  union {
+    Value constant;
+    struct {
+      const Thunk *left, *right;
+    } binary;
+    struct {
+      uint32_t left, right; // indices in the locals
+    } locals;
+    struct {
+      const Thunk *left;
+      double right;
+    } number; // right operand is a number literal
+    struct {
+      const Thunk *operand;
+    } unary;
+    struct {
+      uint32_t slot;    // in the locals or the environment
+      const char *name; // of globals being defined
+      const Thunk *value;
+    } variable;
+    struct {
+      const Thunk **items;
+      uint32_t count;
+    } sequence;
+    struct {
+      const Thunk *condition, *body, *increment;
+    } loop;
+    struct {
+      const Thunk *callee; // the instance of an invoke
+      const Thunk **arguments;
+      uint32_t count;
+      const char *name; // of the method an invoke calls, else NULL
+      PropertyCache *cache;
+    } call;
+    struct {
+      const Thunk *object;
+      const Thunk *value; // of a set
+      const char *name;
+      PropertyCache *cache;
+    } property;
+    struct {
+      const char *name;
+      const Thunk *superclass; // defines 'super', NULL if there is none
+      uint32_t slot;           // of 'super' in the locals
+      const Thunk **methods;
+      uint32_t count;
+    } klass;
+    struct {
+      const Thunk *superclass, *receiver;
+      const char *name;
+    } super;
+    struct {
+      const Function *function;
+      // a local index * 2 + 1 or an upvalue index * 2, per capture
+      const uint32_t *captures;
+    } closure;
+  } as;
+};
+
+#define EVAL(thunk) ((thunk)->run((thunk), x))
+
+static void runtime_error(Exec *x, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vfprintf(x->out, format, args);
+  va_end(args);
+  longjmp(x->on_error, 1);
+}
+
+static void not_numeric(Exec *x) {
+  runtime_error(x, "operands should be numeric");
+}
+
+static void numeric(Exec *x, Value left, Value right) {
+  if (!is_number(left) || !is_number(right)) {
+    not_numeric(x);
+  }
+}
+
+static Value run_constant(const Thunk *t, Exec *x) { return t->as.constant; }
+
+static Value run_get_local(const Thunk *t, Exec *x) {
+  return x->locals[t->as.variable.slot];
+}
+
+static Value run_get_global(const Thunk *t, Exec *x) {
+  return x->environment->entries[t->as.variable.slot].value;
+}
+
+static Value run_get_local_cell(const Thunk *t, Exec *x) {
+  return as_cell(x->locals[t->as.variable.slot])->value;
+}
+
+static Value run_get_upvalue(const Thunk *t, Exec *x) {
+  return x->closure->upvalues[t->as.variable.slot];
+}
+
+static Value run_get_upvalue_cell(const Thunk *t, Exec *x) {
+  return as_cell(x->closure->upvalues[t->as.variable.slot])->value;
+}
+
+// Assignments evaluate to nil, like visitAssignStmt. The value is
+// evaluated first, as a call in it can move the locals.
+static Value run_set_local(const Thunk *t, Exec *x) {
+  Value value = EVAL(t->as.variable.value);
+  x->locals[t->as.variable.slot] = value;
+  return NIL_VALUE;
+}
+
+static Value run_set_local_cell(const Thunk *t, Exec *x) {
+  Value value = EVAL(t->as.variable.value);
+  as_cell(x->locals[t->as.variable.slot])->value = value;
+  return NIL_VALUE;
+}
+
+// An assigned upvalue is always in a cell.
+static Value run_set_upvalue(const Thunk *t, Exec *x) {
+  Value value = EVAL(t->as.variable.value);
+  as_cell(x->closure->upvalues[t->as.variable.slot])->value = value;
+  return NIL_VALUE;
+}
+
+// The cell exists before the value, so a function can capture itself.
+static Value run_define_cell(const Thunk *t, Exec *x) {
+  Value cell = new_cell(x->heap, NIL_VALUE);
+  x->locals[t->as.variable.slot] = cell;
+  Value value = EVAL(t->as.variable.value);
+  as_cell(x->locals[t->as.variable.slot])->value = value;
+  return NIL_VALUE;
+}
+
+// Puts a captured parameter in a cell.
+static Value run_box_local(const Thunk *t, Exec *x) {
+  Value *parameter = &x->locals[t->as.variable.slot];
+  *parameter = new_cell(x->heap, *parameter);
+  return NIL_VALUE;
+}
+
+static Value run_set_global(const Thunk *t, Exec *x) {
+  Value value = EVAL(t->as.variable.value);
+  x->environment->entries[t->as.variable.slot].value = value;
+  return NIL_VALUE;
+}
+
+static Value run_define_global(const Thunk *t, Exec *x) {
+  Value value = EVAL(t->as.variable.value);
+  var_define(x->environment, t->as.variable.slot, t->as.variable.name, value);
+  return NIL_VALUE;
+}
+
+// Evaluates right while left is kept alive: right may allocate.
+static Value eval_right(const Thunk *right, Value left, Exec *x) {
+  if (!is_obj(left)) {
+    return EVAL(right);
+  }
+  uint32_t temps = x->heap->temp_count;
+  gc_protect(x->heap, left);
+  Value value = EVAL(right);
+  gc_unprotect(x->heap, temps);
+  return value;
+}
+
+static Value concat_strings(Exec *x, Value left, Value right) {
+  Value string = string_concat(x->heap, left, right);
+  if (is_nil(string)) {
+    runtime_error(x, "string too long");
+  }
+  return string;
+}
+
+// Each operator gets a generic thunk, one for two locals and one for a
+// number literal on the right, the common shapes in arithmetic. Only +
+// (concat) also takes two strings.
+#define BINARY(name, make_value, operator, concat)                             \
+  static Value run_##name(const Thunk *t, Exec *x) {                           \
+    Value left = EVAL(t->as.binary.left);                                      \
+    Value right = eval_right(t->as.binary.right, left, x);                     \
+    if (concat && is_string(left) && is_string(right)) {                       \
+      return concat_strings(x, left, right);                                   \
+    }                                                                          \
+    numeric(x, left, right);                                                   \
+    return make_value(as_number(left) operator as_number(right));              \
+  }                                                                            \
+  static Value run_##name##_locals(const Thunk *t, Exec *x) {                  \
+    Value left = x->locals[t->as.locals.left];                                 \
+    Value right = x->locals[t->as.locals.right];                               \
+    if (concat && is_string(left) && is_string(right)) {                       \
+      return concat_strings(x, left, right);                                   \
+    }                                                                          \
+    numeric(x, left, right);                                                   \
+    return make_value(as_number(left) operator as_number(right));              \
+  }                                                                            \
+  static Value run_##name##_number(const Thunk *t, Exec *x) {                  \
+    Value left = EVAL(t->as.number.left);                                      \
+    if (!is_number(left)) {                                                    \
+      not_numeric(x);                                                          \
+    }                                                                          \
+    return make_value(as_number(left) operator t->as.number.right);            \
+  }
+
+BINARY(add, number_value, +, true)
+BINARY(subtract, number_value, -, false)
+BINARY(multiply, number_value, *, false)
+BINARY(divide, number_value, /, false)
+BINARY(greater, bool_value, >, false)
+BINARY(greater_equal, bool_value, >=, false)
+BINARY(less, bool_value, <, false)
+BINARY(less_equal, bool_value, <=, false)
+#undef BINARY
+
+static Value run_equal(const Thunk *t, Exec *x) {
+  Value left = EVAL(t->as.binary.left);
+  Value right = eval_right(t->as.binary.right, left, x);
+  return bool_value(values_equal(left, right));
+}
+
+static Value run_negate(const Thunk *t, Exec *x) {
+  Value value = EVAL(t->as.unary.operand);
+  if (!is_number(value)) {
+    not_numeric(x);
+  }
+  return number_value(-as_number(value));
+}
+
+static Value run_not(const Thunk *t, Exec *x) {
+  Value value = EVAL(t->as.unary.operand);
+  return bool_value(is_falsey(value));
+}
+
+static Value run_print(const Thunk *t, Exec *x) {
+  Value value = EVAL(t->as.unary.operand);
+  if (!is_nil(value)) {
+    char buffer[VALUE_STRING_SIZE];
+    fprintf(x->out, "%s\n", value_string(value, buffer));
+  }
+  return NIL_VALUE;
+}
+
+// Statements stop running once a return statement has run.
+static Value run_sequence(const Thunk *t, Exec *x) {
+  const Thunk **items = t->as.sequence.items;
+  for (uint32_t i = 0; i < t->as.sequence.count && !x->returning; i++) {
+    EVAL(items[i]);
+  }
+  return NIL_VALUE;
+}
+
+static Value run_while(const Thunk *t, Exec *x) {
+  while (!is_falsey(EVAL(t->as.loop.condition))) {
+    EVAL(t->as.loop.body);
+    if (x->returning) {
+      break;
+    }
+    EVAL(t->as.loop.increment);
+  }
+  return NIL_VALUE;
+}
+
+// Captured variables are copied as they are: a variable in a cell is
+// shared by copying the cell.
+static Value run_closure(const Thunk *t, Exec *x) {
+  const Function *function = t->as.closure.function;
+  ObjClosure *closure =
+      new_closure(x->heap, function, function->capture_count);
+  for (uint32_t i = 0; i < function->capture_count; i++) {
+    uint32_t capture = t->as.closure.captures[i];
+    closure->upvalues[i] = capture & 1 ? x->locals[capture >> 1]
+                                       : x->closure->upvalues[capture >> 1];
+  }
+  return obj_value(&closure->obj);
+}
+
+// Makes room for size values on the stack, which can move it.
+static void reserve(Exec *x, uint32_t size) {
+  if (size <= x->stack_capacity) {
+    return;
+  }
+  while (x->stack_capacity < size) {
+    x->stack_capacity *= 2;
+  }
+  x->stack = realloc(x->stack, sizeof(Value) * x->stack_capacity);
+  if (x->stack == NULL) {
+    printf("Cannot allocate memory for the thunks");
+    exit(1);
+  }
+  x->locals = x->stack + x->frame;
+}
+
+static void push(Exec *x, Value value) {
+  reserve(x, x->top + 1);
+  x->stack[x->top++] = value;
+}
+
+static ObjInstance *instance(Exec *x, Value value, const char *message) {
+  if (!is_instance(value)) {
+    runtime_error(x, message);
+  }
+  return as_instance(value);
+}
+
+// Looks up the method an invoke runs with the instance in the callee's
+// slot. A field is called like any other value instead: it replaces the
+// instance and NULL is returned.
+static ObjClosure *lookup_method(const Thunk *t, Exec *x, uint32_t callee) {
+  ObjInstance *receiver =
+      instance(x, x->stack[callee], "Only instances have properties");
+  Value value;
+  switch (property_get(x->heap, t->as.call.cache, receiver, t->as.call.name,
+                       &value)) {
+  case PROPERTY_METHOD:
+    return as_closure(value);
+  case PROPERTY_FIELD:
+    x->stack[callee] = value;
+    return NULL;
+  default:
+    runtime_error(x, "Undefined property '%s'", t->as.call.name);
+    return NULL;
+  }
+}
+
+// Evaluates the callee and the arguments onto the top of the stack, where
+// the collector sees them. Returns the index of the callee; *method is set
+// for an invoke, see lookup_method.
+static uint32_t push_call(const Thunk *t, Exec *x, ObjClosure **method) {
+  uint32_t callee = x->top;
+  push(x, EVAL(t->as.call.callee));
+  for (uint32_t i = 0; i < t->as.call.count; i++) {
+    push(x, EVAL(t->as.call.arguments[i]));
+  }
+  *method = t->as.call.name == NULL ? NULL : lookup_method(t, x, callee);
+  return callee;
+}
+
+// The closure a call of stack[callee] runs. A bound method runs with its
+// receiver in the callee's slot, a class's init with a new instance there.
+// NULL if there's nothing to run: a class without init.
+static ObjClosure *callee_closure(Exec *x, uint32_t callee, uint32_t count) {
+  Value value = x->stack[callee];
+  ObjClosure *closure;
+  if (is_closure(value)) {
+    closure = as_closure(value);
+  } else if (is_bound_method(value)) {
+    closure = as_bound_method(value)->method;
+    x->stack[callee] = as_bound_method(value)->receiver;
+  } else if (is_class(value)) {
+    x->stack[callee] = new_instance(x->heap, as_class(value));
+    if (is_nil(as_class(value)->init)) {
+      if (count != 0) {
+        runtime_error(x, "Expected 0 arguments but got %u", count);
+      }
+      return NULL;
+    }
+    closure = as_closure(as_class(value)->init);
+  } else {
+    runtime_error(x, "Can only call functions and classes");
+    return NULL;
+  }
+  if (count != closure->function->arity) {
+    runtime_error(x, "Expected %u arguments but got %u",
+                  closure->function->arity, count);
+  }
+  return closure;
+}
+
+// Runs the function at stack[callee] with the arguments after it, or
+// method with the receiver there. Tail calls replace them and go round
+// again instead of nesting.
+static Value call(Exec *x, uint32_t callee, uint32_t count,
+                  ObjClosure *method) {
+  if (x->depth == CALL_DEPTH_MAX) {
+    runtime_error(x, "Stack overflow");
+  }
+  x->depth += 1;
+  ObjClosure *closure = x->closure;
+  uint32_t frame = x->frame;
+  for (;;) {
+    ObjClosure *running =
+        method != NULL ? method : callee_closure(x, callee, count);
+    if (running == NULL) {
+      x->result = x->stack[callee];
+      break;
+    }
+    const Function *function = running->function;
+    const ThunkProgram *program = function->code;
+    x->closure = running;
+    x->frame = callee;
+    reserve(x, x->frame + program->max_locals);
+    x->locals = x->stack + x->frame;
+    for (uint32_t i = count + 1; i < program->max_locals; i++) {
+      x->locals[i] = NIL_VALUE;
+    }
+    x->top = x->frame + program->max_locals;
+    EVAL(program->body);
+    x->returning = false;
+    // init evaluates to the instance, whatever it returns
+    if (function->initializer) {
+      x->result = x->stack[callee];
+    }
+    if (!x->tail_call) {
+      break;
+    }
+    x->tail_call = false;
+    method = x->tail_method;
+    x->tail_method = NULL;
+    count = x->top - callee - 1;
+  }
+  Value result = x->result;
+  x->result = NIL_VALUE;
+  x->closure = closure;
+  x->frame = frame;
+  x->locals = x->stack + frame;
+  x->top = callee;
+  x->depth -= 1;
+  return result;
+}
+
+static Value run_call(const Thunk *t, Exec *x) {
+  ObjClosure *method;
+  uint32_t callee = push_call(t, x, &method);
+  return call(x, callee, t->as.call.count, method);
+}
+
+static Value run_return(const Thunk *t, Exec *x) {
+  x->result = EVAL(t->as.unary.operand);
+  x->returning = true;
+  return NIL_VALUE;
+}
+
+// A tail call moves the callee and its arguments down over the frame of the
+// function returning, for call() to run in its place.
+static Value run_tail_call(const Thunk *t, Exec *x) {
+  ObjClosure *method;
+  uint32_t from = push_call(t, x, &method);
+  uint32_t callee = x->frame;
+  uint32_t count = t->as.call.count + 1;
+  // short, so a loop beats memmove
+  for (uint32_t i = 0; i < count; i++) {
+    x->stack[callee + i] = x->stack[from + i];
+  }
+  x->top = callee + count;
+  x->tail_call = true;
+  x->tail_method = method;
+  x->result = NIL_VALUE;
+  x->returning = true;
+  return NIL_VALUE;
+}
+
+// The methods are made in the class's scope, whose first local is 'super'
+// in a subclass.
+static Value run_class(const Thunk *t, Exec *x) {
+  if (t->as.klass.superclass != NULL) {
+    EVAL(t->as.klass.superclass);
+    if (!is_class(x->locals[t->as.klass.slot])) {
+      runtime_error(x, "Superclass must be a class");
+    }
+  }
+  uint32_t methods = x->top;
+  for (uint32_t i = 0; i < t->as.klass.count; i++) {
+    push(x, EVAL(t->as.klass.methods[i]));
+  }
+  const ObjClass *superclass = t->as.klass.superclass == NULL
+                                   ? NULL
+                                   : as_class(x->locals[t->as.klass.slot]);
+  Value klass = new_class(x->heap, t->as.klass.name, superclass,
+                          &x->stack[methods], t->as.klass.count);
+  x->top = methods;
+  return klass;
+}
+
+// A method read without calling it is bound to the instance.
+static Value run_get_property(const Thunk *t, Exec *x) {
+  Value object = EVAL(t->as.property.object);
+  ObjInstance *receiver =
+      instance(x, object, "Only instances have properties");
+  Value value;
+  switch (property_get(x->heap, t->as.property.cache, receiver,
+                       t->as.property.name, &value)) {
+  case PROPERTY_FIELD:
+    return value;
+  case PROPERTY_METHOD:
+    return new_bound_method(x->heap, object, as_closure(value));
+  default:
+    runtime_error(x, "Undefined property '%s'", t->as.property.name);
+    return NIL_VALUE;
+  }
+}
+
+static Value run_set_property(const Thunk *t, Exec *x) {
+  Value object = EVAL(t->as.property.object);
+  Value value = eval_right(t->as.property.value, object, x);
+  ObjInstance *receiver = instance(x, object, "Only instances have fields");
+  property_set(x->heap, t->as.property.cache, receiver, t->as.property.name,
+               value);
+  return NIL_VALUE;
+}
+
+static Value run_get_super(const Thunk *t, Exec *x) {
+  Value superclass = EVAL(t->as.super.superclass);
+  Value receiver = EVAL(t->as.super.receiver);
+  Value method = class_method(as_class(superclass), t->as.super.name);
+  if (is_nil(method)) {
+    runtime_error(x, "Undefined property '%s'", t->as.super.name);
+  }
+  return new_bound_method(x->heap, receiver, as_closure(method));
+}
+
+typedef struct {
+  const Ast *ast;
+  Arena *arena;
+  uint16_t level; // block nesting, 0 for the environment
+  uint32_t live;  // locals of the open blocks declared so far
+  // index of the first local of each open block, by level
+  uint32_t *base;
+  uint32_t base_capacity;
+  uint32_t max_locals;
+} Lowering;
+
+static const Thunk *lower_expression(Lowering *l, NodeIndex index);
+static const Thunk *lower_statement(Lowering *l, NodeIndex index);
+
+static Thunk *thunk(Lowering *l, ThunkFn run) {
+  Thunk *t = arena_alloc(l->arena, sizeof(Thunk));
+  memset(t, 0, sizeof(Thunk));
+  t->run = run;
+  return t;
+}
+
+// Opens a scope whose locals go after the live ones.
+static void begin_level(Lowering *l) {
+  l->level += 1;
+  if (l->level >= l->base_capacity) {
+    while (l->level >= l->base_capacity) {
+      l->base_capacity = l->base_capacity == 0 ? 16 : l->base_capacity * 2;
+    }
+    l->base = realloc(l->base, sizeof(uint32_t) * l->base_capacity);
+    if (l->base == NULL) {
+      printf("Cannot allocate memory for the thunks");
+      exit(1);
+    }
+  }
+  l->base[l->level] = l->live;
+}
+
+static uint32_t local(Lowering *l, uint16_t level, uint32_t slot) {
+  uint32_t index = l->base[level] + slot;
+  if (index + 1 > l->max_locals) {
+    l->max_locals = index + 1;
+  }
+  return index;
+}
+
+static const Thunk *constant(Lowering *l, Value value) {
+  Thunk *t = thunk(l, run_constant);
+  t->as.constant = value;
+  return t;
+}
+
+// The local index a variable read uses, or UINT32_MAX if it isn't a local.
+static uint32_t local_read(Lowering *l, NodeIndex index) {
+  const Node *node = ast_node(l->ast, index);
+  if (node->kind != VARIABLE_EXPR || node->depth == l->level ||
+      node->op != 0) {
+    return UINT32_MAX;
+  }
+  return local(l, l->level - node->depth, node->as.variable.slot);
+}
+
+static bool number_literal(Lowering *l, NodeIndex index) {
+  const Node *node = ast_node(l->ast, index);
+  return node->kind == LITERAL_EXPR &&
+         node->as.literal.constant != NIL_CONSTANT &&
+         is_number(l->ast->constants[node->as.literal.constant]);
+}
+
+static const Thunk *lower_binary(Lowering *l, const Node *node) {
+  ThunkFn generic, locals, number;
+  switch (node->op) {
+#define OPERATOR(token, name)                                                  \
+  case token:                                                                  \
+    generic = run_##name;                                                      \
+    locals = run_##name##_locals;                                              \
+    number = run_##name##_number;                                              \
+    break;
+    OPERATOR(PLUS, add)
+    OPERATOR(MINUS, subtract)
+    OPERATOR(STAR, multiply)
+    OPERATOR(SLASH, divide)
+    OPERATOR(GREATER, greater)
+    OPERATOR(GREATER_EQUAL, greater_equal)
+    OPERATOR(LESS, less)
+    OPERATOR(LESS_EQUAL, less_equal)
+#undef OPERATOR
+  case BANG_EQUAL: // the tree walker doesn't negate != either
+  case EQUAL_EQUAL:
+    generic = run_equal;
+    locals = NULL;
+    number = NULL;
+    break;
+  default:
+    return constant(l, NIL_VALUE);
+  }
+
+  NodeIndex left = node->as.binary.left;
+  NodeIndex right = node->as.binary.right;
+  uint32_t left_local = local_read(l, left);
+  uint32_t right_local = local_read(l, right);
+  if (locals != NULL && left_local != UINT32_MAX &&
+      right_local != UINT32_MAX) {
+    Thunk *t = thunk(l, locals);
+    t->as.locals.left = left_local;
+    t->as.locals.right = right_local;
+    return t;
+  }
+  if (number != NULL && number_literal(l, right)) {
+    Thunk *t = thunk(l, number);
+    t->as.number.left = lower_expression(l, left);
+    uint32_t literal = ast_node(l->ast, right)->as.literal.constant;
+    t->as.number.right = as_number(l->ast->constants[literal]);
+    return t;
+  }
+  Thunk *t = thunk(l, generic);
+  t->as.binary.left = lower_expression(l, left);
+  t->as.binary.right = lower_expression(l, right);
+  return t;
+}
+
+// run is indexed by where the variable is: an upvalue, a global, or a
+// local, and then whether it is in a cell.
+static Thunk *lower_variable(Lowering *l, const ThunkFn run[3][2],
+                             const Node *node, uint32_t slot) {
+  uint16_t level = l->level - node->depth;
+  bool cell = node->op & VAR_CELL;
+  Thunk *t;
+  if (node->op & VAR_UPVALUE) {
+    t = thunk(l, run[0][cell]);
+    t->as.variable.slot = slot;
+  } else if (level == 0) {
+    t = thunk(l, run[1][cell]);
+    t->as.variable.slot = slot;
+  } else {
+    t = thunk(l, run[2][cell]);
+    t->as.variable.slot = local(l, level, slot);
+  }
+  return t;
+}
+
+static const ThunkFn get_variable[3][2] = {
+    {run_get_upvalue, run_get_upvalue_cell},
+    {run_get_global, run_get_global},
+    {run_get_local, run_get_local_cell},
+};
+
+static const ThunkFn set_variable[3][2] = {
+    {run_set_upvalue, run_set_upvalue},
+    {run_set_global, run_set_global},
+    {run_set_local, run_set_local_cell},
+};
+
+static const Thunk **lower_list(Lowering *l, uint32_t first, uint32_t count) {
+  const Thunk **items = arena_alloc(l->arena, sizeof(Thunk *) * count);
+  for (uint32_t i = 0; i < count; i++) {
+    items[i] = lower_expression(l, l->ast->lists[first + i]);
+  }
+  return items;
+}
+
+// A call of instance.name is an invoke: the instance takes the callee's
+// slot and no bound method is made for it.
+static Thunk *lower_call(Lowering *l, const Node *node, ThunkFn run) {
+  Thunk *t = thunk(l, run);
+  const Node *callee = ast_node(l->ast, node->as.call.callee);
+  if (callee->kind == GET_EXPR) {
+    t->as.call.callee = lower_expression(l, callee->as.property.object);
+    t->as.call.name = l->ast->names[callee->as.property.name];
+    t->as.call.cache = &l->ast->caches[callee->as.property.cache];
+  } else {
+    t->as.call.callee = lower_expression(l, node->as.call.callee);
+  }
+  t->as.call.arguments =
+      lower_list(l, node->as.call.first, node->as.call.count);
+  t->as.call.count = node->as.call.count;
+  return t;
+}
+
+static void lower_function(Lowering *l, Function *function);
+
+static const Thunk *lower_closure(Lowering *l, const Node *node) {
+  Function *function = ast_function(l->ast, node);
+  lower_function(l, function);
+  uint32_t *captures =
+      arena_alloc(l->arena, sizeof(uint32_t) * (function->capture_count + 1));
+  const Capture *capture = &l->ast->captures[function->first_capture];
+  for (uint32_t i = 0; i < function->capture_count; i++) {
+    captures[i] =
+        capture[i].local
+            ? local(l, l->level - capture[i].depth, capture[i].slot) << 1 | 1
+            : capture[i].slot << 1;
+  }
+  Thunk *t = thunk(l, run_closure);
+  t->as.closure.function = function;
+  t->as.closure.captures = captures;
+  return t;
+}
+
+static const Thunk *lower_class(Lowering *l, const Node *node) {
+  begin_level(l);
+  Thunk *t = thunk(l, run_class);
+  t->as.klass.name = l->ast->names[node->as.klass.name];
+  uint32_t first = node->as.klass.first;
+  uint32_t count = node->as.klass.count;
+  if (node->op & CLASS_SUBCLASS) {
+    t->as.klass.superclass = lower_statement(l, l->ast->lists[first]);
+    t->as.klass.slot = local(l, l->level, 0);
+    first += 1;
+    count -= 1;
+  }
+  t->as.klass.methods = lower_list(l, first, count);
+  t->as.klass.count = count;
+  l->live = l->base[l->level];
+  l->level -= 1;
+  return t;
+}
+
+static const Thunk *lower_expression(Lowering *l, NodeIndex index) {
+  if (index == NO_NODE) {
+    return constant(l, NIL_VALUE);
+  }
+  const Node *node = ast_node(l->ast, index);
+  switch ((NodeKind)node->kind) {
+  case BINARY_EXPR:
+    return lower_binary(l, node);
+  case UNARY_EXPR: {
+    if (node->op != MINUS && node->op != BANG) {
+      return constant(l, NIL_VALUE);
+    }
+    Thunk *t = thunk(l, node->op == MINUS ? run_negate : run_not);
+    t->as.unary.operand = lower_expression(l, node->as.unary.right);
+    return t;
+  }
+  case LITERAL_EXPR:
+    if (node->as.literal.constant == NIL_CONSTANT) {
+      return constant(l, NIL_VALUE);
+    }
+    return constant(l, l->ast->constants[node->as.literal.constant]);
+  case GROUP_EXPR:
+    return lower_expression(l, node->as.group.expression);
+  case VARIABLE_EXPR:
+    return lower_variable(l, get_variable, node, node->as.variable.slot);
+  case ASSIGN_STMT: {
+    // lowered first, its locals must be the ones before the assignment
+    const Thunk *value = lower_expression(l, node->as.assign.value);
+    Thunk *t = lower_variable(l, set_variable, node, node->as.assign.slot);
+    t->as.variable.value = value;
+    return t;
+  }
+  case FUNCTION_EXPR:
+    return lower_closure(l, node);
+  case CALL_EXPR:
+    return lower_call(l, node, run_call);
+  case CLASS_EXPR:
+    return lower_class(l, node);
+  case GET_EXPR:
+  case SET_EXPR: {
+    const Node *get = node->kind == GET_EXPR
+                          ? node
+                          : ast_node(l->ast, node->as.set.target);
+    Thunk *t = thunk(l, node->kind == GET_EXPR ? run_get_property
+                                               : run_set_property);
+    t->as.property.object = lower_expression(l, get->as.property.object);
+    if (node->kind == SET_EXPR) {
+      t->as.property.value = lower_expression(l, node->as.set.value);
+    }
+    t->as.property.name = l->ast->names[get->as.property.name];
+    t->as.property.cache = &l->ast->caches[get->as.property.cache];
+    return t;
+  }
+  case SUPER_EXPR: {
+    Thunk *t = thunk(l, run_get_super);
+    t->as.super.superclass = lower_expression(l, node->as.super.superclass);
+    t->as.super.receiver = lower_expression(l, node->as.super.receiver);
+    t->as.super.name = l->ast->names[node->as.super.name];
+    return t;
+  }
+  default:
+    // statements and errors have no value
+    return constant(l, NIL_VALUE);
+  }
+}
+
+static const Thunk *lower_block(Lowering *l, uint32_t first, uint32_t count) {
+  Thunk *t = thunk(l, run_sequence);
+  t->as.sequence.items = arena_alloc(l->arena, sizeof(Thunk *) * count);
+  t->as.sequence.count = count;
+  for (uint32_t i = 0; i < count; i++) {
+    t->as.sequence.items[i] = lower_statement(l, l->ast->lists[first + i]);
+  }
+  return t;
+}
+
+static const Thunk *lower_statement(Lowering *l, NodeIndex index) {
+  const Node *node = ast_node(l->ast, index);
+  switch ((NodeKind)node->kind) {
+  case PRINT_STMT: {
+    Thunk *t = thunk(l, run_print);
+    t->as.unary.operand = lower_expression(l, node->as.group.expression);
+    return t;
+  }
+  case EXPR_STMT:
+    return lower_expression(l, node->as.group.expression);
+  case VARIABLE_STMT: {
+    if (node->op & VAR_CELL) {
+      Thunk *t = thunk(l, run_define_cell);
+      t->as.variable.slot = local(l, l->level, node->as.assign.slot);
+      l->live = t->as.variable.slot + 1;
+      t->as.variable.value = lower_expression(l, node->as.assign.value);
+      return t;
+    }
+    const Thunk *value = lower_expression(l, node->as.assign.value);
+    Thunk *t;
+    if (l->level == 0) {
+      t = thunk(l, run_define_global);
+      t->as.variable.slot = node->as.assign.slot;
+      t->as.variable.name = l->ast->names[node->as.assign.name];
+    } else {
+      t = thunk(l, run_set_local);
+      t->as.variable.slot = local(l, l->level, node->as.assign.slot);
+      l->live = t->as.variable.slot + 1;
+    }
+    t->as.variable.value = value;
+    return t;
+  }
+  case BLOCK_STMT: {
+    begin_level(l);
+    const Thunk *block =
+        lower_block(l, node->as.block.first, node->as.block.count);
+    l->live = l->base[l->level];
+    l->level -= 1;
+    return block;
+  }
+  case WHILE_STMT: {
+    Thunk *t = thunk(l, run_while);
+    // a for loop without a condition loops forever
+    t->as.loop.condition = node->as.loop.condition == NO_NODE
+                               ? constant(l, TRUE_VALUE)
+                               : lower_expression(l, node->as.loop.condition);
+    t->as.loop.body = lower_statement(l, node->as.loop.body);
+    t->as.loop.increment = lower_expression(l, node->as.loop.increment);
+    return t;
+  }
+  case RETURN_STMT: {
+    NodeIndex value = node->as.group.expression;
+    const Node *call = value == NO_NODE ? NULL : ast_node(l->ast, value);
+    if (call != NULL && call->kind == CALL_EXPR && call->op == CALL_TAIL) {
+      return lower_call(l, call, run_tail_call);
+    }
+    Thunk *t = thunk(l, run_return);
+    t->as.unary.operand = lower_expression(l, value);
+    return t;
+  }
+  default:
+    return lower_expression(l, index);
+  }
+}
+
+// Lowers a function into a program of its own. Its first local is the
+// callee's slot and its parameters follow, where call() leaves the
+// arguments; the ones in cells are boxed first thing.
+static void lower_function(Lowering *l, Function *function) {
+  Lowering lowering;
+  lowering.ast = l->ast;
+  lowering.arena = l->arena;
+  lowering.level = function->level - 1;
+  lowering.live = 0;
+  lowering.base = NULL;
+  lowering.base_capacity = 0;
+  begin_level(&lowering);
+  lowering.live = function->arity + 1;
+  lowering.max_locals = function->arity + 1;
+
+  const NodeIndex *statements = &l->ast->lists[function->first];
+  Thunk *body = thunk(l, run_sequence);
+  body->as.sequence.items =
+      arena_alloc(l->arena, sizeof(Thunk *) * (function->count + 1));
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < function->arity; i++) {
+    if (ast_node(l->ast, statements[i])->op & VAR_CELL) {
+      Thunk *t = thunk(l, run_box_local);
+      t->as.variable.slot = i + 1;
+      body->as.sequence.items[count++] = t;
+    }
+  }
+  for (uint32_t i = function->arity; i < function->count; i++) {
+    body->as.sequence.items[count++] =
+        lower_statement(&lowering, statements[i]);
+  }
+  body->as.sequence.count = count;
+
+  ThunkProgram *program = arena_alloc(l->arena, sizeof(ThunkProgram));
+  program->body = body;
+  program->max_locals = lowering.max_locals;
+  free(lowering.base);
+  function->code = program;
+}
+
+ThunkProgram *thunks_compile(const Ast *ast, Arena *arena) {
+  Lowering lowering;
+  lowering.ast = ast;
+  lowering.arena = arena;
+  lowering.level = 0;
+  lowering.live = 0;
+  lowering.base = NULL;
+  lowering.base_capacity = 0;
+  lowering.max_locals = 0;
+
+  ThunkProgram *program = arena_alloc(arena, sizeof(ThunkProgram));
+  program->body =
+      lower_block(&lowering, ast->first_statement, ast->statement_count);
+  program->max_locals = lowering.max_locals;
+
+  free(lowering.base);
+  return program;
+}
+
+static void mark_stack(Heap *heap, void *context) {
+  Exec *x = context;
+  for (uint32_t i = 0; i < x->top; i++) {
+    gc_mark_value(heap, x->stack[i]);
+  }
+  gc_mark_value(heap, x->result);
+}
+
+bool thunks_run(VarMap *environment, const ThunkProgram *program, FILE *out) {
+  Exec exec;
+  Exec *x = &exec;
+  x->environment = environment;
+  x->heap = environment->heap;
+  x->out = out;
+  x->frame = 0;
+  x->top = program->max_locals;
+  x->stack = malloc(sizeof(Value) * (program->max_locals + 256));
+  if (x->stack == NULL) {
+    printf("Cannot allocate memory for the thunks");
+    exit(1);
+  }
+  x->stack_capacity = program->max_locals + 256;
+  x->locals = x->stack;
+  for (uint32_t i = 0; i < x->top; i++) {
+    x->locals[i] = NIL_VALUE;
+  }
+  x->closure = NULL;
+  x->depth = 0;
+  x->returning = false;
+  x->tail_call = false;
+  x->tail_method = NULL;
+  x->result = NIL_VALUE;
+  uint32_t temps = x->heap->temp_count;
+  gc_push_roots(x->heap, mark_stack, x);
+  bool ok = false;
+  if (setjmp(x->on_error) == 0) {
+    EVAL(program->body);
+    ok = true;
+  }
+  gc_unprotect(x->heap, temps);
+  gc_pop_roots(x->heap);
+  free(x->stack);
+  return ok;
+}
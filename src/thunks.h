@@ -0,0 +1,24 @@
+#ifndef THUNKS_H
+#define THUNKS_H
+
+#include "arena.h"
+#include "interpreter.h"
+
+// The closure-compilation engine: the AST is lowered once into a tree of
+// thunks, each a C function pointer with its operands already resolved, so
+// running a node is a single indirect call.
+typedef struct Thunk Thunk;
+
+typedef struct {
+  const Thunk *body;
+  uint32_t max_locals; // block variables live at the same time
+} ThunkProgram;
+
+// Lowers a resolved AST. Everything is allocated in arena, which must
+// outlive the program, as must the Ast.
+ThunkProgram *thunks_compile(const Ast *ast, Arena *arena);
+
+// Runs a lowered script in environment, printing to out. Behaves like
+// interpret(). Returns false if a runtime error stopped execution.
+bool thunks_run(VarMap *environment, const ThunkProgram *program, FILE *out);
+#endif
@@ -3,15 +3,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-Token *newToken(void) {
-  Token *token = malloc(sizeof(Token));
-  if (token == NULL) {
-    printf("can't allocate memory for Token");
-    exit(1);
-  }
-  return token;
-}
-
 void tokenlist_init(TokenList *list) {
   list->tokens = malloc(sizeof(Token) * 32);
   if (list->tokens == NULL) {
@@ -22,10 +13,14 @@ void tokenlist_init(TokenList *list) {
   list->capacity = 32;
 }
 
-void tokenlist_add(TokenList *list, Token *value) {
+void tokenlist_add(TokenList *list, Token value) {
   if (list->size >= list->capacity) {
     list->capacity *= 2;
     list->tokens = realloc(list->tokens, sizeof(Token) * list->capacity);
+    if (list->tokens == NULL) {
+      printf("Cannot allocate memory for TokenList");
+      exit(1);
+    }
   }
   list->tokens[list->size] = value;
   list->size += 1;
@@ -36,15 +31,15 @@ Token *tokenlist_get(TokenList *list, int index) {
     printf("Index %d out of bounds for list of size %d\n", index, list->size);
     exit(1);
   }
-  return list->tokens[index];
+  return &list->tokens[index];
 }
 
-Token *tokenlist_last(TokenList *list) { return list->tokens[list->size - 1]; }
+Token *tokenlist_last(TokenList *list) { return &list->tokens[list->size - 1]; }
 
 void tokenlist_print(TokenList *tokenlist) {
   for (int i = 0; i < tokenlist->size; i++) {
     Token *token = tokenlist_get(tokenlist, i);
-    printf("%s(%s)", token_name(token->type), token->lexeme);
+    printf("%s(%.*s)", token_name(token->type), token->length, token->start);
   }
   printf("\n");
 }
@@ -61,24 +61,27 @@ static inline const char *token_name(TokenType type) {
   return tokens[type];
 }
 
+// A token does not own its text: start points into the source buffer, so the
+// source must outlive every TokenList (and AST) built from it.
 typedef struct Token {
   TokenType type;
-  char *lexeme;
-  char *literal;
+  const char *start;
+  int length;
   int line;
+  // interned name of an IDENTIFIER, interned contents (without quotes) of a
+  // STRING, NULL for everything else
+  const char *symbol;
 } Token;
 
 typedef struct TokenList {
-  Token **tokens;
+  Token *tokens;
   int size;
   int capacity;
 } TokenList;
 
-Token *newToken(void);
-
 void tokenlist_init(TokenList *list);
 
-void tokenlist_add(TokenList *list, Token *value);
+void tokenlist_add(TokenList *list, Token value);
 
 Token *tokenlist_get(TokenList *list, int index);
 
@@ -3,7 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-char *substring(char *string, int position, int length) {
+char *substring(const char *string, int position, int length) {
   char *ptr = malloc(length + 1);
   if (ptr == NULL) {
     printf("out of memory");
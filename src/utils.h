@@ -1,6 +1,6 @@
 #ifndef UTILS_H
 #define UTILS_H
 
-char *substring(char *string, int position, int length);
+char *substring(const char *string, int position, int length);
 
 #endif
@@ -0,0 +1,70 @@
+#ifndef VALUE_H
+#define VALUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// A Lox value in 64 bits, passed and stored by value. Numbers are plain
+// doubles. Everything else is hidden in the quiet NaNs, which arithmetic
+// never produces with these bit patterns: nil and the booleans as small tags,
+// objects (see object.h) as their pointer (48 bits) with the sign bit set.
+typedef uint64_t Value;
+
+typedef struct Obj Obj;
+
+#define QNAN ((uint64_t)0x7ffc000000000000)
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+
+#define NIL_VALUE ((Value)(QNAN | TAG_NIL))
+#define FALSE_VALUE ((Value)(QNAN | TAG_FALSE))
+#define TRUE_VALUE ((Value)(QNAN | TAG_TRUE))
+#define OBJ_TAG (SIGN_BIT | QNAN)
+
+static inline Value number_value(double number) {
+  Value value;
+  memcpy(&value, &number, sizeof(double));
+  return value;
+}
+
+static inline Value bool_value(bool boolean) {
+  return boolean ? TRUE_VALUE : FALSE_VALUE;
+}
+
+static inline Value obj_value(Obj *obj) {
+  return OBJ_TAG | (uint64_t)(uintptr_t)obj;
+}
+
+static inline bool is_number(Value value) { return (value & QNAN) != QNAN; }
+
+static inline bool is_nil(Value value) { return value == NIL_VALUE; }
+
+static inline bool is_bool(Value value) { return (value | 1) == TRUE_VALUE; }
+
+static inline bool is_obj(Value value) { return (value & OBJ_TAG) == OBJ_TAG; }
+
+static inline double as_number(Value value) {
+  double number;
+  memcpy(&number, &value, sizeof(double));
+  return number;
+}
+
+static inline bool as_bool(Value value) { return value == TRUE_VALUE; }
+
+// nil and false are false as conditions, everything else is true
+static inline bool is_falsey(Value value) {
+  return is_nil(value) || value == FALSE_VALUE;
+}
+
+static inline Obj *as_obj(Value value) {
+  return (Obj *)(uintptr_t)(value & ~OBJ_TAG);
+}
+
+#define VALUE_STRING_SIZE 50
+
+// buffer must hold VALUE_STRING_SIZE chars; the result may point into it
+const char *value_string(Value value, char *buffer);
+#endif
@@ -0,0 +1,479 @@
+#include "vm.h"
+#include <stdlib.h>
+#include <string.h>
+
+// GCC and clang can jump straight from one instruction to the next through
+// a table of label addresses instead of going back to the switch.
+#if defined(__GNUC__)
+#define COMPUTED_GOTO 1
+#else
+#define COMPUTED_GOTO 0
+#endif
+
+static inline uint32_t read_operand(const uint8_t *ip) {
+  uint32_t operand;
+  memcpy(&operand, ip, sizeof(uint32_t));
+  return operand;
+}
+
+// What the collector has to see of the running chunks: the one stack
+// holds the locals and operands of every frame. top is only brought up to
+// date before an instruction that can allocate.
+typedef struct {
+  Value *stack;
+  Value *top;
+} VmRoots;
+
+static void mark_vm(Heap *heap, void *context) {
+  VmRoots *roots = context;
+  for (Value *value = roots->stack; value < roots->top; value++) {
+    gc_mark_value(heap, *value);
+  }
+}
+
+// A running function, or the script in the first frame. Its locals start
+// at the callee's slot on the stack and its operands follow its locals.
+typedef struct {
+  const Chunk *chunk;
+  const uint8_t *ip; // where to go on when the function it called returns
+  uint32_t locals;   // index in the stack
+  ObjClosure *closure;
+} CallFrame;
+
+// Makes the stack hold at least size values. It can move, so the caller
+// rebases its pointers into it.
+static void grow_stack(VmRoots *roots, size_t *capacity, size_t size) {
+  while (*capacity < size) {
+    *capacity *= 2;
+  }
+  Value *stack = realloc(roots->stack, sizeof(Value) * *capacity);
+  if (stack == NULL) {
+    printf("Cannot allocate memory for the VM");
+    exit(1);
+  }
+  roots->stack = stack;
+}
+
+bool vm_run(VarMap *environment, const Chunk *script, FILE *out) {
+  // the script's callee slot stays nil
+  size_t capacity = 256;
+  VmRoots roots = {NULL, NULL};
+  grow_stack(&roots, &capacity, 1 + script->max_locals + script->max_stack);
+  CallFrame *frames = malloc(sizeof(CallFrame) * (CALL_DEPTH_MAX + 1));
+  if (frames == NULL) {
+    printf("Cannot allocate memory for the VM");
+    exit(1);
+  }
+  Value *locals = roots.stack + 1;
+  for (uint32_t i = 0; i <= script->max_locals; i++) {
+    roots.stack[i] = NIL_VALUE;
+  }
+  Heap *heap = environment->heap;
+  roots.top = locals + script->max_locals;
+  gc_push_roots(heap, mark_vm, &roots);
+  // resolve() has reserved all slots, so defining globals doesn't move them
+  MapEntry *globals = environment->entries;
+  const Chunk *chunk = script;
+  ObjClosure *closure = NULL;
+  frames[0] = (CallFrame){script, NULL, 1, NULL};
+  uint32_t frame_count = 1;
+  uint32_t call_count = 0; // arguments of the call being made
+  bool tail = false;       // whether it replaces the running call
+  ObjClosure *callee_closure = NULL; // what it runs
+  Value *top = roots.top;  // next free slot
+  const uint8_t *ip = chunk->code;
+  bool ok = true;
+
+#define PUSH(value) (*top++ = (value))
+#define POP() (*--top)
+#define OPERAND() (ip += sizeof(uint32_t), read_operand(ip - sizeof(uint32_t)))
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    fprintf(out, __VA_ARGS__);                                                 \
+    ok = false;                                                                \
+    goto done;                                                                 \
+  } while (false)
+#define NUMERIC_OPERANDS()                                                     \
+  do {                                                                         \
+    if (!is_number(top[-2]) || !is_number(top[-1])) {                          \
+      RUNTIME_ERROR("operands should be numeric");                             \
+    }                                                                          \
+  } while (false)
+#define BINARY(make_value, operator)                                           \
+  do {                                                                         \
+    NUMERIC_OPERANDS();                                                        \
+    double right = as_number(POP());                                           \
+    top[-1] = make_value(as_number(top[-1]) operator right);                   \
+  } while (false)
+
+#if COMPUTED_GOTO
+  static const void *labels[] = {
+      [OP_CONSTANT] = &&L_OP_CONSTANT,
+      [OP_NIL] = &&L_OP_NIL,
+      [OP_GET_GLOBAL] = &&L_OP_GET_GLOBAL,
+      [OP_SET_GLOBAL] = &&L_OP_SET_GLOBAL,
+      [OP_DEFINE_GLOBAL] = &&L_OP_DEFINE_GLOBAL,
+      [OP_GET_LOCAL] = &&L_OP_GET_LOCAL,
+      [OP_SET_LOCAL] = &&L_OP_SET_LOCAL,
+      [OP_DEFINE_LOCAL] = &&L_OP_DEFINE_LOCAL,
+      [OP_SET_LOCAL_CELL] = &&L_OP_SET_LOCAL_CELL,
+      [OP_GET_UPVALUE] = &&L_OP_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&L_OP_SET_UPVALUE,
+      [OP_BOX] = &&L_OP_BOX,
+      [OP_UNBOX] = &&L_OP_UNBOX,
+      [OP_ADD] = &&L_OP_ADD,
+      [OP_SUBTRACT] = &&L_OP_SUBTRACT,
+      [OP_MULTIPLY] = &&L_OP_MULTIPLY,
+      [OP_DIVIDE] = &&L_OP_DIVIDE,
+      [OP_GREATER] = &&L_OP_GREATER,
+      [OP_GREATER_EQUAL] = &&L_OP_GREATER_EQUAL,
+      [OP_LESS] = &&L_OP_LESS,
+      [OP_LESS_EQUAL] = &&L_OP_LESS_EQUAL,
+      [OP_EQUAL] = &&L_OP_EQUAL,
+      [OP_NEGATE] = &&L_OP_NEGATE,
+      [OP_NOT] = &&L_OP_NOT,
+      [OP_PRINT] = &&L_OP_PRINT,
+      [OP_POP] = &&L_OP_POP,
+      [OP_JUMP] = &&L_OP_JUMP,
+      [OP_JUMP_IF_FALSE] = &&L_OP_JUMP_IF_FALSE,
+      [OP_CLOSURE] = &&L_OP_CLOSURE,
+      [OP_CALL] = &&L_OP_CALL,
+      [OP_TAIL_CALL] = &&L_OP_TAIL_CALL,
+      [OP_CLASS] = &&L_OP_CLASS,
+      [OP_GET_PROPERTY] = &&L_OP_GET_PROPERTY,
+      [OP_SET_PROPERTY] = &&L_OP_SET_PROPERTY,
+      [OP_INVOKE] = &&L_OP_INVOKE,
+      [OP_TAIL_INVOKE] = &&L_OP_TAIL_INVOKE,
+      [OP_GET_SUPER] = &&L_OP_GET_SUPER,
+      [OP_RETURN] = &&L_OP_RETURN,
+  };
+#define CASE(op) L_##op
+#define NEXT() goto *labels[*ip++]
+  NEXT(); // the switch only gives the labels a scope
+#else
+#define CASE(op) case op
+#define NEXT() goto dispatch
+dispatch:
+#endif
+
+  switch ((OpCode)*ip++) {
+  CASE(OP_CONSTANT):
+    PUSH(chunk->constants[OPERAND()]);
+    NEXT();
+  CASE(OP_NIL):
+    PUSH(NIL_VALUE);
+    NEXT();
+  CASE(OP_GET_GLOBAL):
+    PUSH(globals[OPERAND()].value);
+    NEXT();
+  CASE(OP_SET_GLOBAL):
+    globals[OPERAND()].value = top[-1];
+    top[-1] = NIL_VALUE;
+    NEXT();
+  CASE(OP_DEFINE_GLOBAL): {
+    uint32_t slot = OPERAND();
+    var_define(environment, slot, chunk->names[OPERAND()], POP());
+    NEXT();
+  }
+  CASE(OP_GET_LOCAL):
+    PUSH(locals[OPERAND()]);
+    NEXT();
+  CASE(OP_SET_LOCAL):
+    locals[OPERAND()] = top[-1];
+    top[-1] = NIL_VALUE;
+    NEXT();
+  CASE(OP_DEFINE_LOCAL):
+    locals[OPERAND()] = POP();
+    NEXT();
+  CASE(OP_SET_LOCAL_CELL):
+    as_cell(locals[OPERAND()])->value = top[-1];
+    top[-1] = NIL_VALUE;
+    NEXT();
+  CASE(OP_GET_UPVALUE):
+    PUSH(closure->upvalues[OPERAND()]);
+    NEXT();
+  CASE(OP_SET_UPVALUE):
+    as_cell(closure->upvalues[OPERAND()])->value = top[-1];
+    top[-1] = NIL_VALUE;
+    NEXT();
+  CASE(OP_BOX):
+    roots.top = top;
+    top[-1] = new_cell(heap, top[-1]);
+    NEXT();
+  CASE(OP_UNBOX):
+    top[-1] = as_cell(top[-1])->value;
+    NEXT();
+  CASE(OP_ADD):
+    if (is_string(top[-2]) && is_string(top[-1])) {
+      roots.top = top;
+      top--;
+      top[-1] = string_concat(heap, top[-1], top[0]);
+      if (is_nil(top[-1])) {
+        RUNTIME_ERROR("string too long");
+      }
+      NEXT();
+    }
+    BINARY(number_value, +);
+    NEXT();
+  CASE(OP_SUBTRACT):
+    BINARY(number_value, -);
+    NEXT();
+  CASE(OP_MULTIPLY):
+    BINARY(number_value, *);
+    NEXT();
+  CASE(OP_DIVIDE):
+    BINARY(number_value, /);
+    NEXT();
+  CASE(OP_GREATER):
+    BINARY(bool_value, >);
+    NEXT();
+  CASE(OP_GREATER_EQUAL):
+    BINARY(bool_value, >=);
+    NEXT();
+  CASE(OP_LESS):
+    BINARY(bool_value, <);
+    NEXT();
+  CASE(OP_LESS_EQUAL):
+    BINARY(bool_value, <=);
+    NEXT();
+  CASE(OP_EQUAL): {
+    Value right = POP();
+    top[-1] = bool_value(values_equal(top[-1], right));
+    NEXT();
+  }
+  CASE(OP_NEGATE):
+    if (!is_number(top[-1])) {
+      RUNTIME_ERROR("operands should be numeric");
+    }
+    top[-1] = number_value(-as_number(top[-1]));
+    NEXT();
+  CASE(OP_NOT):
+    top[-1] = bool_value(is_falsey(top[-1]));
+    NEXT();
+  CASE(OP_PRINT): {
+    Value value = POP();
+    if (!is_nil(value)) {
+      char buffer[VALUE_STRING_SIZE];
+      fprintf(out, "%s\n", value_string(value, buffer));
+    }
+    NEXT();
+  }
+  CASE(OP_POP):
+    top--;
+    NEXT();
+  CASE(OP_JUMP):
+    ip = chunk->code + read_operand(ip);
+    NEXT();
+  CASE(OP_JUMP_IF_FALSE): {
+    uint32_t target = OPERAND();
+    if (is_falsey(POP())) {
+      ip = chunk->code + target;
+    }
+    NEXT();
+  }
+  CASE(OP_CLOSURE): {
+    const Function *function = &chunk->functions[OPERAND()];
+    roots.top = top;
+    ObjClosure *made =
+        new_closure(heap, function, function->capture_count);
+    for (uint32_t i = 0; i < function->capture_count; i++) {
+      uint32_t capture = OPERAND();
+      made->upvalues[i] = capture & 1 ? locals[capture >> 1]
+                                      : closure->upvalues[capture >> 1];
+    }
+    PUSH(obj_value(&made->obj));
+    NEXT();
+  }
+  CASE(OP_TAIL_CALL):
+    call_count = OPERAND();
+    tail = true;
+    goto call;
+  CASE(OP_CALL):
+    call_count = OPERAND();
+    tail = false;
+    frames[frame_count - 1].ip = ip;
+  call: {
+    // a bound method runs with its receiver in the callee's slot, a class's
+    // init with a new instance there
+    Value *callee = top - call_count - 1;
+    if (is_closure(*callee)) {
+      callee_closure = as_closure(*callee);
+    } else if (is_bound_method(*callee)) {
+      callee_closure = as_bound_method(*callee)->method;
+      *callee = as_bound_method(*callee)->receiver;
+    } else if (is_class(*callee)) {
+      ObjClass *klass = as_class(*callee);
+      roots.top = top;
+      *callee = new_instance(heap, klass);
+      if (is_nil(klass->init)) {
+        if (call_count != 0) {
+          RUNTIME_ERROR("Expected 0 arguments but got %u", call_count);
+        }
+        top = callee + 1;
+        if (tail) {
+          goto leave;
+        }
+        NEXT();
+      }
+      callee_closure = as_closure(klass->init);
+    } else {
+      RUNTIME_ERROR("Can only call functions and classes");
+    }
+    goto run;
+  }
+  CASE(OP_TAIL_INVOKE):
+    tail = true;
+    goto invoke;
+  CASE(OP_INVOKE):
+    tail = false;
+  invoke: {
+    const char *name = chunk->names[OPERAND()];
+    PropertyCache *cache = &chunk->caches[OPERAND()];
+    call_count = OPERAND();
+    if (!tail) {
+      frames[frame_count - 1].ip = ip;
+    }
+    Value *receiver = top - call_count - 1;
+    if (!is_instance(*receiver)) {
+      RUNTIME_ERROR("Only instances have properties");
+    }
+    Value value;
+    switch (property_get(heap, cache, as_instance(*receiver), name, &value)) {
+    case PROPERTY_METHOD:
+      callee_closure = as_closure(value);
+      goto run;
+    case PROPERTY_FIELD:
+      *receiver = value;
+      goto call;
+    default:
+      RUNTIME_ERROR("Undefined property '%s'", name);
+    }
+  }
+  run: {
+    // callee_closure with the callee's slot and the arguments on top
+    if (tail) {
+      Value *from = top - call_count - 1;
+      // short, so a loop beats memmove
+      for (uint32_t i = 0; i <= call_count; i++) {
+        locals[i] = from[i];
+      }
+      top = locals + call_count + 1;
+      frame_count -= 1;
+    }
+    if (frame_count == CALL_DEPTH_MAX + 1) {
+      RUNTIME_ERROR("Stack overflow");
+    }
+    closure = callee_closure;
+    if (call_count != closure->function->arity) {
+      RUNTIME_ERROR("Expected %u arguments but got %u",
+                    closure->function->arity, call_count);
+    }
+    chunk = closure->function->code;
+    uint32_t base = top - call_count - 1 - roots.stack;
+    size_t size = (size_t)base + chunk->max_locals + chunk->max_stack;
+    if (size > capacity) {
+      grow_stack(&roots, &capacity, size);
+    }
+    locals = roots.stack + base;
+    for (uint32_t i = call_count + 1; i < chunk->max_locals; i++) {
+      locals[i] = NIL_VALUE;
+    }
+    top = locals + chunk->max_locals;
+    frames[frame_count++] = (CallFrame){chunk, NULL, base, closure};
+    ip = chunk->code;
+    NEXT();
+  }
+  CASE(OP_CLASS): {
+    const char *name = chunk->names[OPERAND()];
+    uint32_t count = OPERAND();
+    bool subclass = OPERAND();
+    Value *methods = top - count;
+    const ObjClass *superclass = NULL;
+    if (subclass) {
+      if (!is_class(methods[-1])) {
+        RUNTIME_ERROR("Superclass must be a class");
+      }
+      superclass = as_class(methods[-1]);
+    }
+    roots.top = top;
+    Value klass = new_class(heap, name, superclass, methods, count);
+    top = methods - subclass;
+    PUSH(klass);
+    NEXT();
+  }
+  CASE(OP_GET_PROPERTY): {
+    const char *name = chunk->names[OPERAND()];
+    PropertyCache *cache = &chunk->caches[OPERAND()];
+    if (!is_instance(top[-1])) {
+      RUNTIME_ERROR("Only instances have properties");
+    }
+    Value value;
+    switch (property_get(heap, cache, as_instance(top[-1]), name, &value)) {
+    case PROPERTY_FIELD:
+      top[-1] = value;
+      NEXT();
+    case PROPERTY_METHOD:
+      roots.top = top;
+      top[-1] = new_bound_method(heap, top[-1], as_closure(value));
+      NEXT();
+    default:
+      RUNTIME_ERROR("Undefined property '%s'", name);
+    }
+  }
+  CASE(OP_SET_PROPERTY): {
+    const char *name = chunk->names[OPERAND()];
+    PropertyCache *cache = &chunk->caches[OPERAND()];
+    if (!is_instance(top[-2])) {
+      RUNTIME_ERROR("Only instances have fields");
+    }
+    property_set(heap, cache, as_instance(top[-2]), name, top[-1]);
+    top -= 1;
+    top[-1] = NIL_VALUE;
+    NEXT();
+  }
+  CASE(OP_GET_SUPER): {
+    const char *name = chunk->names[OPERAND()];
+    Value method = class_method(as_class(top[-2]), name);
+    if (is_nil(method)) {
+      RUNTIME_ERROR("Undefined property '%s'", name);
+    }
+    roots.top = top;
+    Value bound = new_bound_method(heap, top[-1], as_closure(method));
+    top -= 1;
+    top[-1] = bound;
+    NEXT();
+  }
+  CASE(OP_RETURN):
+  leave: {
+    if (frame_count == 1) {
+      goto done;
+    }
+    Value result = top[-1];
+    top = locals;
+    const CallFrame *frame = &frames[--frame_count - 1];
+    chunk = frame->chunk;
+    ip = frame->ip;
+    locals = roots.stack + frame->locals;
+    closure = frame->closure;
+    PUSH(result);
+    NEXT();
+  }
+  default:
+    // every opcode the compiler emits has its case
+    RUNTIME_ERROR("unknown opcode %d", ip[-1]);
+  }
+
+done:
+  gc_pop_roots(heap);
+  free(roots.stack);
+  free(frames);
+  return ok;
+#undef PUSH
+#undef POP
+#undef OPERAND
+#undef RUNTIME_ERROR
+#undef NUMERIC_OPERANDS
+#undef BINARY
+#undef CASE
+#undef NEXT
+}
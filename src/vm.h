@@ -0,0 +1,11 @@
+#ifndef VM_H
+#define VM_H
+
+#include "chunk.h"
+#include "interpreter.h"
+
+// Runs a compiled script in environment, printing to out. Behaves like
+// interpret() on the AST the script was compiled from. Returns false if a
+// runtime error stopped execution.
+bool vm_run(VarMap *environment, const Chunk *script, FILE *out);
+#endif
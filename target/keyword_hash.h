@@ -0,0 +1,47 @@
+// Generated by tools/keywords_gen.c from src/keywords.h. Do not edit.
+#ifndef KEYWORD_HASH_H
+#define KEYWORD_HASH_H
+
+#include "tokens.h"
+#include <string.h>
+
+typedef struct {
+  const char *key;
+  int length;
+  TokenType type;
+} KeywordSlot;
+
+static const KeywordSlot keyword_slots[32] = {
+    [2] = {"else", 4, ELSE},
+    [3] = {"for", 3, FOR},
+    [4] = {"false", 5, FALSE},
+    [7] = {"class", 5, CLASS},
+    [9] = {"if", 2, IF},
+    [11] = {"or", 2, OR},
+    [13] = {"nil", 3, NIL},
+    [15] = {"fun", 3, FUN},
+    [17] = {"true", 4, TRUE},
+    [18] = {"super", 5, SUPER},
+    [19] = {"var", 3, VAR},
+    [21] = {"while", 5, WHILE},
+    [23] = {"this", 4, THIS},
+    [24] = {"and", 3, AND},
+    [25] = {"print", 5, PRINT},
+    [30] = {"return", 6, RETURN},
+};
+
+// Returns the keyword's type, or IDENTIFIER if the span is not a keyword.
+static inline TokenType keyword_type(const char *start, int length) {
+  if (length < 2 || length > 6) {
+    return IDENTIFIER;
+  }
+  unsigned first = (unsigned char)start[0];
+  unsigned last = (unsigned char)start[length - 1];
+  const KeywordSlot *slot =
+      &keyword_slots[(first * 1u + last * 5u + (unsigned)length) & 31u];
+  if (slot->length == length && memcmp(slot->key, start, length) == 0) {
+    return slot->type;
+  }
+  return IDENTIFIER;
+}
+#endif
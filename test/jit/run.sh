@@ -0,0 +1,23 @@
+#!/bin/sh
+# Differential test of the JIT: runs every script in this directory with
+# and without --jit at -O0 and -O2 and compares everything they print.
+# Where there's no JIT --jit changes nothing, and every script passes.
+# Usage: test/jit/run.sh [lox binary]
+lox=${1:-./target/lox}
+dir=$(dirname "$0")
+failed=0
+expected=$(mktemp)
+actual=$(mktemp)
+for script in "$dir"/*.lox; do
+  for level in -O0 -O2; do
+    "$lox" $level "$script" >"$expected" 2>&1
+    "$lox" --jit $level "$script" >"$actual" 2>&1
+    if ! cmp -s "$expected" "$actual"; then
+      echo "FAIL $script --jit $level"
+      failed=1
+    fi
+  done
+done
+rm -f "$expected" "$actual"
+[ $failed -eq 0 ] && echo "all JIT scripts match the interpreter"
+exit $failed
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Runs every script in this directory on each engine at -O0 and -O2 and
+# compares everything it prints, errors included, with <script>.out.
+# Usage: test/run.sh [lox binary] [extra options]
+lox=${1:-./target/lox}
+[ $# -gt 0 ] && shift
+dir=$(dirname "$0")
+failed=0
+for script in "$dir"/*.lox; do
+  expected="${script%.lox}.out"
+  for engine in tree vm closures; do
+    for level in -O0 -O2; do
+      if ! "$lox" --engine=$engine $level "$@" "$script" 2>&1 |
+        cmp -s - "$expected"; then
+        echo "FAIL $script --engine=$engine $level $*"
+        failed=1
+      fi
+    done
+  done
+done
+[ $failed -eq 0 ] && echo "all scripts passed"
+exit $failed
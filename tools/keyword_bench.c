@@ -0,0 +1,101 @@
+// Microbenchmark for the scanner's keyword lookup. Every identifier the
+// scanner finds is looked up, so this times both ways of doing it over the
+// same spans of a typical mix of keywords and names: the binary search the
+// scanner used before, which needed a NUL-terminated copy of the span, and
+// the generated perfect hash (target/keyword_hash.h), which reads the span
+// in place. Run with 'make bench'.
+#include "../src/keywords.h"
+#include "keyword_hash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define KEYWORD_COUNT (int)(sizeof(keywords) / sizeof(Item))
+#define SPANS 1000000
+#define ROUNDS 10
+
+static const char *names[] = {
+    "i",     "count", "total",   "result",  "node",   "left", "right",
+    "value", "fib",   "n",       "clock",   "person", "name", "x",
+    "y",     "returned", "printer", "whilst", "iffy", "nil0"};
+#define NAME_COUNT (int)(sizeof(names) / sizeof(names[0]))
+
+typedef struct {
+  const char *start;
+  int length;
+} Span;
+
+// The lookup before the perfect hash, as it was in scanner.h.
+static const TokenType *search_keyword(const char *start, int length) {
+  char *copy = malloc(length + 1);
+  memcpy(copy, start, length);
+  copy[length] = '\0';
+  int low = 0;
+  int high = KEYWORD_COUNT;
+  const TokenType *found = NULL;
+  while (low < high) {
+    int mid = (low + high) / 2;
+    int c = strcmp(keywords[mid].key, copy);
+    if (c == 0) {
+      found = &keywords[mid].value;
+      break;
+    }
+    if (c < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  free(copy);
+  return found;
+}
+
+static double seconds(void) {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(void) {
+  // one keyword in three, like ordinary Lox code
+  Span *spans = malloc(sizeof(Span) * SPANS);
+  srand(1);
+  for (int i = 0; i < SPANS; i++) {
+    const char *word = rand() % 3 == 0 ? keywords[rand() % KEYWORD_COUNT].key
+                                       : names[rand() % NAME_COUNT];
+    spans[i] = (Span){word, (int)strlen(word)};
+  }
+
+  unsigned long checksum = 0;
+  double start = seconds();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < SPANS; i++) {
+      const TokenType *type = search_keyword(spans[i].start, spans[i].length);
+      checksum += type == NULL ? IDENTIFIER : *type;
+    }
+  }
+  double before = seconds() - start;
+
+  start = seconds();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < SPANS; i++) {
+      checksum -= keyword_type(spans[i].start, spans[i].length);
+    }
+  }
+  double after = seconds() - start;
+
+  double lookups = (double)SPANS * ROUNDS / 1e6;
+  printf("keyword lookup, %.0fM identifiers:\n", lookups);
+  printf("  binary search on a copy  %7.3f s  %7.1f M/s\n", before,
+         lookups / before);
+  printf("  perfect hash on the span %7.3f s  %7.1f M/s\n", after,
+         lookups / after);
+  free(spans);
+  // both lookups agree if everything added was taken away again
+  if (checksum != 0) {
+    fprintf(stderr, "the lookups disagree\n");
+    return 1;
+  }
+  return 0;
+}
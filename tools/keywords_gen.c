@@ -0,0 +1,87 @@
+// Build-time generator for the scanner's keyword lookup. It searches for a
+// hash over (length, first char, last char) that puts every keyword of
+// src/keywords.h in its own slot of a small power-of-two table, and prints
+// the table and lookup function as a C header on stdout.
+#include "../src/keywords.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define KEYWORD_COUNT (int)(sizeof(keywords) / sizeof(Item))
+
+static unsigned hash(unsigned a, unsigned b, const char *key, int size) {
+  int length = (int)strlen(key);
+  unsigned first = (unsigned char)key[0];
+  unsigned last = (unsigned char)key[length - 1];
+  return (first * a + last * b + (unsigned)length) & (unsigned)(size - 1);
+}
+
+static bool is_perfect(unsigned a, unsigned b, int size) {
+  bool used[256] = {false};
+  for (int i = 0; i < KEYWORD_COUNT; i++) {
+    unsigned slot = hash(a, b, keywords[i].key, size);
+    if (used[slot]) {
+      return false;
+    }
+    used[slot] = true;
+  }
+  return true;
+}
+
+int main(void) {
+  for (int size = 16; size <= 256; size *= 2) {
+    if (size < KEYWORD_COUNT) {
+      continue;
+    }
+    for (unsigned a = 1; a < 256; a++) {
+      for (unsigned b = 0; b < 256; b++) {
+        if (!is_perfect(a, b, size)) {
+          continue;
+        }
+
+        int min_length = 255, max_length = 0;
+        const Item *slots[256] = {NULL};
+        for (int i = 0; i < KEYWORD_COUNT; i++) {
+          int length = (int)strlen(keywords[i].key);
+          min_length = length < min_length ? length : min_length;
+          max_length = length > max_length ? length : max_length;
+          slots[hash(a, b, keywords[i].key, size)] = &keywords[i];
+        }
+
+        printf("// Generated by tools/keywords_gen.c from src/keywords.h. "
+               "Do not edit.\n");
+        printf("#ifndef KEYWORD_HASH_H\n#define KEYWORD_HASH_H\n\n");
+        printf("#include \"tokens.h\"\n#include <string.h>\n\n");
+        printf("typedef struct {\n  const char *key;\n  int length;\n"
+               "  TokenType type;\n} KeywordSlot;\n\n");
+        printf("static const KeywordSlot keyword_slots[%d] = {\n", size);
+        for (int i = 0; i < size; i++) {
+          if (slots[i] != NULL) {
+            printf("    [%d] = {\"%s\", %d, %s},\n", i, slots[i]->key,
+                   (int)strlen(slots[i]->key), token_name(slots[i]->value));
+          }
+        }
+        printf("};\n\n");
+        printf("// Returns the keyword's type, or IDENTIFIER if the span is "
+               "not a keyword.\n");
+        printf("static inline TokenType keyword_type(const char *start, "
+               "int length) {\n");
+        printf("  if (length < %d || length > %d) {\n    return IDENTIFIER;\n"
+               "  }\n",
+               min_length, max_length);
+        printf("  unsigned first = (unsigned char)start[0];\n");
+        printf("  unsigned last = (unsigned char)start[length - 1];\n");
+        printf("  const KeywordSlot *slot =\n      &keyword_slots[(first * %uu "
+               "+ last * %uu + (unsigned)length) & %du];\n",
+               a, b, size - 1);
+        printf("  if (slot->length == length && "
+               "memcmp(slot->key, start, length) == 0) {\n"
+               "    return slot->type;\n  }\n");
+        printf("  return IDENTIFIER;\n}\n#endif\n");
+        return 0;
+      }
+    }
+  }
+  fprintf(stderr, "no perfect hash found for the keyword table\n");
+  return 1;
+}